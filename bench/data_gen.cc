@@ -0,0 +1,323 @@
+#include "rec/bench/data_gen.h"
+
+#include <algorithm>
+#include <cmath>
+#include <ctime>
+
+#include <google/protobuf/descriptor.h>
+#include <google/protobuf/reflection.h>
+
+namespace ad {
+namespace bench {
+
+using google::protobuf::FieldDescriptor;
+using google::protobuf::Message;
+
+
+DataGenerator::DataGenerator(const DataGenOptions& options)
+  : options_(options),
+    rng_(options.seed) {
+  options_.store_ads = std::max<size_t>(options_.store_ads, 1);
+  options_.packages = std::max<size_t>(options_.packages, 1);
+  options_.categories = std::max<size_t>(options_.categories, 1);
+  options_.apps = std::max<size_t>(options_.apps, 1);
+  options_.pos_ids = std::max<size_t>(options_.pos_ids, 1);
+}
+
+
+int64_t DataGenerator::AdId(size_t ad) {
+  return 100000 + ad;
+}
+
+
+std::string DataGenerator::Package(size_t ad) const {
+  return "com.bench.pkg" + std::to_string(ad % options_.packages);
+}
+
+
+// 同一包名的广告属于同一类目
+std::string DataGenerator::Category(size_t ad) const {
+  return "cate" + std::to_string(ad % options_.packages % options_.categories);
+}
+
+
+std::string DataGenerator::App(size_t i) const {
+  return "com.bench.app" + std::to_string(i % options_.apps);
+}
+
+
+std::string DataGenerator::PosId(size_t i) const {
+  return std::to_string(1000 + i % options_.pos_ids);
+}
+
+
+std::string DataGenerator::CreativeId(size_t ad, size_t j) {
+  return std::to_string(AdId(ad)) + "_" + std::to_string(j);
+}
+
+
+// 曝光数按对数均匀分布，scale为量级上限；CTR约0.5%~5%，CVR约2%~10%
+CountFeatures DataGenerator::Counts(double scale) {
+  std::uniform_real_distribution<double> unit(0.0, 1.0);
+  CountFeatures count;
+  double imp_7d = std::exp(unit(rng_) * std::log(scale));
+  double ctr = 0.005 + unit(rng_) * 0.045;
+  double cvr = 0.02 + unit(rng_) * 0.08;
+  double shares[] = {1.0 / 7, 3.0 / 7, 1.0};
+  decltype(count.mutable_count_features_1d()) windows[] = {
+    count.mutable_count_features_1d(), count.mutable_count_features_3d(),
+    count.mutable_count_features_7d()};
+  for (int w = 0; w < 3; ++w) {
+    double imp = imp_7d * shares[w];
+    double click = imp * ctr;
+    windows[w]->set_imp(imp);
+    windows[w]->set_click(click);
+    windows[w]->set_attr_install(click * cvr);
+  }
+  count.mutable_count_features_bj_1d()->CopyFrom(count.count_features_1d());
+  return count;
+}
+
+
+StoreAdInfo DataGenerator::AdInfo() {
+  std::uniform_real_distribution<double> unit(0.0, 1.0);
+  StoreAdInfo store;
+  auto& infos = *store.mutable_ad_infos();
+  int64_t now = time(nullptr);
+  for (size_t ad = 0; ad < options_.store_ads; ++ad) {
+    infos[Package(ad)].set_category(Category(ad));
+    if (unit(rng_) < options_.capped_ratio * 2) {
+      // 一半设置了cap的广告已超预算，见AdCounter
+      infos["ad_id#" + std::to_string(AdId(ad))].set_day_attr_install_cap(
+        ad % 2 == 0 ? 1 : 1000000);
+    }
+    for (size_t j = 0; j < options_.creatives_per_ad; ++j) {
+      // 约1/5的素材在3天内创建，走新广告逻辑
+      int64_t age = unit(rng_) < 0.2 ? unit(rng_) * 3 * 86400 :
+        3 * 86400 + unit(rng_) * 60 * 86400;
+      infos["c_id#" + CreativeId(ad, j)].set_creative_create_time(now - age);
+    }
+  }
+  return store;
+}
+
+
+StoreAdCounter DataGenerator::AdCounter() {
+  std::uniform_real_distribution<double> unit(0.0, 1.0);
+  StoreAdCounter store;
+  auto& counters = *store.mutable_store_ad_counter();
+  auto add = [&] (const std::string& key, double scale) {
+    if (unit(rng_) < options_.counter_fill && counters.count(key) == 0) {
+      counters[key] = Counts(scale);
+    }
+  };
+  for (size_t ad = 0; ad < options_.store_ads; ++ad) {
+    auto ad_id = std::to_string(AdId(ad));
+    add("ad_id#" + ad_id, 1e6);
+    if (ad % 2 == 0) {
+      // cap为1的广告当日安装数超过cap
+      counters["ad_id#" + ad_id].mutable_count_features_bj_1d()->
+        set_attr_install(2);
+    }
+    for (size_t p = 0; p < options_.pos_ids; ++p) {
+      auto pos = PosId(p);
+      add("pos_id#ad_id#" + pos + "#" + ad_id, 1e5);
+      add("pos_id#ad_package_name#" + pos + "#" + Package(ad), 1e5);
+      add("pos_id#ad_package_category#" + pos + "#" + Category(ad), 1e6);
+      for (size_t j = 0; j < options_.creatives_per_ad; ++j) {
+        add("pos_id#c_id#" + pos + "#" + CreativeId(ad, j), 1e4);
+      }
+    }
+    for (size_t a = 0; a < options_.apps; ++a) {
+      auto app = App(a);
+      add("package_name#ad_package_name#" + app + "#" + Package(ad), 1e5);
+      add("package_name#ad_package_category#" + app + "#" + Category(ad),
+        1e6);
+      for (size_t j = 0; j < options_.creatives_per_ad; ++j) {
+        add("package_name#c_id#" + app + "#" + CreativeId(ad, j), 1e4);
+      }
+    }
+  }
+  return store;
+}
+
+
+ad_model::AdRequest DataGenerator::Request(const std::string& user_id) {
+  ad_model::AdRequest ad_request;
+  auto& request = *ad_request.mutable_request();
+  request.set_request_id("bench-" + std::to_string(rng_()));
+  request.set_user_id(user_id);
+  request.set_pos_id(PosId(rng_()));
+  request.set_user_ip("10.0.0.1");
+  auto& contexts = *request.mutable_contexts();
+  contexts.set_network_type(1);
+  contexts.set_os_version("10");
+  contexts.set_brand("bench");
+  contexts.set_model("bench-1");
+  contexts.set_language("en");
+  contexts.set_app_version_code(100);
+  contexts.set_package_name(App(rng_()));
+  contexts.set_floor_price(0.01);
+  contexts.set_ad_count(10);
+
+  // 不重复地取request_ads个广告
+  std::vector<size_t> ads(options_.store_ads);
+  for (size_t i = 0; i < ads.size(); ++i) {
+    ads[i] = i;
+  }
+  auto count = std::min(options_.request_ads, ads.size());
+  for (size_t i = 0; i < count; ++i) {
+    std::swap(ads[i], ads[i + rng_() % (ads.size() - i)]);
+  }
+  std::uniform_real_distribution<double> bid(0.5, 5.0);
+  for (size_t i = 0; i < count; ++i) {
+    auto ad = ads[i];
+    auto& creatives = *request.add_creatives();
+    creatives.set_camp_id(AdId(ad));
+    creatives.set_app_id(Package(ad));
+    creatives.set_attr_platform(1);
+    creatives.set_is_auto_download(ad % 2);
+    creatives.set_bid_price(bid(rng_));
+    for (size_t j = 0; j < options_.creatives_per_ad; ++j) {
+      auto& creative = *creatives.add_creative();
+      creative.set_creative_id(CreativeId(ad, j));
+      creative.set_cp_id("cp" + std::to_string(ad % 100));
+    }
+  }
+  return ad_request;
+}
+
+
+// 依次为请求中的广告生成各类user级计数项，直到user_counter_keys个
+StoreUserCounter DataGenerator::UserCounter(
+    const ad_model::AdRequest& ad_request) {
+  const auto& request = ad_request.request();
+  const auto& user_id = request.user_id();
+  const auto& pos = request.pos_id();
+  StoreUserCounter store;
+  auto& counters = *store.mutable_store_user_counter();
+  counters["user_id#" + user_id] = Counts(1e3);
+  for (int i = 0; i < request.creatives_size() &&
+      counters.size() < options_.user_counter_keys; ++i) {
+    const auto& creatives = request.creatives(i);
+    auto ad_id = std::to_string(creatives.camp_id());
+    auto cate = Category(creatives.camp_id() - AdId(0));
+    counters["user_id#ad_id#" + user_id + "#" + ad_id] = Counts(20);
+    counters["user_id#ad_package_name#" + user_id + "#" +
+      creatives.app_id()] = Counts(20);
+    counters["user_id#ad_package_category#" + user_id + "#" + cate] =
+      Counts(50);
+    counters["user_id#pos_id#ad_id#" + user_id + "#" + pos + "#" + ad_id] =
+      Counts(10);
+    counters["user_id#pos_id#ad_package_name#" + user_id + "#" + pos + "#" +
+      creatives.app_id()] = Counts(10);
+    for (const auto& creative : creatives.creative()) {
+      counters["user_id#c_id#" + user_id + "#" + creative.creative_id()] =
+        Counts(10);
+      counters["user_id#pos_id#c_id#" + user_id + "#" + pos + "#" +
+        creative.creative_id()] = Counts(5);
+    }
+  }
+  return store;
+}
+
+
+// 标量字段填随机值，repeated标量字段填seq_len个，子消息递归填充
+static void FillMessage(Message& message, size_t seq_len,
+    std::mt19937_64& rng, int depth) {
+  const auto* descriptor = message.GetDescriptor();
+  const auto* reflection = message.GetReflection();
+  for (int i = 0; i < descriptor->field_count(); ++i) {
+    const auto* field = descriptor->field(i);
+    size_t n = field->is_repeated() ? seq_len : 1;
+    for (size_t k = 0; k < n; ++k) {
+      bool repeated = field->is_repeated();
+      switch (field->cpp_type()) {
+        case FieldDescriptor::CPPTYPE_INT32:
+          repeated ? reflection->AddInt32(&message, field, rng() % 1000) :
+            reflection->SetInt32(&message, field, rng() % 1000);
+          break;
+        case FieldDescriptor::CPPTYPE_INT64:
+          repeated ? reflection->AddInt64(&message, field, rng() % 1000000) :
+            reflection->SetInt64(&message, field, rng() % 1000000);
+          break;
+        case FieldDescriptor::CPPTYPE_UINT32:
+          repeated ? reflection->AddUInt32(&message, field, rng() % 1000) :
+            reflection->SetUInt32(&message, field, rng() % 1000);
+          break;
+        case FieldDescriptor::CPPTYPE_UINT64:
+          repeated ? reflection->AddUInt64(&message, field, rng() % 1000000) :
+            reflection->SetUInt64(&message, field, rng() % 1000000);
+          break;
+        case FieldDescriptor::CPPTYPE_FLOAT:
+          repeated ? reflection->AddFloat(&message, field, rng() % 1000 / 1e3) :
+            reflection->SetFloat(&message, field, rng() % 1000 / 1e3);
+          break;
+        case FieldDescriptor::CPPTYPE_DOUBLE:
+          repeated ? reflection->AddDouble(&message, field, rng() % 1000 / 1e3) :
+            reflection->SetDouble(&message, field, rng() % 1000 / 1e3);
+          break;
+        case FieldDescriptor::CPPTYPE_BOOL:
+          repeated ? reflection->AddBool(&message, field, rng() % 2) :
+            reflection->SetBool(&message, field, rng() % 2);
+          break;
+        case FieldDescriptor::CPPTYPE_STRING: {
+          auto value = "v" + std::to_string(rng() % 10000);
+          repeated ? reflection->AddString(&message, field, value) :
+            reflection->SetString(&message, field, value);
+          break;
+        }
+        case FieldDescriptor::CPPTYPE_ENUM: {
+          const auto* value = field->enum_type()->value(
+            rng() % field->enum_type()->value_count());
+          repeated ? reflection->AddEnum(&message, field, value) :
+            reflection->SetEnum(&message, field, value);
+          break;
+        }
+        case FieldDescriptor::CPPTYPE_MESSAGE:
+          // map和深层嵌套的消息不展开
+          if (depth < 3 && !field->is_map()) {
+            FillMessage(repeated ? *reflection->AddMessage(&message, field) :
+              *reflection->MutableMessage(&message, field), seq_len, rng,
+              depth + 1);
+          }
+          break;
+      }
+    }
+  }
+}
+
+
+StoreUserProfile DataGenerator::UserProfile() {
+  StoreUserProfile profile;
+  FillMessage(*profile.mutable_user_base(), 1, rng_, 0);
+  FillMessage(*profile.mutable_user_behavior(), options_.seq_len, rng_, 0);
+  return profile;
+}
+
+
+std::shared_ptr<TfModel> DataGenerator::Model(const FeatureResult& sample,
+    int64_t buckets) const {
+  auto model = std::make_shared<TfModel>();
+  auto add = [&model] (const std::string& name, const char* type,
+      int64_t max_length, int64_t seq_length) {
+    auto& item = model->dnn_dict[name];
+    item.field_name = name;
+    item.field_type = type;
+    item.field_max_length = max_length;
+    item.field_seq_length = seq_length;
+  };
+  for (const auto& p : sample.int_features) {
+    add(p.first, "int", buckets, 1);
+  }
+  for (const auto& p : sample.float_features) {
+    add(p.first, "float", 0, 1);
+  }
+  for (const auto& p : sample.sequence_features) {
+    add(p.first, "sequence", buckets, options_.seq_len);
+  }
+  return model;
+}
+
+}  // end of namespace
+}  // end of namespace
@@ -0,0 +1,69 @@
+#pragma once
+
+#include <cstdint>
+#include <memory>
+#include <random>
+#include <string>
+#include <vector>
+
+#include "ad_model_service.pb.h"
+#include "ads_feature.h"
+#include "store_table.pb.h"
+#include "tf/tf_model.h"
+
+namespace ad {
+namespace bench {
+
+// 合成数据的规模。广告目录中的广告编号为[0, store_ads)，
+// 包名、类目、流量方包名和pos_id按编号取模分配，同一种子生成的数据完全相同
+struct DataGenOptions {
+  size_t store_ads = 5000;      // ad_info/ad_counter中的广告数
+  size_t creatives_per_ad = 3;
+  size_t packages = 1000;       // 广告包名数
+  size_t categories = 30;
+  size_t apps = 10;             // 流量方包名数
+  size_t pos_ids = 5;
+  size_t request_ads = 100;     // 一次请求中的广告数，取自广告目录
+  size_t user_counter_keys = 300;
+  size_t seq_len = 50;          // user_behavior中各序列的长度
+  double counter_fill = 0.8;    // 广告侧计数项存在的比例
+  double capped_ratio = 0.02;   // 设置了cap且已超预算的广告比例
+  uint64_t seed = 1;
+};
+
+
+// 生成与线上格式一致的store数据和请求；sharestore和tf-serving由调用方替换
+class DataGenerator {
+ public:
+  explicit DataGenerator(const DataGenOptions& options);
+
+  const DataGenOptions& options() const { return options_; }
+
+  StoreAdInfo AdInfo();
+  StoreAdCounter AdCounter();
+  // 请求中的广告随机取自目录，用户数据按请求生成，查找时大部分能命中
+  ad_model::AdRequest Request(const std::string& user_id);
+  StoreUserCounter UserCounter(const ad_model::AdRequest& request);
+  // user_base和user_behavior按消息定义用反射填充，不依赖具体字段
+  StoreUserProfile UserProfile();
+  // 按一个候选的抽取结果合成模型：每个int、float、序列特征各对应一个同名
+  // 字段，int和序列按buckets取模，序列长度为seq_len
+  std::shared_ptr<TfModel> Model(const FeatureResult& sample,
+      int64_t buckets) const;
+
+  static int64_t AdId(size_t ad);
+  std::string Package(size_t ad) const;
+  std::string Category(size_t ad) const;
+  std::string App(size_t i) const;
+  std::string PosId(size_t i) const;
+  static std::string CreativeId(size_t ad, size_t j);
+
+ private:
+  CountFeatures Counts(double scale);
+
+  DataGenOptions options_;
+  std::mt19937_64 rng_;
+};
+
+}  // end of namespace
+}  // end of namespace
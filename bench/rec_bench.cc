@@ -0,0 +1,741 @@
+// 排序主路径的微基准，基于Google Benchmark。数据由DataGenerator按固定种子合成，
+// sharestore、tf-serving和metis分别经UserDataCache::SetFetchFn、
+// TfAsyncClient::SetPredictFn和MetisLogger::SetSendFn替换为桩，不访问网络；
+// CTR、CVR模型由DataGenerator按合成特征生成，经SetTfModelFn注册。
+// 用法:
+//   rec_bench [--benchmark_filter=<regex>]
+//       [--benchmark_out=<result.json> --benchmark_out_format=json]
+// 两次提交的json结果用Google Benchmark的tools/compare.py对比。
+
+#include <stdlib.h>
+#include <sys/stat.h>
+
+#include <algorithm>
+#include <atomic>
+#include <cstdio>
+#include <fstream>
+#include <map>
+#include <mutex>
+#include <new>
+#include <random>
+#include <string>
+#include <vector>
+
+#include <benchmark/benchmark.h>
+#include <google/protobuf/stubs/logging.h>
+
+#include "ads_feature.h"
+#include "feature/ad_cap.h"
+#include "feature/feature.h"
+#include "rec/bench/data_gen.h"
+#include "rec/explore.h"
+#include "rec/metis_log.h"
+#include "rec/parallel_for.h"
+#include "rec/rec.h"
+#include "rec/request_arena.h"
+#include "rec/tf_predict.h"
+#include "rec/user_cache.h"
+
+// 统计进程内经operator new的堆分配次数和字节数（含后台线程），
+// BM_Recommend据此报告每个请求的分配量
+static std::atomic<int64_t> heap_allocs{0};
+static std::atomic<int64_t> heap_bytes{0};
+
+void* operator new(size_t size) {
+  heap_allocs.fetch_add(1, std::memory_order_relaxed);
+  heap_bytes.fetch_add(size, std::memory_order_relaxed);
+  void* p = malloc(size != 0 ? size : 1);
+  if (p == nullptr) {
+    throw std::bad_alloc();
+  }
+  return p;
+}
+
+void* operator new[](size_t size) {
+  return operator new(size);
+}
+
+void operator delete(void* p) noexcept {
+  free(p);
+}
+
+void operator delete[](void* p) noexcept {
+  free(p);
+}
+
+void operator delete(void* p, size_t) noexcept {
+  free(p);
+}
+
+void operator delete[](void* p, size_t) noexcept {
+  free(p);
+}
+
+namespace ad {
+
+// 访问AdRec的私有步骤
+class AdRecBench {
+ public:
+  // 与Recommend的前几步相同：取用户数据、过滤、组装Feature
+  static bool Prepare(AdRec& rec, const AdInfoSnapshot& ad_info,
+      const AdCounterSnapshot& ad_counter) {
+    rec.user_data_ = UserDataCache::Instance().Get(
+      rec.request_->request().user_id());
+    rec.stats_prior_ = ad_counter.prior;
+    auto ads = rec.SelectUncappedAds(ad_info, ad_counter);
+    return DataToFeatureInput(*rec.request_, ads,
+      rec.user_data_->counter_index, *rec.user_data_->profile, ad_info,
+      ad_counter, rec.request_feature_, rec.raw_features_);
+  }
+
+  // 登记模型的填充计划并抽取特征；返回模型的填充计划，未加载时为nullptr
+  static const FeatureFillPlan* Extract(AdRec& rec,
+      const std::string& model_name) {
+    rec.PrepareFillPlans();
+    rec.model_features_ = FeatureExtract(rec.request_feature_,
+      rec.raw_features_, false, rec.dense_layout_, rec.dense_features_);
+    auto it = rec.fill_plans_.find(model_name);
+    return it != rec.fill_plans_.end() && it->second.plan != nullptr &&
+      it->second.plan->valid() ? it->second.plan.get() : nullptr;
+  }
+
+  // 登记模型的填充计划，返回由其构建的稠密特征布局
+  static const DenseLayout& PrepareLayout(AdRec& rec) {
+    rec.PrepareFillPlans();
+    return rec.dense_layout_;
+  }
+
+  static std::vector<int32_t> SelectUncappedAds(AdRec& rec,
+      const AdInfoSnapshot& ad_info, const AdCounterSnapshot& ad_counter) {
+    return rec.SelectUncappedAds(ad_info, ad_counter);
+  }
+
+  static bool FillScore(AdRec& rec, const std::vector<double>& ctr,
+      const std::vector<double>& cvr, ScoredAds& scored,
+      metis::ReqAds& req_ads) {
+    return rec.FillScore(ctr, cvr, rec.request_->request(), false, false,
+      scored, req_ads);
+  }
+
+  static RequestFeature& request_feature(AdRec& rec) {
+    return rec.request_feature_;
+  }
+  static const FeatureList& features(const AdRec& rec) {
+    return rec.raw_features_;
+  }
+  static const std::vector<DenseFeatures>& dense(const AdRec& rec) {
+    return rec.dense_features_;
+  }
+};
+
+namespace bench {
+namespace {
+
+const std::string kCtrModel = "dnn_model_t1";
+const std::string kCvrModel = "dnn_model_cvr_t1";
+
+
+// 一次请求及其用户数据
+struct BenchRequest {
+  ad_model::AdRequest request;
+  std::string counter;  // 序列化的StoreUserCounter
+  std::string profile;  // 序列化的StoreUserProfile
+};
+
+
+// 进程内共用的数据：ad_info/ad_counter写到临时目录后经InitFeature加载，
+// 与线上的加载路径一致；请求按广告数生成一次后复用
+class BenchEnv {
+ public:
+  static BenchEnv& Get() {
+    static BenchEnv env;
+    return env;
+  }
+
+  const BenchRequest& Request(size_t ads) {
+    std::lock_guard<std::mutex> lock(mutex_);
+    auto it = requests_.find(ads);
+    if (it == requests_.end()) {
+      auto options = generator_.options();
+      options.request_ads = ads;
+      options.seed += ads;
+      DataGenerator generator(options);
+      BenchRequest data;
+      data.request = generator.Request("bench_user_" + std::to_string(ads));
+      data.counter = generator.UserCounter(data.request).SerializeAsString();
+      data.profile = generator.UserProfile().SerializeAsString();
+      it = requests_.emplace(ads, std::move(data)).first;
+    }
+    return it->second;
+  }
+
+  std::shared_ptr<AdInfoSnapshot> ad_info() const { return GetStoreAdInfo(); }
+  std::shared_ptr<AdCounterSnapshot> ad_counter() const {
+    return GetStoreAdCounter();
+  }
+  bool ok() const { return ok_; }
+
+ private:
+  BenchEnv() : generator_(DataGenOptions()) {
+    char dir[] = "/tmp/rec_bench.XXXXXX";
+    if (mkdtemp(dir) == nullptr) {
+      return;
+    }
+    std::string sub_dir = std::string(dir) + "/bench";
+    mkdir(sub_dir.c_str(), 0755);
+    std::ofstream(sub_dir + "/ad_info.pb") <<
+      generator_.AdInfo().SerializeAsString();
+    std::ofstream(sub_dir + "/ad_counter.pb") <<
+      generator_.AdCounter().SerializeAsString();
+    nlohmann::json conf = {
+      {"data_path", dir},
+      {"s3", {{"sub_dir", "bench"},
+        {"data", {{"ad_info", "ad_info"}, {"ad_counter", "ad_counter"}}}}},
+    };
+    ok_ = InitFeature(conf);
+
+    UserDataCache::Instance().SetFetchFn(
+      [this] (const std::string& user_id, std::string* counter,
+          std::string* profile) {
+        std::lock_guard<std::mutex> lock(mutex_);
+        for (const auto& p : requests_) {
+          if (p.second.request.request().user_id() == user_id) {
+            *counter = p.second.counter;
+            *profile = p.second.profile;
+            return true;
+          }
+        }
+        return false;
+      });
+    // 按输入的第0维返回同样行数的分数
+    TfAsyncClient::Instance().SetPredictFn(
+      [] (const tensorflow::serving::PredictRequest& request,
+          tensorflow::serving::PredictResponse& response) {
+        int64_t rows = 0;
+        if (!request.inputs().empty()) {
+          rows = request.inputs().begin()->second.tensor_shape().dim(0).size();
+        }
+        auto& output = (*response.mutable_outputs())["predictions"];
+        output.set_dtype(tensorflow::DataType::DT_FLOAT);
+        for (int64_t i = 0; i < rows; ++i) {
+          output.add_float_val(0.001f * (i % 100 + 1));
+        }
+        return true;
+      });
+    MetisLogger::Instance().SetSendFn(
+      [] (const metis::RecAds& rec_ads, const metis::ReqAds& req_ads) {
+        benchmark::DoNotOptimize(rec_ads.ByteSizeLong() +
+          req_ads.ByteSizeLong());
+      });
+    if (ok_) {
+      RegisterModels();
+    }
+  }
+
+  // 按一个请求中首个候选的完整抽取结果合成CTR、CVR模型，替换模型来源。
+  // 两个模型的哈希桶数不同，请求内只有float字段共用编码，与线上相近
+  void RegisterModels() {
+    const auto& data = Request(DataGenOptions().request_ads);
+    AdRec rec(&data.request);
+    if (!AdRecBench::Prepare(rec, *ad_info(), *ad_counter()) ||
+        AdRecBench::features(rec).empty()) {
+      return;
+    }
+    ModelFeature mf;
+    auto sample = mf.extract_feature(AdRecBench::features(rec)[0]);
+    std::map<std::string, TfModelPtr> models = {
+      {kCtrModel, generator_.Model(*sample, 1 << 20)},
+      {kCvrModel, generator_.Model(*sample, 1 << 18)},
+    };
+    SetTfModelFn([models] (const std::string& model_name) -> TfModelPtr {
+      auto it = models.find(model_name);
+      return it != models.end() ? it->second : nullptr;
+    });
+  }
+
+  DataGenerator generator_;
+  bool ok_ = false;
+  std::mutex mutex_;
+  std::map<size_t, BenchRequest> requests_;
+};
+
+
+// 请求中的广告数，每个广告3个素材
+void CandidateArgs(benchmark::internal::Benchmark* b) {
+  for (int ads : {10, 50, 100, 300, 1000}) {
+    b->Arg(ads);
+  }
+  b->Unit(benchmark::kMicrosecond);
+}
+
+
+// 已完成Prepare的AdRec
+struct PreparedRec {
+  explicit PreparedRec(size_t ads)
+    : data(BenchEnv::Get().Request(ads)),
+      ad_info(BenchEnv::Get().ad_info()),
+      ad_counter(BenchEnv::Get().ad_counter()),
+      rec(&data.request),
+      ok(BenchEnv::Get().ok() &&
+        AdRecBench::Prepare(rec, *ad_info, *ad_counter)) {
+  }
+
+  const BenchRequest& data;
+  std::shared_ptr<AdInfoSnapshot> ad_info;
+  std::shared_ptr<AdCounterSnapshot> ad_counter;
+  AdRec rec;
+  bool ok;
+};
+
+
+void SetCandidates(benchmark::State& state, size_t candidates) {
+  state.counters["candidates"] = candidates;
+  state.SetItemsProcessed(state.iterations() * candidates);
+}
+
+/* ========================================================================== */
+
+// BuildFromWire成功且blob能被protobuf解析时，两种索引须查到相同的计数；
+// 不一致时返回原因。BuildFromWire失败时UserDataCache改用protobuf解析，
+// 只有must_build（未损坏的blob）时才算错误；protobuf解析失败的blob
+// 不比较：wire索引只在查到时才解析value，可以接受其中损坏的部分
+std::string WireIndexDiff(const std::string& blob, int field,
+    bool must_build) {
+  CounterIndex wire;
+  if (!wire.BuildFromWire(blob, field)) {
+    return must_build ? "BuildFromWire failed" : std::string();
+  }
+  StoreUserCounter counter;
+  if (!counter.ParseFromString(blob)) {
+    return std::string();
+  }
+  CounterIndex parsed(counter.store_user_counter());
+  if (wire.size() != parsed.size()) {
+    return "size " + std::to_string(wire.size()) + " != " +
+      std::to_string(parsed.size());
+  }
+  for (const auto& p : counter.store_user_counter()) {
+    KeyHash hash;
+    if (!ParseCounterKey(p.first, &hash)) {
+      continue;
+    }
+    CountFeatures from_wire;
+    CountFeatures from_map;
+    auto ref = wire.Find(hash);
+    if (!ref || !ref.CopyTo(&from_wire) ||
+        !parsed.Find(hash).CopyTo(&from_map) ||
+        from_wire.SerializeAsString() != from_map.SerializeAsString()) {
+      return "value differs, key=" + p.first;
+    }
+  }
+  return std::string();
+}
+
+
+// 在若干种子生成的user counter上，原样、随机截断、随机改写字节及两段拼接
+// （同一key以后出现的为准）后比较两种索引，不一致时终止，避免测出错误实现的耗时
+void VerifyWireIndex(int field) {
+  static std::once_flag once;
+  std::call_once(once, [field] {
+    // 损坏的key不是合法UTF-8时protobuf逐条打日志
+    google::protobuf::LogSilencer silencer;
+    std::mt19937_64 rng(17);
+    for (uint64_t seed = 1; seed <= 8; ++seed) {
+      auto options = DataGenOptions();
+      options.seed = seed;
+      options.request_ads = 50;
+      DataGenerator generator(options);
+      auto request = generator.Request("wire_user");
+      auto blob = generator.UserCounter(request).SerializeAsString();
+      // 前两项未损坏
+      std::vector<std::string> cases = {blob, blob + blob};
+      for (int i = 0; i < 200; ++i) {
+        cases.push_back(blob.substr(0, rng() % (blob.size() + 1)));
+        auto flipped = blob;
+        for (int n = rng() % 3 + 1; n > 0; --n) {
+          flipped[rng() % flipped.size()] ^= 1 << (rng() % 8);
+        }
+        cases.push_back(std::move(flipped));
+      }
+      for (size_t i = 0; i < cases.size(); ++i) {
+        const auto& c = cases[i];
+        auto diff = WireIndexDiff(c, field, i < 2);
+        if (!diff.empty()) {
+          fprintf(stderr, "BuildFromWire mismatch (seed=%lu bytes=%zu): %s\n",
+            static_cast<unsigned long>(seed), c.size(), diff.c_str());
+          std::abort();
+        }
+      }
+    }
+  });
+}
+
+
+void BM_UserCounterIndex(benchmark::State& state) {
+  const auto& data = BenchEnv::Get().Request(state.range(0));
+  static const int counter_field = StoreUserCounter::descriptor()->
+    FindFieldByName("store_user_counter")->number();
+  VerifyWireIndex(counter_field);
+  bool wire = state.range(1) != 0;
+  for (auto _ : state) {
+    if (wire) {
+      CounterIndex index;
+      benchmark::DoNotOptimize(index.BuildFromWire(data.counter,
+        counter_field));
+    } else {
+      StoreUserCounter counter;
+      counter.ParseFromString(data.counter);
+      CounterIndex index(counter.store_user_counter());
+      benchmark::DoNotOptimize(index.size());
+    }
+  }
+  state.counters["blob_bytes"] = data.counter.size();
+}
+BENCHMARK(BM_UserCounterIndex)->ArgsProduct({{10, 100, 1000}, {0, 1}})
+  ->ArgNames({"ads", "wire"})->Unit(benchmark::kMicrosecond);
+
+
+void BM_AdCapScan(benchmark::State& state) {
+  PreparedRec p(state.range(0));
+  const auto& request = p.data.request.request();
+  for (auto _ : state) {
+    size_t capped = 0;
+    for (const auto& creatives : request.creatives()) {
+      capped += AdBudgetCapped(creatives.camp_id(), *p.ad_info,
+        *p.ad_counter);
+    }
+    benchmark::DoNotOptimize(capped);
+  }
+  SetCandidates(state, request.creatives_size());
+}
+BENCHMARK(BM_AdCapScan)->Apply(CandidateArgs);
+
+
+void BM_SelectUncappedAds(benchmark::State& state) {
+  PreparedRec p(state.range(0));
+  if (!p.ok) {
+    state.SkipWithError("prepare failed");
+    return;
+  }
+  for (auto _ : state) {
+    benchmark::DoNotOptimize(AdRecBench::SelectUncappedAds(p.rec,
+      *p.ad_info, *p.ad_counter));
+  }
+  SetCandidates(state, p.data.request.request().creatives_size());
+}
+BENCHMARK(BM_SelectUncappedAds)->Apply(CandidateArgs);
+
+
+void BM_DataToFeatureInput(benchmark::State& state) {
+  PreparedRec p(state.range(0));
+  if (!p.ok) {
+    state.SkipWithError("prepare failed");
+    return;
+  }
+  auto user_data = UserDataCache::Instance().Get(
+    p.data.request.request().user_id());
+  std::vector<int32_t> ads(p.data.request.request().creatives_size());
+  for (size_t i = 0; i < ads.size(); ++i) {
+    ads[i] = i;
+  }
+  for (auto _ : state) {
+    RequestArena arena;
+    RequestFeature request_feature;
+    auto& features = *arena.Create<FeatureList>();
+    DataToFeatureInput(p.data.request, ads, user_data->counter_index,
+      *user_data->profile, *p.ad_info, *p.ad_counter, request_feature,
+      features);
+    benchmark::DoNotOptimize(features.size());
+  }
+  SetCandidates(state, AdRecBench::features(p.rec).size());
+}
+BENCHMARK(BM_DataToFeatureInput)->Apply(CandidateArgs);
+
+
+// 特征名 -> 在各样本候选上是否都与完整抽取的取值相同
+template <typename M>
+void MatchFull(const M& part, const M& full,
+    std::map<std::string, bool>& same) {
+  for (const auto& p : full) {
+    auto it = part.find(p.first);
+    bool equal = it != part.end() && it->second == p.second;
+    auto inserted = same.emplace(p.first, equal);
+    if (!inserted.second) {
+      inserted.first->second = inserted.first->second && equal;
+    }
+  }
+}
+
+
+// 按合成数据推断"layered_extract"配置：在部分候选上分别只用user/context、
+// 只用广告侧抽取，与完整抽取取值都相同的特征归为该侧，其余视为交叉特征
+void ConfigureLayeredExtract(AdRec& rec) {
+  static std::once_flag once;
+  std::call_once(once, [&rec] {
+    const auto& rf = AdRecBench::request_feature(rec);
+    const auto& features = AdRecBench::features(rec);
+    ModelFeature mf;
+    Feature request;
+    *request.mutable_context() = rf.context;
+    *request.mutable_user_profile() = rf.user_profile;
+    auto request_result = mf.extract_feature(request);
+    std::map<std::string, bool> request_same;
+    std::map<std::string, bool> ad_same;
+    for (int i = 0; i < std::min(features.size(), 20); ++i) {
+      Feature ad;
+      *ad.mutable_ad_data() = features[i].ad_data();
+      *ad.mutable_user_ad_feature() = features[i].user_ad_feature();
+      auto ad_result = mf.extract_feature(ad);
+      auto full = mf.extract_feature(features[i]);
+      MatchFull(request_result->int_features, full->int_features,
+        request_same);
+      MatchFull(request_result->float_features, full->float_features,
+        request_same);
+      MatchFull(request_result->sequence_features, full->sequence_features,
+        request_same);
+      MatchFull(ad_result->int_features, full->int_features, ad_same);
+      MatchFull(ad_result->float_features, full->float_features, ad_same);
+      MatchFull(ad_result->sequence_features, full->sequence_features,
+        ad_same);
+    }
+    nlohmann::json request_features = nlohmann::json::array();
+    nlohmann::json ad_features = nlohmann::json::array();
+    nlohmann::json cross_features = nlohmann::json::array();
+    for (const auto& p : ad_same) {
+      if (p.second) {
+        ad_features.push_back(p.first);
+      } else if (request_same[p.first]) {
+        request_features.push_back(p.first);
+      } else {
+        cross_features.push_back(p.first);
+      }
+    }
+    InitLayeredExtract({{"layered_extract", {
+      {"request_features", request_features},
+      {"ad_features", ad_features},
+      {"cross_features", cross_features}}}});
+  });
+}
+
+
+void BM_FeatureExtract(benchmark::State& state) {
+  PreparedRec p(state.range(0));
+  if (!p.ok) {
+    state.SkipWithError("prepare failed");
+    return;
+  }
+  bool layered = state.range(1) != 0;
+  if (layered) {
+    ConfigureLayeredExtract(p.rec);
+  }
+  const auto& layout = AdRecBench::PrepareLayout(p.rec);
+  for (auto _ : state) {
+    std::vector<DenseFeatures> dense;
+    benchmark::DoNotOptimize(FeatureExtract(AdRecBench::request_feature(p.rec),
+      AdRecBench::features(p.rec), layered, layout, dense));
+  }
+  SetCandidates(state, AdRecBench::features(p.rec).size());
+}
+BENCHMARK(BM_FeatureExtract)->ArgsProduct({{10, 100, 300, 1000}, {0, 1}})
+  ->ArgNames({"ads", "layered"})->Unit(benchmark::kMicrosecond);
+
+
+void BM_FillTfFeatures(benchmark::State& state) {
+  PreparedRec p(state.range(0));
+  const auto* plan = p.ok ? AdRecBench::Extract(p.rec, kCtrModel) : nullptr;
+  if (plan == nullptr) {
+    state.SkipWithError("model not loaded");
+    return;
+  }
+  bool packed = state.range(1) != 0;
+  const auto& dense = AdRecBench::dense(p.rec);
+  for (auto _ : state) {
+    RequestArena arena;
+    TensorCache cache(arena.get());
+    for (const auto& field : plan->fields()) {
+      cache.Declare(field, packed);
+    }
+    tensorflow::serving::PredictRequest request;
+    FillTfFeatures(*plan, dense, packed, cache, *request.mutable_inputs());
+    benchmark::DoNotOptimize(request.inputs().size());
+  }
+  SetCandidates(state, dense.size());
+}
+BENCHMARK(BM_FillTfFeatures)->ArgsProduct({{10, 100, 300, 1000}, {0, 1}})
+  ->ArgNames({"ads", "packed"})->Unit(benchmark::kMicrosecond);
+
+
+void BM_StatsCtrCvr(benchmark::State& state) {
+  PreparedRec p(state.range(0));
+  if (!p.ok) {
+    state.SkipWithError("prepare failed");
+    return;
+  }
+  const auto& prior = *p.ad_counter->prior;
+  const auto& features = AdRecBench::features(p.rec);
+  for (auto _ : state) {
+    benchmark::DoNotOptimize(GetStatsCtr(prior, features));
+    benchmark::DoNotOptimize(GetStatsCvr(prior, features));
+  }
+  SetCandidates(state, features.size());
+}
+BENCHMARK(BM_StatsCtrCvr)->Apply(CandidateArgs);
+
+
+void BM_FillScore(benchmark::State& state) {
+  PreparedRec p(state.range(0));
+  if (!p.ok) {
+    state.SkipWithError("prepare failed");
+    return;
+  }
+  size_t n = AdRecBench::features(p.rec).size();
+  std::vector<double> ctr(n, 0.02);
+  std::vector<double> cvr(n, 0.05);
+  for (auto _ : state) {
+    RequestArena arena;
+    ScoredAds scored;
+    auto& req_ads = *arena.Create<metis::ReqAds>();
+    benchmark::DoNotOptimize(AdRecBench::FillScore(p.rec, ctr, cvr, scored,
+      req_ads));
+  }
+  SetCandidates(state, n);
+}
+BENCHMARK(BM_FillScore)->Apply(CandidateArgs);
+
+
+void BM_TopByEcpm(benchmark::State& state) {
+  size_t n = state.range(0) * DataGenOptions().creatives_per_ad;
+  std::mt19937_64 rng(n);
+  std::vector<double> ecpm(n);
+  for (auto& e : ecpm) {
+    e = rng() % 100000 / 1000.0;
+  }
+  std::vector<int32_t> order(n);
+  for (auto _ : state) {
+    for (size_t i = 0; i < n; ++i) {
+      order[i] = i;
+    }
+    TopByEcpm(ecpm, std::min<size_t>(10, n), order);
+    benchmark::DoNotOptimize(order.data());
+  }
+  SetCandidates(state, n);
+}
+BENCHMARK(BM_TopByEcpm)->Apply(CandidateArgs);
+
+
+void BM_NewAdBoost(benchmark::State& state) {
+  PreparedRec p(state.range(0));
+  if (!p.ok) {
+    state.SkipWithError("prepare failed");
+    return;
+  }
+  const auto& features = AdRecBench::features(p.rec);
+  std::vector<int32_t> order(features.size());
+  for (size_t i = 0; i < order.size(); ++i) {
+    order[i] = i;
+  }
+  for (auto _ : state) {
+    RequestArena arena;
+    RecAdMap rec_ad_map(RecAdMap::allocator_type(arena.get()));
+    NewAdBoost(features, order, 10, rec_ad_map);
+  }
+  SetCandidates(state, features.size());
+}
+BENCHMARK(BM_NewAdBoost)->Apply(CandidateArgs);
+
+
+// 探索流量的整批Thompson采样，分数取ctr * cvr的典型量级
+void BM_ExploreScores(benchmark::State& state) {
+  PreparedRec p(state.range(0));
+  if (!p.ok) {
+    state.SkipWithError("prepare failed");
+    return;
+  }
+  const auto& features = AdRecBench::features(p.rec);
+  std::vector<double> base(features.size());
+  for (size_t i = 0; i < base.size(); ++i) {
+    base[i] = 0.0005 * (i % 10 + 1);
+  }
+  std::vector<double> score;
+  for (auto _ : state) {
+    score = base;
+    ExploreScores(features, ExploreOptions().large_shape, score);
+    benchmark::DoNotOptimize(score.data());
+  }
+  SetCandidates(state, features.size());
+}
+BENCHMARK(BM_ExploreScores)->Apply(CandidateArgs);
+
+
+// 各段的单项耗时约1微秒，比较不同n下并行切分的收益
+void BM_ParallelFor(benchmark::State& state) {
+  size_t n = state.range(0);
+  std::vector<double> out(n);
+  static ParallelCost cost(1000);
+  for (auto _ : state) {
+    ParallelFor(n, cost, [&out] (size_t begin, size_t end) {
+      for (; begin < end; ++begin) {
+        double x = begin;
+        for (int k = 0; k < 200; ++k) {
+          x = x * 1.000001 + 0.5;
+        }
+        out[begin] = x;
+      }
+      return true;
+    });
+    benchmark::DoNotOptimize(out.data());
+  }
+  SetCandidates(state, n);
+}
+BENCHMARK(BM_ParallelFor)->RangeMultiplier(4)->Range(16, 16384)
+  ->Unit(benchmark::kMicrosecond)->UseRealTime();
+
+
+// 完整的Recommend；model为0时用统计CTR/CVR，为1时经tf-serving桩打分；
+// arena为0时关闭请求级arena，与逐个堆分配对比allocs/req和heap_KB/req
+void BM_Recommend(benchmark::State& state) {
+  auto& env = BenchEnv::Get();
+  if (!env.ok()) {
+    state.SkipWithError("prepare failed");
+    return;
+  }
+  bool model = state.range(1) != 0;
+  if (model && (FindTfModel(kCtrModel) == nullptr ||
+      FindTfModel(kCvrModel) == nullptr)) {
+    state.SkipWithError("model not loaded");
+    return;
+  }
+  auto request = env.Request(state.range(0)).request;
+  auto& exp_params = *request.mutable_exp_params()->mutable_exp_params();
+  exp_params["stats_ctr"] = model ? 0 : 1;
+  exp_params["stats_cvr"] = model ? 0 : 1;
+  RequestArena::SetEnabled(state.range(2) != 0);
+  auto allocs = heap_allocs.load(std::memory_order_relaxed);
+  auto bytes = heap_bytes.load(std::memory_order_relaxed);
+  for (auto _ : state) {
+    AdRec rec(&request);
+    std::vector<modelx::Model_result> ads;
+    if (!rec.Recommend(ads)) {
+      state.SkipWithError("recommend failed");
+      break;
+    }
+    benchmark::DoNotOptimize(ads.size());
+  }
+  RequestArena::SetEnabled(true);
+  SetCandidates(state, request.request().creatives_size() *
+    DataGenOptions().creatives_per_ad);
+  double iterations = std::max<double>(state.iterations(), 1);
+  state.counters["allocs/req"] =
+    (heap_allocs.load(std::memory_order_relaxed) - allocs) / iterations;
+  state.counters["heap_KB/req"] =
+    (heap_bytes.load(std::memory_order_relaxed) - bytes) / iterations / 1024;
+}
+BENCHMARK(BM_Recommend)->ArgsProduct({{10, 100, 300, 1000}, {0, 1}, {1, 0}})
+  ->ArgNames({"ads", "model", "arena"})->Unit(benchmark::kMicrosecond)
+  ->UseRealTime();
+
+}  // namespace
+}  // end of namespace
+}  // end of namespace
+
+BENCHMARK_MAIN();
@@ -0,0 +1,401 @@
+#include "rec/cpu_backend.h"
+
+#include <algorithm>
+#include <atomic>
+#include <cmath>
+#include <cstring>
+
+#include "file_watcher.h"
+#include "metrics/metrics.h"
+#include "rec/parallel_for.h"
+#include "util/log.h"
+#include "util/util.h"
+
+namespace ad {
+
+static const char kModelMagic[4] = {'A', 'M', 'L', 'P'};
+static const uint32_t kModelVersion = 1;
+// 单个embedding表或权重矩阵的元素数上限，超过视为文件损坏
+static const uint64_t kMaxElements = 1ULL << 30;
+// 每次前向计算的行数，各层的中间结果在此范围内留在缓存中
+static const size_t kBlockRows = 32;
+
+
+// 按顺序读取模型文件，越界时之后的读取都失败
+class ModelReader {
+ public:
+  explicit ModelReader(const std::string& content)
+    : p_(content.data()), end_(p_ + content.size()) {}
+
+  bool U32(uint32_t* value) { return Bytes(value, sizeof(*value)); }
+
+  bool String(std::string* value) {
+    uint32_t size = 0;
+    if (!U32(&size) || static_cast<size_t>(end_ - p_) < size) {
+      return false;
+    }
+    value->assign(p_, size);
+    p_ += size;
+    return true;
+  }
+
+  bool Floats(uint64_t count, std::vector<float>* values) {
+    if (count > kMaxElements ||
+        static_cast<uint64_t>(end_ - p_) < count * sizeof(float)) {
+      return false;
+    }
+    values->resize(count);
+    return Bytes(values->data(), count * sizeof(float));
+  }
+
+  bool Bytes(void* out, size_t size) {
+    if (static_cast<size_t>(end_ - p_) < size) {
+      return false;
+    }
+    if (size == 0) {
+      return true;
+    }
+    memcpy(out, p_, size);
+    p_ += size;
+    return true;
+  }
+
+  bool done() const { return p_ == end_; }
+
+ private:
+  const char* p_;
+  const char* end_;
+};
+
+
+std::shared_ptr<const CpuModel> CpuModel::Parse(const std::string& content,
+    std::string* error) {
+  ModelReader reader(content);
+  char magic[sizeof(kModelMagic)];
+  uint32_t version = 0;
+  if (!reader.Bytes(magic, sizeof(magic)) ||
+      memcmp(magic, kModelMagic, sizeof(magic)) != 0 ||
+      !reader.U32(&version) || version != kModelVersion) {
+    *error = "bad header";
+    return nullptr;
+  }
+
+  auto model = std::make_shared<CpuModel>();
+  uint32_t input_count = 0;
+  if (!reader.U32(&input_count) || input_count == 0) {
+    *error = "no inputs";
+    return nullptr;
+  }
+  for (uint32_t i = 0; i < input_count; ++i) {
+    Input input;
+    uint32_t type = 0;
+    if (!reader.String(&input.name) || !reader.U32(&type) ||
+        !reader.U32(&input.rows) || !reader.U32(&input.dim) ||
+        type >= kFieldTypeCount || input.dim == 0) {
+      *error = "bad input #" + std::to_string(i);
+      return nullptr;
+    }
+    input.type = static_cast<FieldType>(type);
+    if ((input.type == FieldType::kFloat) != (input.rows == 0) ||
+        (input.type == FieldType::kFloat && input.dim != 1) ||
+        !reader.Floats(static_cast<uint64_t>(input.rows) * input.dim,
+          &input.table)) {
+      *error = "bad input table: " + input.name;
+      return nullptr;
+    }
+    input.offset = model->width_;
+    model->width_ += input.dim;
+    model->inputs_.push_back(std::move(input));
+  }
+
+  uint32_t layer_count = 0;
+  if (!reader.U32(&layer_count) || layer_count == 0) {
+    *error = "no layers";
+    return nullptr;
+  }
+  size_t in = model->width_;
+  for (uint32_t i = 0; i < layer_count; ++i) {
+    Layer layer;
+    uint32_t activation = 0;
+    if (!reader.U32(&layer.in) || !reader.U32(&layer.out) ||
+        !reader.U32(&activation) || layer.in != in || layer.out == 0 ||
+        activation > static_cast<uint32_t>(Activation::kSigmoid) ||
+        !reader.Floats(static_cast<uint64_t>(layer.in) * layer.out,
+          &layer.weight) ||
+        !reader.Floats(layer.out, &layer.bias)) {
+      *error = "bad layer #" + std::to_string(i);
+      return nullptr;
+    }
+    layer.activation = static_cast<Activation>(activation);
+    in = layer.out;
+    model->max_dim_ = std::max(model->max_dim_, layer.out);
+    model->layers_.push_back(std::move(layer));
+  }
+  if (in != 1 || !reader.done()) {
+    *error = "last layer output must be 1, or trailing bytes";
+    return nullptr;
+  }
+  return model;
+}
+
+
+// 按tensor名找到各输入在plan中的字段；结果按plan版本缓存，失败也缓存，
+// 避免每个请求重复查找和打日志
+std::shared_ptr<const CpuModel::Binding> CpuModel::Bind(
+    const FeatureFillPlan& plan) const {
+  {
+    std::lock_guard<std::mutex> lock(mutex_);
+    if (binding_ != nullptr && binding_->plan_version == plan.version()) {
+      return binding_;
+    }
+  }
+  auto binding = std::make_shared<Binding>();
+  binding->plan_version = plan.version();
+  binding->ok = true;
+  const auto& fields = plan.fields();
+  for (const auto& input : inputs_) {
+    auto it = std::find_if(fields.begin(), fields.end(),
+      [&input] (const FillField& field) {
+        return field.tensor_name == input.name;
+      });
+    if (it == fields.end() || it->type != input.type ||
+        (input.type != FieldType::kFloat && it->max_length > input.rows)) {
+      LOG_ERROR("cpu model input not bound: input=" << input.name
+        << " rows=" << input.rows << (it == fields.end() ? " not in plan" :
+          " max_length=" + std::to_string(it->max_length)));
+      binding->ok = false;
+      break;
+    }
+    binding->fields.push_back(it - fields.begin());
+  }
+  std::lock_guard<std::mutex> lock(mutex_);
+  binding_ = binding;
+  return binding;
+}
+
+
+// 拼接一个素材的输入向量
+void CpuModel::Embed(const FeatureFillPlan& plan, const Binding& binding,
+    const DenseFeatures& creative, float* x) const {
+  for (size_t i = 0; i < inputs_.size(); ++i) {
+    const auto& input = inputs_[i];
+    const auto& field = plan.fields()[binding.fields[i]];
+    float* dst = x + input.offset;
+    switch (input.type) {
+      case FieldType::kFloat:
+        dst[0] = creative.floats[field.slot];
+        break;
+      case FieldType::kInt: {
+        int64_t id = 0;
+        ModBatch(&creative.ints[field.slot], 1, field.divisor, &id);
+        // 负数取模后仍为负，按缺失处理
+        id = id >= 0 ? id : 0;
+        memcpy(dst, input.table.data() + id * input.dim,
+          input.dim * sizeof(float));
+        break;
+      }
+      case FieldType::kSequence: {
+        std::fill(dst, dst + input.dim, 0.0f);
+        const auto* seq = creative.sequences[field.slot];
+        if (seq == nullptr) {
+          break;
+        }
+        int64_t ids[64];
+        int64_t count = 0;
+        int64_t pooled = 0;
+        auto it = seq->cbegin();
+        while (count < field.seq_length && it != seq->cend()) {
+          // 分批取模，每批不超过ids的大小
+          int64_t n = 0;
+          for (; n < 64 && count < field.seq_length && it != seq->cend();
+              ++n, ++count, ++it) {
+            ids[n] = *it;
+          }
+          ModBatch(ids, n, field.divisor, ids);
+          for (int64_t k = 0; k < n; ++k) {
+            if (ids[k] <= 0) {
+              continue;
+            }
+            const float* __restrict row = input.table.data() +
+              ids[k] * input.dim;
+            for (uint32_t j = 0; j < input.dim; ++j) {
+              dst[j] += row[j];
+            }
+            ++pooled;
+          }
+        }
+        if (pooled > 1) {
+          float scale = 1.0f / pooled;
+          for (uint32_t j = 0; j < input.dim; ++j) {
+            dst[j] *= scale;
+          }
+        }
+        break;
+      }
+    }
+  }
+}
+
+
+// y[n][out] += x[n][in] * w[in][out]。每次处理4行，w的每一行只加载一次；
+// 内层循环连续访问且无别名，由编译器向量化
+static void Gemm(const float* x, size_t n, size_t in, const float* w,
+    size_t out, float* y) {
+  size_t r = 0;
+  for (; r + 4 <= n; r += 4) {
+    const float* x0 = x + r * in;
+    float* __restrict y0 = y + r * out;
+    float* __restrict y1 = y0 + out;
+    float* __restrict y2 = y1 + out;
+    float* __restrict y3 = y2 + out;
+    for (size_t k = 0; k < in; ++k) {
+      const float* __restrict wk = w + k * out;
+      float a0 = x0[k];
+      float a1 = x0[in + k];
+      float a2 = x0[2 * in + k];
+      float a3 = x0[3 * in + k];
+      for (size_t j = 0; j < out; ++j) {
+        float wj = wk[j];
+        y0[j] += a0 * wj;
+        y1[j] += a1 * wj;
+        y2[j] += a2 * wj;
+        y3[j] += a3 * wj;
+      }
+    }
+  }
+  for (; r < n; ++r) {
+    const float* xr = x + r * in;
+    float* __restrict yr = y + r * out;
+    for (size_t k = 0; k < in; ++k) {
+      const float* __restrict wk = w + k * out;
+      float a = xr[k];
+      for (size_t j = 0; j < out; ++j) {
+        yr[j] += a * wk[j];
+      }
+    }
+  }
+}
+
+
+bool CpuModel::Forward(const FeatureFillPlan& plan, const Binding& binding,
+    const std::vector<DenseFeatures>& features, size_t begin, size_t end,
+    std::chrono::steady_clock::time_point until, double* scores) const {
+  thread_local std::vector<float> cur;
+  thread_local std::vector<float> next;
+  // 两个缓冲区交替作为各层的输入和输出
+  size_t capacity = kBlockRows * std::max<size_t>(width_, max_dim_);
+  cur.resize(std::max(cur.size(), capacity));
+  next.resize(std::max(next.size(), capacity));
+  for (size_t r0 = begin; r0 < end; r0 += kBlockRows) {
+    if (until != std::chrono::steady_clock::time_point::max() &&
+        std::chrono::steady_clock::now() >= until) {
+      return false;
+    }
+    size_t n = std::min(kBlockRows, end - r0);
+    for (size_t r = 0; r < n; ++r) {
+      Embed(plan, binding, features[r0 + r], cur.data() + r * width_);
+    }
+    size_t in = width_;
+    for (const auto& layer : layers_) {
+      for (size_t r = 0; r < n; ++r) {
+        std::copy(layer.bias.begin(), layer.bias.end(),
+          next.data() + r * layer.out);
+      }
+      Gemm(cur.data(), n, in, layer.weight.data(), layer.out, next.data());
+      float* y = next.data();
+      size_t size = n * layer.out;
+      if (layer.activation == Activation::kRelu) {
+        for (size_t j = 0; j < size; ++j) {
+          y[j] = std::max(y[j], 0.0f);
+        }
+      } else if (layer.activation == Activation::kSigmoid) {
+        for (size_t j = 0; j < size; ++j) {
+          y[j] = 1.0f / (1.0f + std::exp(-y[j]));
+        }
+      }
+      std::swap(cur, next);
+      in = layer.out;
+    }
+    for (size_t r = 0; r < n; ++r) {
+      scores[r0 + r] = cur[r];
+    }
+  }
+  return true;
+}
+
+
+std::optional<std::vector<double>> CpuModel::Predict(
+    const FeatureFillPlan& plan,
+    const std::vector<DenseFeatures>& features,
+    std::chrono::steady_clock::time_point until) const {
+  auto binding = Bind(plan);
+  if (!binding->ok) {
+    return std::nullopt;
+  }
+  std::vector<double> scores(features.size());
+  static ParallelCost cost(5000);
+  bool ok = ParallelFor(features.size(), cost,
+    [this, &plan, &binding, &features, until, &scores] (size_t begin,
+        size_t end) {
+      return Forward(plan, *binding, features, begin, end, until,
+        scores.data());
+    });
+  if (!ok) {
+    return std::nullopt;
+  }
+  return std::make_optional(std::move(scores));
+}
+
+/* ========================================================================== */
+
+std::shared_ptr<CpuBackend> CpuBackend::Create(const std::string& model_name,
+    const std::string& path) {
+  std::shared_ptr<CpuBackend> backend(new CpuBackend(model_name));
+  if (path.empty() || !backend->Load(ReadFile(path))) {
+    LOG_ERROR("cpu model load failed: model=" << model_name << " path="
+      << path);
+    return nullptr;
+  }
+  bool watched = common::FileWatcher::Instance()->AddFile(path,
+    [backend] (std::string content) {
+      backend->Load(content);
+    });
+  return watched ? backend : nullptr;
+}
+
+
+bool CpuBackend::Load(const std::string& content) {
+  std::string error;
+  auto model = CpuModel::Parse(content, &error);
+  if (model == nullptr) {
+    common::Stats::get()->Incr(cpuModelLoadError);
+    LOG_ERROR("cpu model parse failed: model=" << model_name_ << " "
+      << error);
+    return false;
+  }
+  std::atomic_store_explicit(&model_, model, std::memory_order_release);
+  LOG_INFO("cpu model loaded: model=" << model_name_ << " width="
+    << model->width());
+  return true;
+}
+
+
+// 任务引用input中的plan和features，调用方按reads_input_async()的约定
+// 在future就绪前保留它们
+ScoreFuture CpuBackend::Score(const ScoreInput& input) {
+  auto model = std::atomic_load_explicit(&model_, std::memory_order_acquire);
+  const auto* plan = &input.plan;
+  const auto* features = &input.features;
+  auto until = input.until;
+  return CpuThreadPool().enqueue([model, plan, features, until] () {
+    auto scores = model->Predict(*plan, *features, until);
+    if (!scores.has_value()) {
+      common::Stats::get()->Incr(
+        std::chrono::steady_clock::now() >= until ? cpuModelTimeout
+        : cpuModelBindError);
+    }
+    return scores;
+  });
+}
+
+}  // end of namespace
@@ -0,0 +1,112 @@
+#pragma once
+
+#include <chrono>
+#include <cstdint>
+#include <memory>
+#include <mutex>
+#include <optional>
+#include <string>
+#include <vector>
+
+#include "rec/model_backend.h"
+#include "rec/tf_feature.h"
+
+namespace ad {
+
+// 导出的embedding + MLP模型，进程内直接在稠密特征上计算，不经protobuf。
+// 文件格式（本机字节序）:
+//   "AMLP" u32版本(1)
+//   u32输入数，每个输入: u32名字长度 名字（dnn_dict中的tensor名）
+//     u32类型（0 int、1 float、2 sequence） u32行数 u32维数 float[行数*维数]
+//   u32层数，每层: u32输入维数 u32输出维数 u32激活（0无、1 relu、2 sigmoid）
+//     float[输入维数*输出维数]（按输入维优先存放） float[输出维数]
+// int输入取embedding的第id行，id与tf-serving相同按field_max_length取模，
+// 0表示缺失；sequence输入取非0 id的embedding均值；float输入行数为0、
+// 维数为1，直接取值。各输入按文件中的顺序拼接后依次经过各层，
+// 最后一层的输出维数为1
+class CpuModel {
+ public:
+  enum class Activation : uint32_t {
+    kNone = 0,
+    kRelu,
+    kSigmoid,
+  };
+
+  // 格式错误时返回nullptr，error为原因
+  static std::shared_ptr<const CpuModel> Parse(const std::string& content,
+      std::string* error);
+
+  // plan缺少模型需要的输入或取模范围超出embedding行数时返回nullopt；
+  // 过了until时不再计算剩余的行，也返回nullopt
+  std::optional<std::vector<double>> Predict(const FeatureFillPlan& plan,
+      const std::vector<DenseFeatures>& features,
+      std::chrono::steady_clock::time_point until =
+        std::chrono::steady_clock::time_point::max()) const;
+
+  size_t width() const { return width_; }
+
+ private:
+  struct Input {
+    std::string name;
+    FieldType type;
+    uint32_t rows;
+    uint32_t dim;
+    size_t offset;  // 在拼接后的输入向量中的位置
+    std::vector<float> table;
+  };
+  struct Layer {
+    uint32_t in;
+    uint32_t out;
+    Activation activation;
+    std::vector<float> weight;
+    std::vector<float> bias;
+  };
+  // 各输入对应的plan.fields()下标，plan版本变化时重新绑定
+  struct Binding {
+    uint64_t plan_version = 0;
+    bool ok = false;
+    std::vector<size_t> fields;
+  };
+
+  std::shared_ptr<const Binding> Bind(const FeatureFillPlan& plan) const;
+  void Embed(const FeatureFillPlan& plan, const Binding& binding,
+      const DenseFeatures& creative, float* x) const;
+  bool Forward(const FeatureFillPlan& plan, const Binding& binding,
+      const std::vector<DenseFeatures>& features, size_t begin, size_t end,
+      std::chrono::steady_clock::time_point until, double* scores) const;
+
+  std::vector<Input> inputs_;
+  std::vector<Layer> layers_;
+  size_t width_ = 0;
+  uint32_t max_dim_ = 0;  // 各层输出维数的最大值
+
+  mutable std::mutex mutex_;
+  mutable std::shared_ptr<const Binding> binding_;
+};
+
+
+// 使用CpuModel打分，提交到CPU线程池（经ParallelFor并行）异步计算，
+// 请求线程可继续填充下一个模型的特征；超过input.until后放弃计算。
+// 模型文件由FileWatcher监控，更新后整体替换，进行中的请求仍用旧模型
+class CpuBackend : public ModelBackend {
+ public:
+  // 首次加载失败时返回nullptr
+  static std::shared_ptr<CpuBackend> Create(const std::string& model_name,
+      const std::string& path);
+
+  const char* name() const override { return "cpu"; }
+  bool uses_tensors() const override { return false; }
+  bool reads_input_async() const override { return true; }
+  ScoreFuture Score(const ScoreInput& input) override;
+
+ private:
+  explicit CpuBackend(const std::string& model_name)
+    : model_name_(model_name) {}
+
+  bool Load(const std::string& content);
+
+  std::string model_name_;
+  std::shared_ptr<const CpuModel> model_;
+};
+
+}  // end of namespace
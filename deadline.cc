@@ -0,0 +1,88 @@
+#include "rec/deadline.h"
+
+#include <algorithm>
+
+#include "metrics/metrics.h"
+#include "util/log.h"
+
+namespace ad {
+
+static DeadlineOptions deadline_options;
+
+// 配置名和超出预算的指标，与Stage一一对应
+static const struct {
+  const char* name;
+  int overrun_metric;
+} stage_info[] = {
+  {"sharestore_ms", deadlineSharestoreOverrun},
+  {"feature_ms", deadlineFeatureOverrun},
+  {"extract_ms", deadlineExtractOverrun},
+  {"predict_ms", deadlinePredictOverrun},
+  {"log_ms", deadlineLogOverrun},
+};
+static_assert(sizeof(stage_info) / sizeof(stage_info[0]) ==
+  static_cast<size_t>(Stage::kCount), "stage_info size mismatch");
+
+
+Deadline::Deadline()
+  : options_(deadline_options),
+    start_(Clock::now()),
+    mark_(start_) {
+}
+
+
+bool Deadline::Finish(Stage stage) {
+  auto now = Clock::now();
+  auto budget = options_.stage_ms[static_cast<int>(stage)];
+  bool overrun = budget > 0 && now - mark_ > std::chrono::milliseconds(budget);
+  if (overrun) {
+    common::Stats::get()->Incr(
+      stage_info[static_cast<int>(stage)].overrun_metric);
+  }
+  mark_ = now;
+  return overrun;
+}
+
+
+Deadline::Clock::time_point Deadline::StageDeadline(Stage stage) const {
+  auto until = Clock::time_point::max();
+  auto budget = options_.stage_ms[static_cast<int>(stage)];
+  if (budget > 0) {
+    until = mark_ + std::chrono::milliseconds(budget);
+  }
+  if (options_.total_ms > 0) {
+    until = std::min(until, start_ + std::chrono::milliseconds(
+      options_.total_ms));
+  }
+  return until;
+}
+
+
+bool Deadline::Expired() const {
+  return options_.total_ms > 0 &&
+    Clock::now() - start_ > std::chrono::milliseconds(options_.total_ms);
+}
+
+
+bool InitDeadline(const nlohmann::json& conf) {
+  DeadlineOptions options;
+  auto it = conf.find("deadline");
+  if (it != conf.end()) {
+    const auto& deadline_conf = it.value();
+    if (!deadline_conf.is_object()) {
+      LOG_ERROR("deadline config invalid");
+      return false;
+    }
+    options.total_ms = deadline_conf.value("total_ms", options.total_ms);
+    for (int i = 0; i < static_cast<int>(Stage::kCount); ++i) {
+      options.stage_ms[i] = deadline_conf.value(stage_info[i].name,
+        options.stage_ms[i]);
+    }
+  }
+  deadline_options = options;
+  LOG_INFO("deadline total_ms=" << options.total_ms << " predict_ms="
+    << options.stage_ms[static_cast<int>(Stage::kPredict)]);
+  return true;
+}
+
+}  // end of namespace
@@ -0,0 +1,58 @@
+#pragma once
+
+#include <chrono>
+#include <cstdint>
+
+#include <nlohmann/json.hpp>
+
+namespace ad {
+
+// 请求处理的各阶段，按顺序进行
+enum class Stage {
+  kSharestore,  // 拉取用户数据
+  kFeature,     // 过滤广告并组装Feature
+  kExtract,     // 特征抽取
+  kPredict,     // 填充tensor并等待模型打分
+  kLog,         // 排序、生成结果和metis日志
+  kCount,
+};
+
+
+// 总截止时间和各阶段预算（毫秒），0表示不限制
+struct DeadlineOptions {
+  int64_t total_ms = 0;
+  int64_t stage_ms[static_cast<int>(Stage::kCount)] = {0, 0, 0, 0, 0};
+};
+
+
+// 一次请求的截止时间，构造时开始计时；各阶段依次调用Finish，
+// 阶段耗时从上一次Finish（或构造）算起，超出预算时记录指标。
+// Finish只做统计，真正限制等待的只有用StageDeadline的地方：
+// kSharestore限制等待其他请求的同一用户拉取，本请求的拉取仍受
+// sharestore客户端超时限制；kPredict限制等待模型打分和cpu后端的计算；
+// 其余阶段只在总截止时间到达后跳过模型
+class Deadline {
+ public:
+  using Clock = std::chrono::steady_clock;
+
+  Deadline();
+
+  // 结束一个阶段，返回是否超出该阶段预算
+  bool Finish(Stage stage);
+
+  // 当前阶段须在此之前完成：阶段预算和总截止时间中较早的一个，均不限制时为max
+  Clock::time_point StageDeadline(Stage stage) const;
+
+  // 是否已超过总截止时间
+  bool Expired() const;
+
+ private:
+  const DeadlineOptions& options_;
+  Clock::time_point start_;
+  Clock::time_point mark_;
+};
+
+// 读取server.json中的"deadline"配置，未配置时不限制
+bool InitDeadline(const nlohmann::json& conf);
+
+}  // end of namespace
@@ -0,0 +1,222 @@
+#include "rec/explore.h"
+
+#include <algorithm>
+#include <array>
+#include <cmath>
+#include <functional>
+#include <random>
+#include <thread>
+
+#include "util/log.h"
+
+namespace ad {
+
+static inline uint64_t Rotl(uint64_t x, int k) {
+  return (x << k) | (x >> (64 - k));
+}
+
+
+static uint64_t SplitMix64(uint64_t& x) {
+  uint64_t z = (x += 0x9e3779b97f4a7c15ULL);
+  z = (z ^ (z >> 30)) * 0xbf58476d1ce4e5b9ULL;
+  z = (z ^ (z >> 27)) * 0x94d049bb133111ebULL;
+  return z ^ (z >> 31);
+}
+
+
+FastRng::FastRng(uint64_t seed) {
+  for (size_t lane = 0; lane < kLanes; ++lane) {
+    for (auto& s : state_) {
+      s[lane] = SplitMix64(seed);
+    }
+  }
+}
+
+
+void FastRng::Refill() {
+  auto& s0 = state_[0];
+  auto& s1 = state_[1];
+  auto& s2 = state_[2];
+  auto& s3 = state_[3];
+  for (size_t i = 0; i < kBufferSize; i += kLanes) {
+    for (size_t lane = 0; lane < kLanes; ++lane) {
+      buffer_[i + lane] = Rotl(s0[lane] + s3[lane], 23) + s0[lane];
+      uint64_t t = s1[lane] << 17;
+      s2[lane] ^= s0[lane];
+      s3[lane] ^= s1[lane];
+      s1[lane] ^= s2[lane];
+      s0[lane] ^= s3[lane];
+      s2[lane] ^= t;
+      s3[lane] = Rotl(s3[lane], 45);
+    }
+  }
+  pos_ = 0;
+}
+
+
+double FastRng::Normal() {
+  if (has_spare_) {
+    has_spare_ = false;
+    return spare_normal_;
+  }
+  double r = std::sqrt(-2.0 * std::log(Uniform()));
+  double theta = 2.0 * M_PI * Uniform();
+  spare_normal_ = r * std::sin(theta);
+  has_spare_ = true;
+  return r * std::cos(theta);
+}
+
+
+FastRng& ThreadRng() {
+  thread_local FastRng rng(std::random_device{}() ^
+    (std::hash<std::thread::id>()(std::this_thread::get_id()) << 32));
+  return rng;
+}
+
+/* ========================================================================== */
+
+// 标准正态分布的分位数函数（Acklam的有理近似，相对误差约1e-9）
+static double InverseNormalCdf(double p) {
+  static const double a[] = {-3.969683028665376e+01, 2.209460984245205e+02,
+    -2.759285104469687e+02, 1.383577518672690e+02, -3.066479806614716e+01,
+    2.506628277459239e+00};
+  static const double b[] = {-5.447609879822406e+01, 1.615858368580409e+02,
+    -1.556989798598866e+02, 6.680131188771972e+01, -1.328068155288572e+01};
+  static const double c[] = {-7.784894002430293e-03, -3.223964580411365e-01,
+    -2.400758277161838e+00, -2.549671010229528e+00, 4.374664141464968e+00,
+    2.938163982698783e+00};
+  static const double d[] = {7.784695709041462e-03, 3.224671290700398e-01,
+    2.445134137142996e+00, 3.754408661907416e+00};
+  const double p_low = 0.02425;
+  if (p < p_low || p > 1 - p_low) {
+    double q = std::sqrt(-2 * std::log(p < p_low ? p : 1 - p));
+    double x = (((((c[0] * q + c[1]) * q + c[2]) * q + c[3]) * q + c[4]) * q +
+      c[5]) / ((((d[0] * q + d[1]) * q + d[2]) * q + d[3]) * q + 1);
+    return p < p_low ? x : -x;
+  }
+  double q = p - 0.5;
+  double r = q * q;
+  return (((((a[0] * r + a[1]) * r + a[2]) * r + a[3]) * r + a[4]) * r +
+    a[5]) * q / (((((b[0] * r + b[1]) * r + b[2]) * r + b[3]) * r + b[4]) *
+    r + 1);
+}
+
+
+// 在[0, 1]上等分kQuantileCells格的分位数表，格内线性插值；两端的格
+// 在1/(4*kQuantileCells)处截断，尾部概率不足千分之一，对探索打分无影响
+constexpr int kQuantileCells = 4096;
+
+static const std::array<double, kQuantileCells + 1>& QuantileTable() {
+  static const auto table = [] {
+    std::array<double, kQuantileCells + 1> t;
+    const double edge = 0.25 / kQuantileCells;
+    for (int i = 0; i <= kQuantileCells; ++i) {
+      t[i] = InverseNormalCdf(std::clamp(static_cast<double>(i) /
+        kQuantileCells, edge, 1 - edge));
+    }
+    return t;
+  }();
+  return table;
+}
+
+
+static double NormalQuantile(double u) {
+  const auto& table = QuantileTable();
+  double pos = u * kQuantileCells;
+  int i = std::min(static_cast<int>(pos), kQuantileCells - 1);
+  double frac = pos - i;
+  return table[i] + frac * (table[i + 1] - table[i]);
+}
+
+
+double SampleGamma(FastRng& rng, double shape, double large_shape) {
+  if (shape < 1) {
+    // Gamma(a) = Gamma(a + 1) * U^(1/a)
+    double u = rng.Uniform();
+    return SampleGamma(rng, shape + 1, large_shape) * std::pow(u, 1 / shape);
+  }
+  if (shape >= large_shape) {
+    double c = 1 / (9 * shape);
+    double v = 1 - c + NormalQuantile(rng.Uniform()) * std::sqrt(c);
+    return v > 0 ? shape * v * v * v : 0;
+  }
+  double d = shape - 1.0 / 3;
+  double c = 1 / std::sqrt(9 * d);
+  while (true) {
+    double x = rng.Normal();
+    double v = 1 + c * x;
+    if (v <= 0) {
+      continue;
+    }
+    v = v * v * v;
+    double u = rng.Uniform();
+    double x2 = x * x;
+    // 先用不含log的挤压条件，绝大多数样本在此接受
+    if (u < 1 - 0.0331 * x2 * x2 ||
+        std::log(u) < 0.5 * x2 + d * (1 - v + std::log(v))) {
+      return d * v;
+    }
+  }
+}
+
+
+void SampleBeta(FastRng& rng, const double* alpha, const double* beta,
+    size_t n, double large_shape, double* out) {
+  for (size_t i = 0; i < n; ++i) {
+    if (alpha[i] <= 0) {
+      out[i] = 0;
+      continue;
+    }
+    if (beta[i] <= 0) {
+      out[i] = 1;
+      continue;
+    }
+    double x = SampleGamma(rng, alpha[i], large_shape);
+    double y = SampleGamma(rng, beta[i], large_shape);
+    out[i] = x + y > 0 ? x / (x + y) : alpha[i] / (alpha[i] + beta[i]);
+  }
+}
+
+/* ========================================================================== */
+
+static ExploreOptions explore_options;
+
+
+const ExploreOptions& GetExploreOptions() {
+  return explore_options;
+}
+
+
+bool InitExplore(const nlohmann::json& conf) {
+  ExploreOptions options;
+  auto it = conf.find("explore");
+  if (it != conf.end()) {
+    const auto& explore_conf = it.value();
+    if (!explore_conf.is_object()) {
+      LOG_ERROR("explore config invalid");
+      return false;
+    }
+    options.enable = explore_conf.value("enable", options.enable);
+    options.explore_percent = explore_conf.value("explore_percent",
+      options.explore_percent);
+    options.new_ad_percent = explore_conf.value("new_ad_percent",
+      options.new_ad_percent);
+    options.large_shape = explore_conf.value("large_shape",
+      options.large_shape);
+    if (options.explore_percent < 0 || options.new_ad_percent < 0 ||
+        options.explore_percent + options.new_ad_percent > 100 ||
+        options.large_shape < 1) {
+      LOG_ERROR("explore config invalid: explore_percent="
+        << options.explore_percent << " new_ad_percent="
+        << options.new_ad_percent << " large_shape=" << options.large_shape);
+      return false;
+    }
+  }
+  explore_options = options;
+  LOG_INFO("explore enable=" << options.enable << " explore_percent="
+    << options.explore_percent << " new_ad_percent=" << options.new_ad_percent
+    << " large_shape=" << options.large_shape);
+  return true;
+}
+
+}  // end of namespace
@@ -0,0 +1,78 @@
+#pragma once
+
+#include <cstddef>
+#include <cstdint>
+#include <limits>
+
+#include <nlohmann/json.hpp>
+
+namespace ad {
+
+// xoshiro256++，4路交错：每路状态独立，一次为缓冲区生成一批数，
+// 各路的循环无依赖，可被编译器向量化。非线程安全，用ThreadRng取本线程的实例
+class FastRng {
+ public:
+  using result_type = uint64_t;
+  static constexpr size_t kLanes = 4;
+  static constexpr size_t kBufferSize = 256;
+
+  explicit FastRng(uint64_t seed);
+
+  static constexpr result_type min() { return 0; }
+  static constexpr result_type max() {
+    return std::numeric_limits<result_type>::max();
+  }
+  result_type operator()() {
+    if (pos_ == kBufferSize) {
+      Refill();
+    }
+    return buffer_[pos_++];
+  }
+
+  // (0, 1)上的均匀分布
+  double Uniform() {
+    return ((*this)() >> 11) * 0x1.0p-53 + 0x1.0p-54;
+  }
+  // 标准正态分布（Box-Muller，成对生成）
+  double Normal();
+
+ private:
+  void Refill();
+
+  uint64_t state_[4][kLanes];
+  uint64_t buffer_[kBufferSize];
+  size_t pos_ = kBufferSize;
+  double spare_normal_ = 0;
+  bool has_spare_ = false;
+};
+
+// 本线程的FastRng，首次使用时用随机设备和线程id播种
+FastRng& ThreadRng();
+
+
+// Gamma(shape, 1)：shape < 1时由Gamma(shape + 1)升幂得到；
+// shape >= large_shape时用Wilson-Hilferty近似，标准正态分位数查预先算好的表，
+// 只需一个均匀数；其余用Marsaglia-Tsang拒绝采样
+double SampleGamma(FastRng& rng, double shape, double large_shape);
+
+// 对一批Beta(alpha[i], beta[i])各抽一个样本写入out；
+// alpha <= 0时为0，beta <= 0时为1
+void SampleBeta(FastRng& rng, const double* alpha, const double* beta,
+    size_t n, double large_shape, double* out);
+
+
+// 探索与利用的流量划分和探索打分
+struct ExploreOptions {
+  bool enable = false;      // 探索流量是否按Thompson采样打分
+  int explore_percent = 5;  // 探索流量的比例
+  int new_ad_percent = 5;   // 新广告扶持流量的比例
+  double large_shape = 64;  // 见SampleGamma
+};
+
+const ExploreOptions& GetExploreOptions();
+
+// 读取server.json中的"explore"配置，须在开始处理请求前调用；
+// 未配置时流量划分不变，探索流量不做采样
+bool InitExplore(const nlohmann::json& conf);
+
+}  // end of namespace
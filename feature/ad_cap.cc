@@ -0,0 +1,82 @@
+#include "feature/ad_cap.h"
+
+#include <algorithm>
+#include <charconv>
+#include <string>
+#include <string_view>
+
+namespace ad {
+
+// 位图最多占用 kMaxBitmapSpan / 8 字节
+constexpr uint64_t kMaxBitmapSpan = uint64_t(1) << 28;
+
+
+static bool InstallCapped(int64_t ad_id, int64_t cap,
+    const AdCounterSnapshot& ad_counter) {
+  if (cap <= 0) {
+    return false;
+  }
+  auto ref = ad_counter.Find(CounterKey::kAdId, ad_id);
+  if (!ref) {
+    return false;
+  }
+  CountFeatures count;
+  ref.CopyTo(&count);
+  return count.count_features_bj_1d().attr_install() > cap;
+}
+
+
+bool AdBudgetCapped(int64_t ad_id, const AdInfoSnapshot& ad_info,
+    const AdCounterSnapshot& ad_counter) {
+  AdInfoItem scratch;
+  auto item = ad_info.Find("ad_id#" + std::to_string(ad_id), scratch);
+  return item != nullptr &&
+    InstallCapped(ad_id, item->day_attr_install_cap(), ad_counter);
+}
+
+
+std::shared_ptr<const AdCapTable> AdCapTable::Build(
+    const AdInfoSnapshot& ad_info, const AdCounterSnapshot& ad_counter) {
+  auto table = std::make_shared<AdCapTable>();
+  if (ad_info.mapped != nullptr) {
+    return table;
+  }
+  // 枚举ad_info中"ad_id#<id>"的cap
+  constexpr std::string_view kPrefix = "ad_id#";
+  for (const auto& p : ad_info.store.ad_infos()) {
+    std::string_view key = p.first;
+    if (key.compare(0, kPrefix.size(), kPrefix) != 0) {
+      continue;
+    }
+    int64_t ad_id = 0;
+    auto digits = key.substr(kPrefix.size());
+    auto res = std::from_chars(digits.data(), digits.data() + digits.size(),
+      ad_id);
+    if (res.ec != std::errc() || res.ptr != digits.data() + digits.size()) {
+      continue;
+    }
+    if (InstallCapped(ad_id, p.second.day_attr_install_cap(), ad_counter)) {
+      table->ids_.push_back(ad_id);
+    }
+  }
+  auto& ids = table->ids_;
+  std::sort(ids.begin(), ids.end());
+  ids.erase(std::unique(ids.begin(), ids.end()), ids.end());
+  table->size_ = ids.size();
+  table->complete_ = true;
+  if (!ids.empty() &&
+      static_cast<uint64_t>(ids.back() - ids.front()) < kMaxBitmapSpan) {
+    table->min_id_ = ids.front();
+    table->span_ = static_cast<uint64_t>(ids.back() - ids.front()) + 1;
+    table->bits_.assign((table->span_ + 63) / 64, 0);
+    for (auto id : ids) {
+      uint64_t i = static_cast<uint64_t>(id - table->min_id_);
+      table->bits_[i >> 6] |= uint64_t(1) << (i & 63);
+    }
+    ids.clear();
+    ids.shrink_to_fit();
+  }
+  return table;
+}
+
+}  // end of namespace
@@ -0,0 +1,50 @@
+#pragma once
+
+#include <algorithm>
+#include <cstdint>
+#include <memory>
+#include <vector>
+
+#include "feature/feature.h"
+
+namespace ad {
+
+// 单个广告是否超预算：cap>0且当日安装数超过day_attr_install_cap
+bool AdBudgetCapped(int64_t ad_id, const AdInfoSnapshot& ad_info,
+    const AdCounterSnapshot& ad_counter);
+
+
+// 超预算广告的集合，ad_info或ad_counter更新时重算，请求中按ad_id直接查表。
+// ad_info为mmap快照时无法枚举设置了cap的广告，complete()为false，
+// 此时需逐个调用AdBudgetCapped
+class AdCapTable {
+ public:
+  static std::shared_ptr<const AdCapTable> Build(const AdInfoSnapshot& ad_info,
+      const AdCounterSnapshot& ad_counter);
+
+  bool complete() const { return complete_; }
+
+  bool Capped(int64_t ad_id) const {
+    if (!bits_.empty()) {
+      uint64_t i = static_cast<uint64_t>(ad_id - min_id_);
+      return i < span_ && (bits_[i >> 6] >> (i & 63) & 1);
+    }
+    return std::binary_search(ids_.begin(), ids_.end(), ad_id);
+  }
+
+  size_t size() const { return size_; }
+
+ private:
+  bool complete_ = false;
+  size_t size_ = 0;
+  // ad_id跨度不大时用位图，否则用有序数组
+  int64_t min_id_ = 0;
+  uint64_t span_ = 0;
+  std::vector<uint64_t> bits_;
+  std::vector<int64_t> ids_;
+};
+
+// 与GetStoreAdInfo/GetStoreAdCounter同时更新
+std::shared_ptr<const AdCapTable> GetAdCapTable();
+
+}  // end of namespace
@@ -0,0 +1,291 @@
+#include "feature/counter_index.h"
+
+#include "feature/snapshot_file.h"
+#include "util/log.h"
+
+namespace ad {
+
+namespace {
+
+struct KeyPrefix {
+  std::string_view prefix;
+  CounterKey kind;
+  int parts;
+};
+
+constexpr KeyPrefix kKeyPrefixes[] = {
+  {"user_id#", CounterKey::kUserId, 1},
+  {"user_id#ad_id#", CounterKey::kUserIdAdId, 2},
+  {"user_id#ad_package_name#", CounterKey::kUserIdAdPackageName, 2},
+  {"user_id#ad_package_category#", CounterKey::kUserIdAdPackageCategory, 2},
+  {"user_id#pos_id#ad_id#", CounterKey::kUserIdPosIdAdId, 3},
+  {"user_id#pos_id#ad_package_name#",
+    CounterKey::kUserIdPosIdAdPackageName, 3},
+  {"user_id#pos_id#ad_package_category#",
+    CounterKey::kUserIdPosIdAdPackageCategory, 3},
+  {"user_id#c_id#", CounterKey::kUserIdCId, 2},
+  {"user_id#pos_id#c_id#", CounterKey::kUserIdPosIdCId, 3},
+  {"ad_id#", CounterKey::kAdId, 1},
+  {"package_name#ad_package_name#", CounterKey::kPackageNameAdPackageName, 2},
+  {"package_name#ad_package_category#",
+    CounterKey::kPackageNameAdPackageCategory, 2},
+  {"pos_id#ad_id#", CounterKey::kPosIdAdId, 2},
+  {"pos_id#ad_package_name#", CounterKey::kPosIdAdPackageName, 2},
+  {"pos_id#ad_package_category#", CounterKey::kPosIdAdPackageCategory, 2},
+  {"package_name#c_id#", CounterKey::kPackageNameCId, 2},
+  {"pos_id#c_id#", CounterKey::kPosIdCId, 2},
+};
+
+}  // namespace
+
+
+bool ParseCounterKey(std::string_view key, KeyHash* hash, CounterKey* kind) {
+  // 取最长匹配的前缀，"user_id#ad_id#..."不能被当作"user_id#..."
+  const KeyPrefix* match = nullptr;
+  for (const auto& p : kKeyPrefixes) {
+    if (key.compare(0, p.prefix.size(), p.prefix) == 0 &&
+        (match == nullptr || p.prefix.size() > match->prefix.size())) {
+      match = &p;
+    }
+  }
+  if (match == nullptr) {
+    return false;
+  }
+  // 前 parts-1 段以'#'切分，最后一段取剩余全部
+  auto rest = key.substr(match->prefix.size());
+  uint64_t seed = static_cast<uint64_t>(match->kind) + 1;
+  KeyHash h{seed, static_cast<uint32_t>(seed)};
+  for (int i = 1; i < match->parts; ++i) {
+    auto pos = rest.find('#');
+    if (pos == std::string_view::npos) {
+      return false;
+    }
+    h = HashKeyPart(h, rest.substr(0, pos));
+    rest.remove_prefix(pos + 1);
+  }
+  h = HashKeyPart(h, rest);
+  if (h.hash == 0) {
+    h.hash = 1;
+  }
+  *hash = h;
+  if (kind != nullptr) {
+    *kind = match->kind;
+  }
+  return true;
+}
+
+
+bool CounterRef::CopyTo(CountFeatures* out) const {
+  if (message_ != nullptr) {
+    out->CopyFrom(*message_);
+    return true;
+  }
+  return out->ParseFromArray(bytes_.data(), bytes_.size());
+}
+
+
+void CounterIndex::Attach(const MappedSnapshot* mapped) {
+  slots_.clear();
+  mask_ = 0;
+  size_ = mapped->size();
+  mapped_ = mapped;
+}
+
+
+CounterRef CounterIndex::FindMapped(const KeyHash& key) const {
+  auto bytes = mapped_->Find(key);
+  return bytes.data() != nullptr ? CounterRef(bytes) : CounterRef();
+}
+
+
+void CounterIndex::Reset(size_t count) {
+  mapped_ = nullptr;
+  size_t capacity = 16;
+  while (capacity < count * 2) {
+    capacity <<= 1;
+  }
+  slots_.assign(capacity, Slot{KeyHash(), CounterRef()});
+  mask_ = capacity - 1;
+  size_ = 0;
+  collisions_ = 0;
+}
+
+
+void CounterIndex::Insert(const KeyHash& key, CounterRef value,
+    bool overwrite) {
+  auto i = key.hash & mask_;
+  while (slots_[i].key.hash != 0 && slots_[i].key != key) {
+    if (slots_[i].key.hash == key.hash) {
+      ++collisions_;
+    }
+    i = (i + 1) & mask_;
+  }
+  if (slots_[i].key.hash == 0) {
+    slots_[i] = Slot{key, value};
+    ++size_;
+  } else if (overwrite) {
+    slots_[i].value = value;
+  }
+}
+
+
+void CounterIndex::LogCollisions(const char* source) const {
+  if (collisions_ > 0) {
+    LOG_ERROR("counter key hash collision: source=" << source
+      << " collisions=" << collisions_ << " size=" << size_);
+  }
+}
+
+
+void CounterIndex::Build(const Counters& counters) {
+  Reset(counters.size());
+  for (const auto& p : counters) {
+    KeyHash key;
+    if (ParseCounterKey(p.first, &key)) {
+      Insert(key, CounterRef(&p.second), false);
+    }
+  }
+  LogCollisions("map");
+}
+
+
+namespace {
+
+// protobuf wire format的最小读取：varint和跳过字段
+bool ReadVarint(const char*& p, const char* end, uint64_t* value) {
+  uint64_t result = 0;
+  for (int shift = 0; shift < 64 && p < end; shift += 7) {
+    uint8_t byte = static_cast<uint8_t>(*p++);
+    result |= static_cast<uint64_t>(byte & 0x7f) << shift;
+    if ((byte & 0x80) == 0) {
+      *value = result;
+      return true;
+    }
+  }
+  return false;
+}
+
+
+// 读取长度前缀字段的内容，p须位于长度处
+bool ReadBytes(const char*& p, const char* end, std::string_view* bytes) {
+  uint64_t len = 0;
+  if (!ReadVarint(p, end, &len) || len > static_cast<uint64_t>(end - p)) {
+    return false;
+  }
+  *bytes = std::string_view(p, len);
+  p += len;
+  return true;
+}
+
+
+bool SkipField(int wire_type, const char*& p, const char* end) {
+  uint64_t ignored = 0;
+  std::string_view bytes;
+  switch (wire_type) {
+    case 0:
+      return ReadVarint(p, end, &ignored);
+    case 1:
+      if (end - p < 8) return false;
+      p += 8;
+      return true;
+    case 2:
+      return ReadBytes(p, end, &bytes);
+    case 5:
+      if (end - p < 4) return false;
+      p += 4;
+      return true;
+    default:  // group已废弃，不支持
+      return false;
+  }
+}
+
+
+// 逐个取出blob中field_number字段（长度前缀）的内容
+template <typename F>
+bool ForEachLengthDelimited(std::string_view blob, int field_number, F&& fn) {
+  const char* p = blob.data();
+  const char* end = p + blob.size();
+  while (p < end) {
+    uint64_t tag = 0;
+    if (!ReadVarint(p, end, &tag)) {
+      return false;
+    }
+    int wire_type = tag & 7;
+    if (static_cast<int>(tag >> 3) == field_number && wire_type == 2) {
+      std::string_view bytes;
+      if (!ReadBytes(p, end, &bytes) || !fn(bytes)) {
+        return false;
+      }
+    } else if (!SkipField(wire_type, p, end)) {
+      return false;
+    }
+  }
+  return true;
+}
+
+
+// map entry: key = 1, value = 2；缺省的value为空消息。
+// value出现多次时protobuf会合并各段，无法用一段字节表示，返回false
+bool ParseMapEntry(std::string_view entry, std::string_view* key,
+    std::string_view* value) {
+  *key = std::string_view();
+  *value = std::string_view(entry.data(), 0);
+  bool has_value = false;
+  const char* p = entry.data();
+  const char* end = p + entry.size();
+  while (p < end) {
+    uint64_t tag = 0;
+    if (!ReadVarint(p, end, &tag)) {
+      return false;
+    }
+    int wire_type = tag & 7;
+    int field = tag >> 3;
+    if (field == 1 && wire_type == 2) {
+      if (!ReadBytes(p, end, key)) {
+        return false;
+      }
+    } else if (field == 2 && wire_type == 2) {
+      if (has_value || !ReadBytes(p, end, value)) {
+        return false;
+      }
+      has_value = true;
+    } else if (!SkipField(wire_type, p, end)) {
+      return false;
+    }
+  }
+  return true;
+}
+
+}  // namespace
+
+
+bool CounterIndex::BuildFromWire(std::string_view blob, int field_number) {
+  size_t count = 0;
+  if (!ForEachLengthDelimited(blob, field_number,
+      [&count] (std::string_view) { ++count; return true; })) {
+    Reset(0);
+    return false;
+  }
+  Reset(count);
+  bool ok = ForEachLengthDelimited(blob, field_number,
+    [this] (std::string_view entry) {
+      std::string_view key;
+      std::string_view value;
+      if (!ParseMapEntry(entry, &key, &value)) {
+        return false;
+      }
+      KeyHash hash;
+      if (ParseCounterKey(key, &hash)) {
+        Insert(hash, CounterRef(value), true);
+      }
+      return true;
+    });
+  if (!ok) {
+    Reset(0);
+    return false;
+  }
+  LogCollisions("wire");
+  return true;
+}
+
+}  // end of namespace
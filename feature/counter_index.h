@@ -0,0 +1,209 @@
+#pragma once
+
+#include <charconv>
+#include <cstdint>
+#include <string>
+#include <string_view>
+#include <vector>
+
+#include "model_feature.pb.h"
+#include "store_table.pb.h"
+
+namespace ad {
+
+// counter key的类型，对应store中"user_id#pos_id#ad_id#..."等key前缀
+enum class CounterKey : uint8_t {
+  kUserId = 0,
+  kUserIdAdId,
+  kUserIdAdPackageName,
+  kUserIdAdPackageCategory,
+  kUserIdPosIdAdId,
+  kUserIdPosIdAdPackageName,
+  kUserIdPosIdAdPackageCategory,
+  kUserIdCId,
+  kUserIdPosIdCId,
+  kAdId,
+  kPackageNameAdPackageName,
+  kPackageNameAdPackageCategory,
+  kPosIdAdId,
+  kPosIdAdPackageName,
+  kPosIdAdPackageCategory,
+  kPackageNameCId,
+  kPosIdCId,
+};
+
+
+// 64位hash，结果跨进程稳定
+inline uint64_t HashKeyPart(uint64_t h, std::string_view part) {
+  h ^= 0xcbf29ce484222325ULL;
+  for (unsigned char c : part) {
+    h ^= c;
+    h *= 0x100000001b3ULL;
+  }
+  // splitmix64 finalizer
+  h ^= h >> 30;
+  h *= 0xbf58476d1ce4e5b9ULL;
+  h ^= h >> 27;
+  h *= 0x94d049bb133111ebULL;
+  h ^= h >> 31;
+  return h;
+}
+
+// 整数按十进制字符串参与hash，与store中key的写法一致
+inline uint64_t HashKeyPart(uint64_t h, int64_t part) {
+  char buf[24];
+  auto res = std::to_chars(buf, buf + sizeof(buf), part);
+  return HashKeyPart(h, std::string_view(buf, res.ptr - buf));
+}
+
+// 32位的校验hash（FNV-1a + murmur3 finalizer），与HashKeyPart相互独立
+inline uint32_t CheckKeyPart(uint32_t c, std::string_view part) {
+  c ^= 0x811c9dc5U;
+  for (unsigned char ch : part) {
+    c ^= ch;
+    c *= 0x01000193U;
+  }
+  c ^= c >> 16;
+  c *= 0x85ebca6bU;
+  c ^= c >> 13;
+  c *= 0xc2b2ae35U;
+  c ^= c >> 16;
+  return c;
+}
+
+
+// key的hash：hash用于定位，check在hash相同时再比较一次，
+// 64位hash碰撞时不会取到另一个key的数据
+struct KeyHash {
+  uint64_t hash = 0;  // 0表示空槽
+  uint32_t check = 0;
+
+  bool operator==(const KeyHash& other) const {
+    return hash == other.hash && check == other.check;
+  }
+  bool operator!=(const KeyHash& other) const { return !(*this == other); }
+  bool operator<(const KeyHash& other) const {
+    return hash != other.hash ? hash < other.hash : check < other.check;
+  }
+};
+
+inline KeyHash HashKeyPart(const KeyHash& h, std::string_view part) {
+  return KeyHash{HashKeyPart(h.hash, part), CheckKeyPart(h.check, part)};
+}
+
+inline KeyHash HashKeyPart(const KeyHash& h, int64_t part) {
+  char buf[24];
+  auto res = std::to_chars(buf, buf + sizeof(buf), part);
+  return HashKeyPart(h, std::string_view(buf, res.ptr - buf));
+}
+
+// 由key类型和各组成部分计算复合key，无需拼接字符串
+template <typename... Parts>
+inline KeyHash CounterKeyHash(CounterKey kind, const Parts&... parts) {
+  uint64_t seed = static_cast<uint64_t>(kind) + 1;
+  KeyHash h{seed, static_cast<uint32_t>(seed)};
+  ((h = HashKeyPart(h, parts)), ...);
+  if (h.hash == 0) {
+    h.hash = 1;
+  }
+  return h;
+}
+
+// 解析store中的字符串key为复合key，无法识别的前缀返回false；
+// kind非空时同时给出key的类型
+bool ParseCounterKey(std::string_view key, KeyHash* hash,
+    CounterKey* kind = nullptr);
+
+// CounterKey的位集合
+inline constexpr uint32_t CounterKeyBit(CounterKey kind) {
+  return uint32_t(1) << static_cast<int>(kind);
+}
+
+
+class MappedSnapshot;
+
+// CounterIndex的查找结果：已解析的CountFeatures，或快照文件中的序列化字节
+class CounterRef {
+ public:
+  CounterRef() = default;
+  explicit CounterRef(const CountFeatures* message) : message_(message) {}
+  explicit CounterRef(std::string_view bytes) : bytes_(bytes) {}
+
+  explicit operator bool() const {
+    return message_ != nullptr || bytes_.data() != nullptr;
+  }
+
+  // 覆盖写入out
+  bool CopyTo(CountFeatures* out) const;
+
+ private:
+  const CountFeatures* message_ = nullptr;
+  std::string_view bytes_;
+};
+
+
+// counter的扁平开放寻址索引：复合key -> CountFeatures
+// 索引不持有数据，被索引的Map或快照需比索引活得更久且不再修改。
+// 64位hash相同的不同key凭check区分，都保留，构建时碰撞数记入日志
+class CounterIndex {
+ public:
+  using Counters = google::protobuf::Map<std::string, CountFeatures>;
+
+  CounterIndex() = default;
+  explicit CounterIndex(const Counters& counters) { Build(counters); }
+
+  void Build(const Counters& counters);
+  // 直接索引序列化的消息：blob中field_number字段为map<string, CountFeatures>，
+  // 只定位各entry的value字节，查到时才解析。blob需比索引活得更久；
+  // 格式错误返回false
+  bool BuildFromWire(std::string_view blob, int field_number);
+  // 直接查快照文件自带的hash表，不再建索引
+  void Attach(const MappedSnapshot* mapped);
+
+  template <typename... Parts>
+  CounterRef Find(CounterKey kind, const Parts&... parts) const {
+    return Find(CounterKeyHash(kind, parts...));
+  }
+
+  CounterRef Find(const KeyHash& key) const {
+    if (mapped_ != nullptr) {
+      return FindMapped(key);
+    }
+    if (slots_.empty()) {
+      return CounterRef();
+    }
+    for (auto i = key.hash & mask_; ; i = (i + 1) & mask_) {
+      const auto& slot = slots_[i];
+      if (slot.key == key) {
+        return slot.value;
+      }
+      if (slot.key.hash == 0) {
+        return CounterRef();
+      }
+    }
+  }
+
+  size_t size() const { return size_; }
+  // 索引自身占用的堆内存，不含被索引的数据
+  size_t bytes() const { return slots_.capacity() * sizeof(Slot); }
+
+ private:
+  struct Slot {
+    KeyHash key;
+    CounterRef value;
+  };
+
+  CounterRef FindMapped(const KeyHash& key) const;
+  void Reset(size_t count);
+  // overwrite为true时同一key以后出现的为准（与protobuf解析map的语义一致）
+  void Insert(const KeyHash& key, CounterRef value, bool overwrite);
+  void LogCollisions(const char* source) const;
+
+  std::vector<Slot> slots_;
+  uint64_t mask_ = 0;
+  size_t size_ = 0;
+  size_t collisions_ = 0;  // 构建时hash相同而check不同的key数
+  const MappedSnapshot* mapped_ = nullptr;
+};
+
+}  // end of namespace
@@ -0,0 +1,107 @@
+#include "feature/counter_overlay.h"
+
+#include <algorithm>
+#include <map>
+
+namespace ad {
+
+CounterOverlay::Hit CounterOverlay::Find(const KeyHash& key,
+    std::string_view* value) const {
+  if (shards_.empty()) {
+    return Hit::kMiss;
+  }
+  const auto& shard = shards_[ShardOf(key.hash)];
+  if (shard == nullptr) {
+    return Hit::kMiss;
+  }
+  auto it = std::lower_bound(shard->begin(), shard->end(), key,
+    [] (const Entry& e, const KeyHash& k) { return e.key < k; });
+  if (it == shard->end() || it->key != key) {
+    return Hit::kMiss;
+  }
+  if (it->deleted) {
+    return Hit::kDeleted;
+  }
+  *value = it->value;
+  return Hit::kFound;
+}
+
+
+std::shared_ptr<const CounterOverlay> CounterOverlay::Apply(
+    std::shared_ptr<const MappedSnapshot> delta) const {
+  // 按分片归集本次的修改
+  std::map<size_t, Shard> updates;
+  delta->ForEach([&updates] (const KeyHash& key, std::string_view value,
+      bool deleted) {
+    updates[ShardOf(key.hash)].push_back(Entry{key, value, deleted});
+  });
+
+  auto next = std::make_shared<CounterOverlay>(*this);
+  if (next->shards_.empty()) {
+    next->shards_.resize(size_t(1) << kShardBits);
+  }
+  next->delta_bytes_ += delta->bytes();
+  next->deltas_.push_back(std::move(delta));
+  for (auto& p : updates) {
+    auto& changed = p.second;
+    std::sort(changed.begin(), changed.end(),
+      [] (const Entry& a, const Entry& b) { return a.key < b.key; });
+    // 与旧分片归并，同一key以本次为准
+    auto shard = std::make_shared<Shard>();
+    const auto& old = next->shards_[p.first];
+    size_t old_size = old != nullptr ? old->size() : 0;
+    shard->reserve(old_size + changed.size());
+    size_t i = 0;
+    size_t j = 0;
+    while (i < old_size || j < changed.size()) {
+      if (j == changed.size() ||
+          (i < old_size && (*old)[i].key < changed[j].key)) {
+        shard->push_back((*old)[i++]);
+      } else {
+        if (i < old_size && (*old)[i].key == changed[j].key) {
+          ++i;
+        }
+        shard->push_back(changed[j++]);
+      }
+    }
+    next->size_ += shard->size() - old_size;
+    next->shards_[p.first] = std::move(shard);
+  }
+  if (next->deltas_.size() > kCompactDeltas ||
+      next->delta_bytes_ > kCompactBytes) {
+    next->Compact();
+  }
+  return next;
+}
+
+
+void CounterOverlay::Compact() {
+  size_t total = 0;
+  for (const auto& shard : shards_) {
+    if (shard != nullptr) {
+      for (const auto& e : *shard) {
+        total += e.value.size();
+      }
+    }
+  }
+  // 先定长再写入，之后不再修改，value的指向保持有效
+  auto buf = std::make_shared<std::string>(total, '\0');
+  size_t offset = 0;
+  for (auto& shard : shards_) {
+    if (shard == nullptr) {
+      continue;
+    }
+    auto copy = std::make_shared<Shard>(*shard);
+    for (auto& e : *copy) {
+      std::copy(e.value.begin(), e.value.end(), buf->begin() + offset);
+      e.value = std::string_view(buf->data() + offset, e.value.size());
+      offset += e.value.size();
+    }
+    shard = std::move(copy);
+  }
+  compacted_ = std::move(buf);
+  deltas_.clear();
+  delta_bytes_ = 0;
+}
+
+}  // end of namespace
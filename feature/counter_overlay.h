@@ -0,0 +1,59 @@
+#pragma once
+
+#include <cstdint>
+#include <memory>
+#include <string>
+#include <string_view>
+#include <vector>
+
+#include "feature/snapshot_file.h"
+
+namespace ad {
+
+// ad_counter的增量层：记录全量快照之后upsert和删除的key。
+// 按hash分片写时复制，应用增量只复制被修改的分片，其余分片与上一版本共享；
+// 收到新的全量快照时整体丢弃。
+// 条目的value指向仍在映射的增量文件，映射的文件数或总长度超过上限时，
+// 把仍有效的value拷贝到一块自有内存中并解除对这些文件的引用
+class CounterOverlay {
+ public:
+  enum class Hit {
+    kMiss,     // 增量层没有该key，回落到全量快照
+    kFound,
+    kDeleted,
+  };
+
+  Hit Find(const KeyHash& key, std::string_view* value) const;
+
+  // 返回应用delta后的新版本，this不变
+  std::shared_ptr<const CounterOverlay> Apply(
+      std::shared_ptr<const MappedSnapshot> delta) const;
+
+  size_t size() const { return size_; }
+  size_t mapped_deltas() const { return deltas_.size(); }
+
+ private:
+  static constexpr int kShardBits = 10;
+  static constexpr size_t kCompactDeltas = 16;
+  static constexpr size_t kCompactBytes = size_t(256) << 20;
+
+  struct Entry {
+    KeyHash key;
+    std::string_view value;  // 指向deltas_中的文件
+    bool deleted;
+  };
+  using Shard = std::vector<Entry>;  // 按key有序
+
+  static size_t ShardOf(uint64_t hash) { return hash >> (64 - kShardBits); }
+
+  // 重建所有分片，value改为指向compacted_，清空deltas_
+  void Compact();
+
+  std::vector<std::shared_ptr<const Shard>> shards_;  // 为空表示没有任何key
+  std::vector<std::shared_ptr<const MappedSnapshot>> deltas_;
+  size_t delta_bytes_ = 0;  // deltas_的映射总长度
+  std::shared_ptr<const std::string> compacted_;  // 上次合并时拷出的value
+  size_t size_ = 0;
+};
+
+}  // end of namespace
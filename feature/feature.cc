@@ -4,16 +4,140 @@
 #include <string>
 #include "feature/feature.h"
 #include "metrics/metrics.h"
+#include "rec/parallel_for.h"
 
 namespace ad {
 
+// 填充第i个广告下各素材的Feature，依次写入feature[offset]起的位置
+static void FillAdFeature(
+    const modelx::PredictionRequest &model_request,
+    int32_t i,
+    const std::string &user_id,
+    const Context &context,
+    const CounterIndex &user_counter,
+    const AdInfoSnapshot &store_ad_info,
+    const AdCounterSnapshot &ad_counter,
+    FeatureList &feature,
+    int32_t offset) {
+  const auto &creatives = model_request.creatives(i);
+  // 广告级特征块：同一广告的各素材共用
+  AdInfo ad_info;
+  ad_info.set_ad_id(creatives.camp_id());
+  const std::string &pkg_name = creatives.app_id();
+  ad_info.set_app_id(pkg_name);
+  AdInfoItem scratch;
+  if (auto item = store_ad_info.Find(pkg_name, scratch)) {
+    ad_info.set_category(item->category());
+  }
+  auto adinfo_key = "ad_id#" + std::to_string(ad_info.ad_id());
+  if (auto item = store_ad_info.Find(adinfo_key, scratch)) {
+    ad_info.set_day_attr_install_cap(item->day_attr_install_cap());
+  }
+  ad_info.set_attr_platform(creatives.attr_platform());
+  ad_info.set_is_auto_download(creatives.is_auto_download());
+  ad_info.set_bid_price(creatives.bid_price());
+
+  UserAdFeature user_ad_feature;
+  auto user_ad_count = user_ad_feature.mutable_user_ad_count();
+  if (auto p = user_counter.Find(CounterKey::kUserIdAdId,
+      user_id, ad_info.ad_id())) {
+    p.CopyTo(user_ad_count->mutable_user_id_ad_id());
+  }
+  if (auto p = user_counter.Find(CounterKey::kUserIdAdPackageName,
+      user_id, ad_info.app_id())) {
+    p.CopyTo(user_ad_count->mutable_user_id_ad_package_name());
+  }
+  if (auto p = user_counter.Find(CounterKey::kUserIdAdPackageCategory,
+      user_id, ad_info.category())) {
+    p.CopyTo(user_ad_count->mutable_user_id_ad_package_category());
+  }
+  if (auto p = user_counter.Find(CounterKey::kUserIdPosIdAdId,
+      user_id, context.pos_id(), ad_info.ad_id())) {
+    p.CopyTo(user_ad_count->mutable_user_id_pos_id_ad_id());
+  }
+  if (auto p = user_counter.Find(CounterKey::kUserIdPosIdAdPackageName,
+      user_id, context.pos_id(), ad_info.app_id())) {
+    p.CopyTo(user_ad_count->mutable_user_id_pos_id_ad_package_name());
+  }
+  if (auto p = user_counter.Find(CounterKey::kUserIdPosIdAdPackageCategory,
+      user_id, context.pos_id(), ad_info.category())) {
+    p.CopyTo(user_ad_count->mutable_user_id_pos_id_ad_package_category());
+  }
+
+  AdCount feature_ad_counter;
+  if (auto p = ad_counter.Find(CounterKey::kAdId, ad_info.ad_id())) {
+    p.CopyTo(feature_ad_counter.mutable_ad_id());
+  }
+  if (auto p = ad_counter.Find(CounterKey::kPackageNameAdPackageName,
+      context.app_name(), ad_info.app_id())) {
+    p.CopyTo(feature_ad_counter.mutable_ad_package_name());
+  }
+  if (auto p = ad_counter.Find(CounterKey::kPackageNameAdPackageCategory,
+      context.app_name(), ad_info.category())) {
+    p.CopyTo(feature_ad_counter.mutable_ad_package_category());
+  }
+  if (auto p = ad_counter.Find(CounterKey::kPosIdAdId,
+      context.pos_id(), ad_info.ad_id())) {
+    p.CopyTo(feature_ad_counter.mutable_pos_id_ad_id());
+  }
+  if (auto p = ad_counter.Find(CounterKey::kPosIdAdPackageName,
+      context.pos_id(), ad_info.app_id())) {
+    p.CopyTo(feature_ad_counter.mutable_pos_id_ad_package_name());
+  }
+  if (auto p = ad_counter.Find(CounterKey::kPosIdAdPackageCategory,
+      context.pos_id(), ad_info.category())) {
+    p.CopyTo(feature_ad_counter.mutable_pos_id_ad_package_category());
+  }
+
+  for (int32_t j = 0; j < creatives.creative_size(); ++j) {
+    ad_info.set_creative_id(creatives.creative(j).creative_id());
+    ad_info.set_cp_id(creatives.creative(j).cp_id());
+
+    auto key = "c_id#" + ad_info.creative_id();
+    if (auto item = store_ad_info.Find(key, scratch)) {
+      ad_info.set_creative_create_time(item->creative_create_time());
+    }
+
+    // 素材级特征块；广告级计数需与素材级计数合并在同一AdCount中
+    auto &one_feature = *feature.Mutable(offset + j);
+    one_feature.mutable_ad_data()->mutable_ad_info()->CopyFrom(ad_info);
+    one_feature.mutable_ad_data()->
+        mutable_ad_counter()->CopyFrom(feature_ad_counter);
+    one_feature.mutable_user_ad_feature()->CopyFrom(user_ad_feature);
+
+    auto one_user_ad_count =
+        one_feature.mutable_user_ad_feature()->mutable_user_ad_count();
+    if (auto p = user_counter.Find(CounterKey::kUserIdCId,
+        user_id, ad_info.creative_id())) {
+      p.CopyTo(one_user_ad_count->mutable_user_id_c_id());
+    }
+    if (auto p = user_counter.Find(CounterKey::kUserIdPosIdCId,
+        user_id, context.pos_id(), ad_info.creative_id())) {
+      p.CopyTo(one_user_ad_count->mutable_user_id_pos_id_c_id());
+    }
+
+    auto one_ad_counter = one_feature.mutable_ad_data()->mutable_ad_counter();
+    if (auto p = ad_counter.Find(CounterKey::kPackageNameCId,
+        context.app_name(), ad_info.creative_id())) {
+      p.CopyTo(one_ad_counter->mutable_c_id());
+    }
+    if (auto p = ad_counter.Find(CounterKey::kPosIdCId,
+        context.pos_id(), ad_info.creative_id())) {
+      p.CopyTo(one_ad_counter->mutable_pos_id_c_id());
+    }
+  }
+}
+
+
 bool DataToFeatureInput(
     const ad_model::AdRequest &ad_request,
-    const StoreUserCounter &user_counter,
+    const std::vector<int32_t> &ads,
+    const CounterIndex &user_counter,
     const StoreUserProfile &user_profile,
-    const StoreAdInfo &store_ad_info,
-    const StoreAdCounter &ad_counter,
-    std::vector<Feature> &feature) {
+    const AdInfoSnapshot &store_ad_info,
+    const AdCounterSnapshot &ad_counter,
+    RequestFeature &request_feature,
+    FeatureList &feature) {
   common::Timer timer(data2FeatureInputMs);
 
   struct timeval tv;
@@ -22,22 +146,24 @@ bool DataToFeatureInput(
 
   const auto &model_request = ad_request.request();
 
-  UserProfile feature_user_profile;
+  // 请求级特征块：只构建一次，各素材的Feature以别名方式共享
+  auto &feature_user_profile = request_feature.user_profile;
+  feature_user_profile.Clear();
   feature_user_profile.mutable_user_base()->
       CopyFrom(user_profile.user_base());
   feature_user_profile.mutable_user_behavior()->
       CopyFrom(user_profile.user_behavior());
   feature_user_profile.set_user_id(model_request.user_id());
 
+  const auto &user_id = model_request.user_id();
   UserCount feature_user_counter;
-  std::string key = "user_id#" + model_request.user_id();
-  auto ite = user_counter.store_user_counter().find(key);
-  if (ite != user_counter.store_user_counter().end()) {
-    feature_user_counter.mutable_user_id()->CopyFrom(ite->second);
+  if (auto p = user_counter.Find(CounterKey::kUserId, user_id)) {
+    p.CopyTo(feature_user_counter.mutable_user_id());
   }
   feature_user_profile.mutable_user_counter()->CopyFrom(feature_user_counter);
 
-  Context context;
+  auto &context = request_feature.context;
+  context.Clear();
   context.set_pos_id(model_request.pos_id());
   context.set_network_type(model_request.contexts().network_type());
   context.set_os_version(model_request.contexts().os_version());
@@ -49,173 +175,42 @@ bool DataToFeatureInput(
   context.set_client_ip(model_request.user_ip());
   context.set_req_time(req_time);
 
-  for (int32_t i = 0; i < model_request.creatives_size(); ++i) {
-    AdInfo ad_info;
-    ad_info.set_ad_id(model_request.creatives(i).camp_id());
-    const std::string &pkg_name = model_request.creatives(i).app_id();
-    ad_info.set_app_id(pkg_name);
-    auto ite_info = store_ad_info.ad_infos().find(pkg_name);
-    if (ite_info != store_ad_info.ad_infos().end()) {
-      ad_info.set_category(ite_info->second.category());
-    }
-    auto adinfo_key = "ad_id#" + std::to_string(ad_info.ad_id());
-    auto adinfo_ite = store_ad_info.ad_infos().find(adinfo_key);
-    if (adinfo_ite != store_ad_info.ad_infos().end()) {
-      ad_info.set_day_attr_install_cap(adinfo_ite->second.day_attr_install_cap());
-    }
-    ad_info.set_attr_platform(model_request.creatives(i).attr_platform());
-    ad_info.set_is_auto_download(model_request.creatives(i).is_auto_download());
-    ad_info.set_bid_price(model_request.creatives(i).bid_price());
-
-    UserAdFeature user_ad_feature;
-    std::string key = "user_id#ad_id#" +
-        model_request.user_id() + "#" + std::to_string(ad_info.ad_id());
-    auto ite = user_counter.store_user_counter().find(key);
-    if (ite != user_counter.store_user_counter().end()) {
-      user_ad_feature.mutable_user_ad_count()->
-          mutable_user_id_ad_id()->CopyFrom(ite->second);
-    }
-
-    key = "user_id#ad_package_name#" +
-        model_request.user_id() + "#" + ad_info.app_id();
-    ite = user_counter.store_user_counter().find(key);
-    if (ite != user_counter.store_user_counter().end()) {
-      user_ad_feature.mutable_user_ad_count()->
-          mutable_user_id_ad_package_name()->CopyFrom(ite->second);
-    }
-
-    key = "user_id#ad_package_category#" +
-        model_request.user_id() + "#" + ad_info.category();
-    ite = user_counter.store_user_counter().find(key);
-    if (ite != user_counter.store_user_counter().end()) {
-      user_ad_feature.mutable_user_ad_count()->
-          mutable_user_id_ad_package_category()->CopyFrom(ite->second);
-    }
-
-    key = "user_id#pos_id#ad_id#" + model_request.user_id() +
-        "#" + context.pos_id() + "#" + std::to_string(ad_info.ad_id());
-    ite = user_counter.store_user_counter().find(key);
-    if (ite != user_counter.store_user_counter().end()) {
-      user_ad_feature.mutable_user_ad_count()->
-          mutable_user_id_pos_id_ad_id()->CopyFrom(ite->second);
-    }
-
-    key = "user_id#pos_id#ad_package_name#" + model_request.user_id() +
-        "#" + context.pos_id() + "#" + ad_info.app_id();
-    ite = user_counter.store_user_counter().find(key);
-    if (ite != user_counter.store_user_counter().end()) {
-      user_ad_feature.mutable_user_ad_count()->
-          mutable_user_id_pos_id_ad_package_name()->CopyFrom(ite->second);
-    }
-
-    key = "user_id#pos_id#ad_package_category#" + model_request.user_id() +
-        "#" + context.pos_id() + "#" + ad_info.category();
-    ite = user_counter.store_user_counter().find(key);
-    if (ite != user_counter.store_user_counter().end()) {
-      user_ad_feature.mutable_user_ad_count()->
-          mutable_user_id_pos_id_ad_package_category()->CopyFrom(ite->second);
-    }
-
-
-    AdCount feature_ad_counter;
-    key = "ad_id#" + std::to_string(ad_info.ad_id());
-    auto ite_ad = ad_counter.store_ad_counter().find(key);
-    if (ite_ad != ad_counter.store_ad_counter().end()) {
-      feature_ad_counter.mutable_ad_id()->CopyFrom(ite_ad->second);
-    }
-
-    key = "package_name#ad_package_name#" + context.app_name() +
-        "#" + ad_info.app_id();
-    ite_ad = ad_counter.store_ad_counter().find(key);
-    if (ite_ad != ad_counter.store_ad_counter().end()) {
-      feature_ad_counter.mutable_ad_package_name()->CopyFrom(ite_ad->second);
-    }
+  // 先按顺序创建各素材的Feature，再按广告并行填充
+  std::vector<int32_t> offsets(ads.size() + 1, 0);
+  for (size_t k = 0; k < ads.size(); ++k) {
+    offsets[k + 1] = offsets[k] +
+      model_request.creatives(ads[k]).creative_size();
+  }
+  const int32_t base = feature.size();
+  feature.Reserve(base + offsets.back());
+  for (int32_t i = 0; i < offsets.back(); ++i) {
+    AttachRequestFeature(request_feature, feature.Add());
+  }
 
-    key = "package_name#ad_package_category#" + context.app_name() +
-        "#" + ad_info.category();
-    ite_ad = ad_counter.store_ad_counter().find(key);
-    if (ite_ad != ad_counter.store_ad_counter().end()) {
-      feature_ad_counter.mutable_ad_package_category()->
-          CopyFrom(ite_ad->second);
-    }
+  static ParallelCost cost(20000);
+  ParallelFor(ads.size(), cost,
+      [&] (size_t begin, size_t end) {
+        for (size_t k = begin; k < end; ++k) {
+          FillAdFeature(model_request, ads[k], user_id, context,
+              user_counter, store_ad_info, ad_counter, feature,
+              base + offsets[k]);
+        }
+        return true;
+      });
+  return true;
+}
 
-    key = "pos_id#ad_id#" + context.pos_id() + "#" +
-        std::to_string(ad_info.ad_id());
-    ite_ad = ad_counter.store_ad_counter().find(key);
-    if (ite_ad != ad_counter.store_ad_counter().end()) {
-      feature_ad_counter.mutable_pos_id_ad_id()->CopyFrom(ite_ad->second);
-    }
 
-    key = "pos_id#ad_package_name#" + context.pos_id() + "#" + ad_info.app_id();
-    ite_ad = ad_counter.store_ad_counter().find(key);
-    if (ite_ad != ad_counter.store_ad_counter().end()) {
-      feature_ad_counter.mutable_pos_id_ad_package_name()->
-          CopyFrom(ite_ad->second);
-    }
+void AttachRequestFeature(RequestFeature &request_feature, Feature *feature) {
+  feature->unsafe_arena_set_allocated_context(&request_feature.context);
+  feature->unsafe_arena_set_allocated_user_profile(
+      &request_feature.user_profile);
+}
 
-    key = "pos_id#ad_package_category#" + context.pos_id() +
-        "#" + ad_info.category();
-    ite_ad = ad_counter.store_ad_counter().find(key);
-    if (ite_ad != ad_counter.store_ad_counter().end()) {
-      feature_ad_counter.mutable_pos_id_ad_package_category()->
-          CopyFrom(ite_ad->second);
-    }
 
-    for (int32_t j = 0; j < model_request.creatives(i).creative_size(); ++j) {
-      ad_info.set_creative_id(
-          model_request.creatives(i).creative(j).creative_id());
-      ad_info.set_cp_id(model_request.creatives(i).creative(j).cp_id());
-
-      key = "c_id#" + ad_info.creative_id();
-      auto ite_info = store_ad_info.ad_infos().find(key);
-      if (ite_info != store_ad_info.ad_infos().end()) {
-        ad_info.set_creative_create_time(
-            ite_info->second.creative_create_time());
-      }
-
-      Feature one_feature;
-      one_feature.mutable_context()->CopyFrom(context);
-      one_feature.mutable_user_profile()->CopyFrom(feature_user_profile);
-      one_feature.mutable_ad_data()->mutable_ad_info()->CopyFrom(ad_info);
-      one_feature.mutable_ad_data()->
-          mutable_ad_counter()->CopyFrom(feature_ad_counter);
-      one_feature.mutable_user_ad_feature()->CopyFrom(user_ad_feature);
-
-      key = "user_id#c_id#" +
-          model_request.user_id() + "#" + ad_info.creative_id();
-      auto ite = user_counter.store_user_counter().find(key);
-      if (ite != user_counter.store_user_counter().end()) {
-        one_feature.mutable_user_ad_feature()->mutable_user_ad_count()->
-            mutable_user_id_c_id()->CopyFrom(ite->second);
-      }
-
-      key = "user_id#pos_id#c_id#" + model_request.user_id() +
-          "#" + context.pos_id() + "#" + ad_info.creative_id();
-      ite = user_counter.store_user_counter().find(key);
-      if (ite != user_counter.store_user_counter().end()) {
-        one_feature.mutable_user_ad_feature()->mutable_user_ad_count()->
-            mutable_user_id_pos_id_c_id()->CopyFrom(ite->second);
-      }
-
-      key = "package_name#c_id#" + context.app_name() +
-          "#" + ad_info.creative_id();
-      auto ite_ad = ad_counter.store_ad_counter().find(key);
-      if (ite_ad != ad_counter.store_ad_counter().end()) {
-        one_feature.mutable_ad_data()->mutable_ad_counter()->
-            mutable_c_id()->CopyFrom(ite_ad->second);
-      }
-
-      key = "pos_id#c_id#" + context.pos_id() + "#" + ad_info.creative_id();
-      ite_ad = ad_counter.store_ad_counter().find(key);
-      if (ite_ad != ad_counter.store_ad_counter().end()) {
-        one_feature.mutable_ad_data()->mutable_ad_counter()->
-            mutable_pos_id_c_id()->CopyFrom(ite_ad->second);
-      }
-
-      feature.push_back(one_feature);
-    }
-  }
-  return true;
+void DetachRequestFeature(Feature *feature) {
+  feature->unsafe_arena_release_context();
+  feature->unsafe_arena_release_user_profile();
 }
 
 }  // namespace ad
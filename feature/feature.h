@@ -1,26 +1,108 @@
 #pragma once
 
+#include <memory>
+#include <string>
+#include <type_traits>
+#include <vector>
+
+#include <google/protobuf/repeated_field.h>
 #include <nlohmann/json.hpp>
 
 #include "ad_model_service.pb.h"
+#include "feature/counter_index.h"
+#include "feature/counter_overlay.h"
+#include "feature/snapshot_file.h"
+#include "feature/stats_prior.h"
 #include "model_feature.pb.h"
 #include "store_table.pb.h"
 
 namespace ad {
 
+using AdInfoItem = std::remove_reference_t<
+  decltype(std::declval<const StoreAdInfo&>().ad_infos())>::mapped_type;
+
+// ad_info快照，随文件更新整体替换；mapped非空时数据在快照文件中，store为空
+struct AdInfoSnapshot {
+  StoreAdInfo store;
+  std::shared_ptr<const MappedSnapshot> mapped;
+  uint64_t version = 0;  // 发布时分配，与ad_counter共用一个递增序列
+  uint64_t content_hash = 0;  // 文件内容的hash，回放时据此校验数据一致
+
+  // 找到时返回store中的元素，或解析到scratch后返回&scratch
+  const AdInfoItem* Find(const std::string& key, AdInfoItem& scratch) const;
+  size_t size() const;
+};
+
+// ad_counter全量数据及其索引，随全量文件更新整体替换；
+// mapped非空时index直接查快照文件，store为空
+struct AdCounterBase {
+  StoreAdCounter store;
+  std::shared_ptr<const MappedSnapshot> mapped;
+  CounterIndex index;
+};
+
+// ad_counter的一个版本：全量 + 增量层。应用增量时只替换overlay，base共享
+struct AdCounterSnapshot {
+  std::shared_ptr<const AdCounterBase> base;
+  std::shared_ptr<const CounterOverlay> overlay;
+  uint64_t seq = 0;  // 全量文件或最近一次增量的seq
+  uint64_t version = 0;  // 发布时分配，全量和增量都会变化
+  uint64_t content_hash = 0;  // 全量文件及之后依次应用的增量文件内容的hash
+  std::shared_ptr<const StatsPrior> prior;  // 与base、overlay对应
+
+  template <typename... Parts>
+  CounterRef Find(CounterKey kind, const Parts&... parts) const {
+    auto key = CounterKeyHash(kind, parts...);
+    std::string_view value;
+    switch (overlay->Find(key, &value)) {
+      case CounterOverlay::Hit::kFound:
+        return CounterRef(value);
+      case CounterOverlay::Hit::kDeleted:
+        return CounterRef();
+      default:
+        return base->index.Find(key);
+    }
+  }
+};
+
+// 请求内所有素材的Feature，一般分配在请求的Arena上
+using FeatureList = google::protobuf::RepeatedPtrField<Feature>;
+
+// 请求级特征块：user和context，每个请求只构建一次
+// 各素材的Feature通过别名共享，不做拷贝
+struct RequestFeature {
+  Context context;
+  UserProfile user_profile;
+};
+
+// 生成的feature均以别名方式引用request_feature，
+// 在request_feature析构前须对每个feature调用DetachRequestFeature。
+// ads为要展开的广告在请求中的下标，未列出的广告不生成feature
 bool DataToFeatureInput(
   const ad_model::AdRequest& ad_request,
-  const StoreUserCounter& user_counter,
+  const std::vector<int32_t>& ads,
+  const CounterIndex& user_counter,
   const StoreUserProfile& user_profile,
-  const StoreAdInfo& ad_info,
-  const StoreAdCounter& ad_counter,
-  std::vector<Feature> &feature
+  const AdInfoSnapshot& ad_info,
+  const AdCounterSnapshot& ad_counter,
+  RequestFeature& request_feature,
+  FeatureList &feature
 );
 
+// 将请求级特征块以别名方式挂到feature上
+void AttachRequestFeature(RequestFeature& request_feature, Feature* feature);
+
+// 解除别名，feature析构或Clear前必须调用，否则会释放共享的特征块
+void DetachRequestFeature(Feature* feature);
+
+// 加载数据时计算content_hash，供流量录制和回放校验数据一致；
+// 须在InitFeature之前调用，配置了"traffic_record"的enable时InitFeature自动开启
+void EnableContentHash();
+
 bool InitFeature(const nlohmann::json& conf);
 
-std::shared_ptr<StoreAdInfo> GetStoreAdInfo();
+std::shared_ptr<AdInfoSnapshot> GetStoreAdInfo();
 
-std::shared_ptr<StoreAdCounter> GetStoreAdCounter();
+std::shared_ptr<AdCounterSnapshot> GetStoreAdCounter();
 
 }  // end of namespace
@@ -1,6 +1,10 @@
 #include <atomic>
+#include <cstring>
 #include <memory>
+#include <mutex>
+#include <string_view>
 
+#include "feature/ad_cap.h"
 #include "feature/feature.h"
 #include "file_watcher.h"
 #include "metrics/metrics.h"
@@ -10,9 +14,164 @@
 namespace ad {
 
 std::string ad_info_filename;
-static std::shared_ptr<StoreAdInfo> ad_info;
+static std::shared_ptr<AdInfoSnapshot> ad_info;
 std::string ad_counter_filename;
-static std::shared_ptr<StoreAdCounter> ad_counter;
+static std::shared_ptr<AdCounterSnapshot> ad_counter;
+std::string ad_counter_delta_filename;
+// 全量和增量回调都基于当前版本生成新版本，需串行
+static std::mutex ad_counter_update_mutex;
+static std::shared_ptr<const AdCapTable> ad_cap_table;
+// ad_info和ad_counter每发布一个版本加一
+static std::atomic<uint64_t> snapshot_version{0};
+static std::mutex ad_cap_mutex;
+// 为true时加载mmap快照文件（.snap），否则解析protobuf文件（.pb）
+static bool use_mmap_snapshot = false;
+// 开启流量录制或回放时才计算content_hash，否则为0
+static bool content_hash_enabled = false;
+
+
+const AdInfoItem* AdInfoSnapshot::Find(const std::string& key,
+    AdInfoItem& scratch) const {
+  if (mapped != nullptr) {
+    auto bytes = mapped->Find(AdInfoKeyHash(key));
+    if (bytes.data() == nullptr ||
+        !scratch.ParseFromArray(bytes.data(), bytes.size())) {
+      return nullptr;
+    }
+    return &scratch;
+  }
+  auto it = store.ad_infos().find(key);
+  return it != store.ad_infos().end() ? &it->second : nullptr;
+}
+
+
+size_t AdInfoSnapshot::size() const {
+  return mapped != nullptr ? mapped->size() : store.ad_infos().size();
+}
+
+
+void EnableContentHash() {
+  content_hash_enabled = true;
+}
+
+
+// 文件内容的64位hash，按8字节分块，只在加载时计算一次；
+// 未开启时返回0，不读文件内容
+static uint64_t ContentHash(uint64_t seed, std::string_view data) {
+  if (!content_hash_enabled) {
+    return 0;
+  }
+  uint64_t h = seed ^ (data.size() * 0x9e3779b97f4a7c15ULL);
+  auto mix = [&h] (uint64_t v) {
+    h ^= v * 0xbf58476d1ce4e5b9ULL;
+    h = (h << 31 | h >> 33) * 0x94d049bb133111ebULL;
+  };
+  size_t i = 0;
+  for (; i + 8 <= data.size(); i += 8) {
+    uint64_t v;
+    memcpy(&v, data.data() + i, sizeof(v));
+    mix(v);
+  }
+  if (i < data.size()) {
+    uint64_t tail = 0;
+    memcpy(&tail, data.data() + i, data.size() - i);
+    mix(tail);
+  }
+  return HashKeyPart(h, std::string_view());
+}
+
+
+// content为文件内容；mmap格式下直接映射文件，不使用content
+static std::shared_ptr<AdInfoSnapshot> LoadAdInfo(const std::string& content) {
+  auto p = std::make_shared<AdInfoSnapshot>();
+  p->version = ++snapshot_version;
+  if (use_mmap_snapshot) {
+    p->mapped = MappedSnapshot::Open(ad_info_filename, SnapshotKind::kAdInfo);
+    if (p->mapped == nullptr) {
+      return nullptr;
+    }
+    p->content_hash = ContentHash(0, p->mapped->contents());
+    return p;
+  }
+  p->content_hash = ContentHash(0, content);
+  return p->store.ParseFromString(content) ? p : nullptr;
+}
+
+
+// 全量文件生成新版本，丢弃之前的增量层；pb格式的全量seq为0
+static std::shared_ptr<AdCounterSnapshot> LoadAdCounter(
+    const std::string& content) {
+  auto base = std::make_shared<AdCounterBase>();
+  uint64_t seq = 0;
+  uint64_t content_hash = 0;
+  if (use_mmap_snapshot) {
+    base->mapped = MappedSnapshot::Open(ad_counter_filename,
+      SnapshotKind::kAdCounter);
+    if (base->mapped == nullptr) {
+      return nullptr;
+    }
+    base->index.Attach(base->mapped.get());
+    seq = base->mapped->seq();
+    content_hash = ContentHash(0, base->mapped->contents());
+  } else {
+    content_hash = ContentHash(0, content);
+    if (!base->store.ParseFromString(content)) {
+      return nullptr;
+    }
+    // 索引指向base->store中的元素，须在发布前建好
+    base->index.Build(base->store.store_ad_counter());
+  }
+  auto p = std::make_shared<AdCounterSnapshot>();
+  p->version = ++snapshot_version;
+  p->prior = StatsPrior::Build(*base);
+  p->base = std::move(base);
+  p->overlay = std::make_shared<CounterOverlay>();
+  p->seq = seq;
+  p->content_hash = content_hash;
+  return p;
+}
+
+
+// ad_info或ad_counter发布新版本后调用，按当前的两份数据重算超预算广告
+static void RebuildAdCapTable() {
+  std::lock_guard<std::mutex> lock(ad_cap_mutex);
+  auto table = AdCapTable::Build(*GetStoreAdInfo(), *GetStoreAdCounter());
+  std::atomic_store_explicit(&ad_cap_table, table, std::memory_order_release);
+  common::Stats::get()->AddMetric(adCapTableSize, table->size());
+}
+
+
+// 在当前版本上应用增量文件，base_seq须与当前版本的seq一致
+static void ApplyAdCounterDelta() {
+  auto delta = MappedSnapshot::Open(ad_counter_delta_filename,
+    SnapshotKind::kAdCounterDelta);
+  if (delta == nullptr) {
+    common::Stats::get()->Incr(adCounterParseError);
+    LOG_ERROR("ad_counter delta load failed");
+    return;
+  }
+  std::lock_guard<std::mutex> lock(ad_counter_update_mutex);
+  auto cur = GetStoreAdCounter();
+  if (delta->base_seq() != cur->seq || delta->seq() <= cur->seq) {
+    common::Stats::get()->Incr(adCounterDeltaSkip);
+    LOG_ERROR("ad_counter delta skipped, cur seq=" << cur->seq
+      << " delta base_seq=" << delta->base_seq() << " seq=" << delta->seq());
+    return;
+  }
+  auto p = std::make_shared<AdCounterSnapshot>(*cur);
+  p->version = ++snapshot_version;
+  p->seq = delta->seq();
+  p->content_hash = ContentHash(cur->content_hash, delta->contents());
+  auto changed = delta->size();
+  p->prior = cur->prior->Apply(*delta);
+  p->overlay = cur->overlay->Apply(std::move(delta));
+  std::atomic_store_explicit(&ad_counter, p, std::memory_order_release);
+  common::Stats::get()->AddMetric(adCounterOverlaySize, p->overlay->size());
+  LOG_INFO("ad_counter delta applied, seq=" << p->seq << " changed=" << changed
+    << " overlay sz=" << p->overlay->size()
+    << " mapped deltas=" << p->overlay->mapped_deltas());
+  RebuildAdCapTable();
+}
 
 
 // 解析配置；加载文件并解析为protobuf；注册filewatcher监控文件变动并解析更新
@@ -36,26 +195,47 @@ bool InitFeature(const nlohmann::json& conf) {
     return false;
   }
 
+  // "snapshot_format": "mmap" 时读取由snapshot_convert生成的.snap文件
+  auto format = it_s3.value().value("snapshot_format", std::string("pb"));
+  if (format != "pb" && format != "mmap") {
+    LOG_ERROR("s3 snapshot_format invalid: " << format);
+    return false;
+  }
+  use_mmap_snapshot = (format == "mmap");
+  auto it_record = conf.find("traffic_record");
+  if (it_record != conf.end() && it_record.value().is_object() &&
+      it_record.value().value("enable", false)) {
+    EnableContentHash();
+  }
+  const char* suffix = use_mmap_snapshot ? ".snap" : ".pb";
+
   ad_info_filename = it_path.value().get<std::string>() + "/" +
-                     it_sub.value().get<std::string>() + "/ad_info.pb";
+                     it_sub.value().get<std::string>() + "/ad_info" + suffix;
   ad_counter_filename = it_path.value().get<std::string>() + "/" +
-                        it_sub.value().get<std::string>() + "/ad_counter.pb";
-  ad_info = std::make_shared<StoreAdInfo>();
-  ad_counter = std::make_shared<StoreAdCounter>();
-  if (!ad_info->ParseFromString(ReadFile(ad_info_filename)) ||
-      !ad_counter->ParseFromString(ReadFile(ad_counter_filename))) {
+                        it_sub.value().get<std::string>() + "/ad_counter" +
+                        suffix;
+  ad_info = LoadAdInfo(
+    use_mmap_snapshot ? std::string() : ReadFile(ad_info_filename));
+  ad_counter = LoadAdCounter(
+    use_mmap_snapshot ? std::string() : ReadFile(ad_counter_filename));
+  if (ad_info == nullptr || ad_counter == nullptr) {
     LOG_ERROR("parse ad_info or ad_counter failed");
     return false;
   }
-  LOG_INFO("ad_info init size=" << ad_info->ad_infos().size()
-    << " ad_counter init size=" << ad_counter->store_ad_counter().size());
+  LOG_INFO("ad_info init size=" << ad_info->size()
+    << " hash=" << ad_info->content_hash
+    << " ad_counter init size=" << ad_counter->base->index.size()
+    << " hash=" << ad_counter->content_hash << " format=" << format);
+  RebuildAdCapTable();
 
   bool b_ad_info = common::FileWatcher::Instance()->AddFile(ad_info_filename,
     [] (std::string content) {
-      auto p = std::make_shared<StoreAdInfo>();
-      if (p->ParseFromString(content)) {
+      auto p = LoadAdInfo(content);
+      if (p != nullptr) {
         std::atomic_store_explicit(&ad_info, p, std::memory_order_release);
-        LOG_INFO("ad_info parse succ, size=" << p->ad_infos().size());
+        LOG_INFO("ad_info parse succ, size=" << p->size() << " hash="
+          << p->content_hash);
+        RebuildAdCapTable();
       } else {
         common::Stats::get()->Incr(adInfoParseError);
         LOG_ERROR("ad_info parse failed");
@@ -63,26 +243,45 @@ bool InitFeature(const nlohmann::json& conf) {
     });
   bool b_ad_cnt = common::FileWatcher::Instance()->AddFile(ad_counter_filename,
     [] (std::string content) {
-      auto p = std::make_shared<StoreAdCounter>();
-      if (p->ParseFromString(content)) {
+      auto p = LoadAdCounter(content);
+      if (p != nullptr) {
+        std::lock_guard<std::mutex> lock(ad_counter_update_mutex);
         std::atomic_store_explicit(&ad_counter, p, std::memory_order_release);
-        LOG_INFO("ad_counter parse succ, sz=" << p->store_ad_counter().size());
+        LOG_INFO("ad_counter parse succ, index sz=" << p->base->index.size()
+          << " seq=" << p->seq << " hash=" << p->content_hash);
+        RebuildAdCapTable();
       } else {
         common::Stats::get()->Incr(adCounterParseError);
         LOG_ERROR("ad_counter parse failed");
       }
     });
-  return b_ad_info && b_ad_cnt;
+
+  // "ad_counter_delta": true 时监控ad_counter.delta增量文件（快照格式）
+  bool b_ad_delta = true;
+  auto it_delta = it_s3.value().find("ad_counter_delta");
+  if (it_delta != it_s3.value().end() && it_delta.value().is_boolean() &&
+      it_delta.value().get<bool>()) {
+    ad_counter_delta_filename = it_path.value().get<std::string>() + "/" +
+      it_sub.value().get<std::string>() + "/ad_counter.delta";
+    b_ad_delta = common::FileWatcher::Instance()->AddFile(
+      ad_counter_delta_filename, [] (std::string) { ApplyAdCounterDelta(); });
+  }
+  return b_ad_info && b_ad_cnt && b_ad_delta;
 }
 
 
-std::shared_ptr<StoreAdInfo> GetStoreAdInfo() {
+std::shared_ptr<AdInfoSnapshot> GetStoreAdInfo() {
   return std::atomic_load_explicit(&ad_info, std::memory_order_acquire);
 }
 
 
-std::shared_ptr<StoreAdCounter> GetStoreAdCounter() {
+std::shared_ptr<AdCounterSnapshot> GetStoreAdCounter() {
   return std::atomic_load_explicit(&ad_counter, std::memory_order_acquire);
 }
 
+
+std::shared_ptr<const AdCapTable> GetAdCapTable() {
+  return std::atomic_load_explicit(&ad_cap_table, std::memory_order_acquire);
+}
+
 }  // end of namespace
\ No newline at end of file
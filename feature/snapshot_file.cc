@@ -0,0 +1,247 @@
+#include "feature/snapshot_file.h"
+
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+#include <cstdio>
+#include <cstring>
+#include <fstream>
+
+#include "util/log.h"
+
+namespace ad {
+
+// 文件布局（小端）：Header | Slot[slot_count] | data
+// slot_count为2的幂，开放寻址，hash为0的slot为空
+// slot标记的最高8位记录key类型，为0时（此前写出的文件）按未记录处理
+namespace {
+
+constexpr char kMagic[8] = {'A', 'D', 'S', 'N', 'A', 'P', '0', '1'};
+constexpr uint32_t kVersion = 1;
+
+struct Header {
+  char magic[8];
+  uint32_t version;
+  uint32_t kind;
+  uint64_t slot_count;
+  uint64_t entry_count;
+  uint64_t data_offset;
+  uint64_t data_size;
+  uint64_t base_seq;
+  uint64_t seq;
+};
+static_assert(sizeof(Header) == 64, "snapshot header layout");
+
+constexpr int kOffsetBits = 48;
+constexpr uint64_t kOffsetMask = (uint64_t(1) << kOffsetBits) - 1;
+constexpr uint64_t kSlotDeleted = uint64_t(1) << kOffsetBits;
+constexpr int kKeyKindShift = 56;
+
+}  // namespace
+
+struct MappedSnapshot::Slot {
+  uint64_t hash;
+  uint32_t check;
+  uint32_t size;
+  uint64_t offset_flags;  // 低48位为相对data起始的偏移，高16位为标记
+
+  uint64_t offset() const { return offset_flags & kOffsetMask; }
+  bool deleted() const { return offset_flags & kSlotDeleted; }
+  uint8_t key_kind() const { return offset_flags >> kKeyKindShift; }
+};
+static_assert(sizeof(MappedSnapshot::Slot) == 24, "snapshot slot layout");
+
+
+MappedSnapshot::~MappedSnapshot() {
+  if (base_ != nullptr) {
+    munmap(base_, length_);
+  }
+}
+
+
+std::shared_ptr<MappedSnapshot> MappedSnapshot::Open(const std::string& path,
+    SnapshotKind kind) {
+  int fd = open(path.c_str(), O_RDONLY | O_CLOEXEC);
+  if (fd < 0) {
+    LOG_ERROR("open snapshot failed: " << path);
+    return nullptr;
+  }
+  struct stat st;
+  if (fstat(fd, &st) != 0 ||
+      static_cast<size_t>(st.st_size) < sizeof(Header)) {
+    close(fd);
+    LOG_ERROR("snapshot too small: " << path);
+    return nullptr;
+  }
+  size_t length = st.st_size;
+  void* base = mmap(nullptr, length, PROT_READ, MAP_SHARED, fd, 0);
+  close(fd);
+  if (base == MAP_FAILED) {
+    LOG_ERROR("mmap snapshot failed: " << path);
+    return nullptr;
+  }
+  std::shared_ptr<MappedSnapshot> snapshot(new MappedSnapshot());
+  snapshot->base_ = base;
+  snapshot->length_ = length;
+
+  // 校验头部和hash表，保证之后的Find不会越界
+  const auto* header = static_cast<const Header*>(base);
+  uint64_t slot_count = header->slot_count;
+  uint64_t slots_end = sizeof(Header) + slot_count * sizeof(Slot);
+  if (memcmp(header->magic, kMagic, sizeof(kMagic)) != 0 ||
+      header->version != kVersion ||
+      header->kind != static_cast<uint32_t>(kind) ||
+      slot_count == 0 || (slot_count & (slot_count - 1)) != 0 ||
+      slot_count > length / sizeof(Slot) ||
+      header->data_offset < slots_end ||
+      header->data_offset > length ||
+      header->data_size > length - header->data_offset) {
+    LOG_ERROR("snapshot header invalid: " << path);
+    return nullptr;
+  }
+  snapshot->slots_ = reinterpret_cast<const Slot*>(
+    static_cast<const char*>(base) + sizeof(Header));
+  snapshot->mask_ = slot_count - 1;
+  snapshot->data_ = static_cast<const char*>(base) + header->data_offset;
+  snapshot->base_seq_ = header->base_seq;
+  snapshot->seq_ = header->seq;
+  size_t entries = 0;
+  for (uint64_t i = 0; i < slot_count; ++i) {
+    const auto& slot = snapshot->slots_[i];
+    if (slot.hash == 0) {
+      continue;
+    }
+    if (slot.offset() > header->data_size ||
+        slot.size > header->data_size - slot.offset()) {
+      LOG_ERROR("snapshot slot out of range: " << path);
+      return nullptr;
+    }
+    if (slot.deleted() && kind != SnapshotKind::kAdCounterDelta) {
+      LOG_ERROR("snapshot tombstone in full snapshot: " << path);
+      return nullptr;
+    }
+    ++entries;
+  }
+  // 至少一个空slot，否则查找未命中时不会终止
+  if (entries != header->entry_count || entries >= slot_count) {
+    LOG_ERROR("snapshot entry count mismatch: " << path);
+    return nullptr;
+  }
+  snapshot->entry_count_ = entries;
+  madvise(base, length, MADV_WILLNEED);
+  return snapshot;
+}
+
+
+std::string_view MappedSnapshot::Find(const KeyHash& key) const {
+  for (auto i = key.hash & mask_; ; i = (i + 1) & mask_) {
+    const auto& slot = slots_[i];
+    if (slot.hash == key.hash && slot.check == key.check) {
+      return std::string_view(data_ + slot.offset(), slot.size);
+    }
+    if (slot.hash == 0) {
+      return std::string_view();
+    }
+  }
+}
+
+
+void MappedSnapshot::ForEach(const EntryFn& fn) const {
+  ForEach(~uint32_t(0), fn);
+}
+
+
+void MappedSnapshot::ForEach(uint32_t kinds, const EntryFn& fn) const {
+  for (uint64_t i = 0; i <= mask_; ++i) {
+    const auto& slot = slots_[i];
+    auto kind = slot.key_kind();
+    if (slot.hash != 0 &&
+        (kind == 0 || kind > 32 || (kinds >> (kind - 1) & 1))) {
+      fn(KeyHash{slot.hash, slot.check},
+        std::string_view(data_ + slot.offset(), slot.size), slot.deleted());
+    }
+  }
+}
+
+
+int64_t WriteSnapshot(const std::string& path, SnapshotKind kind,
+    uint64_t base_seq, uint64_t seq, const std::vector<SnapshotEntry>& entries) {
+  uint64_t slot_count = 16;
+  while (slot_count < entries.size() * 2) {
+    slot_count <<= 1;
+  }
+  std::vector<MappedSnapshot::Slot> slots(slot_count,
+    MappedSnapshot::Slot{0, 0, 0, 0});
+  std::string data;
+  uint64_t entry_count = 0;
+  uint64_t collisions = 0;
+  for (const auto& entry : entries) {
+    const auto& key = entry.key;
+    if (key.hash == 0 || entry.value.size() > UINT32_MAX ||
+        (entry.deleted && kind != SnapshotKind::kAdCounterDelta)) {
+      LOG_ERROR("snapshot entry invalid, hash=" << key.hash);
+      return -1;
+    }
+    auto i = key.hash & (slot_count - 1);
+    bool duplicate = false;
+    for (; slots[i].hash != 0; i = (i + 1) & (slot_count - 1)) {
+      if (slots[i].hash == key.hash) {
+        if (slots[i].check == key.check) {
+          duplicate = true;
+          break;
+        }
+        ++collisions;
+      }
+    }
+    if (duplicate) {
+      continue;
+    }
+    if (data.size() + entry.value.size() > kOffsetMask) {
+      LOG_ERROR("snapshot data too large: " << path);
+      return -1;
+    }
+    slots[i] = MappedSnapshot::Slot{key.hash, key.check,
+      static_cast<uint32_t>(entry.value.size()),
+      data.size() | (entry.deleted ? kSlotDeleted : 0) |
+        uint64_t(entry.key_kind) << kKeyKindShift};
+    data.append(entry.value);
+    ++entry_count;
+  }
+  if (collisions > 0) {
+    LOG_ERROR("snapshot key hash collision: " << path << " collisions="
+      << collisions << " entries=" << entry_count);
+  }
+
+  Header header;
+  memcpy(header.magic, kMagic, sizeof(kMagic));
+  header.version = kVersion;
+  header.kind = static_cast<uint32_t>(kind);
+  header.slot_count = slot_count;
+  header.entry_count = entry_count;
+  header.data_offset = sizeof(Header) + slot_count * sizeof(slots[0]);
+  header.data_size = data.size();
+  header.base_seq = base_seq;
+  header.seq = seq;
+
+  auto tmp_path = path + ".tmp";
+  {
+    std::ofstream out(tmp_path, std::ios::binary | std::ios::trunc);
+    out.write(reinterpret_cast<const char*>(&header), sizeof(header));
+    out.write(reinterpret_cast<const char*>(slots.data()),
+      slots.size() * sizeof(slots[0]));
+    out.write(data.data(), data.size());
+    if (!out.flush()) {
+      LOG_ERROR("write snapshot failed: " << tmp_path);
+      return -1;
+    }
+  }
+  if (rename(tmp_path.c_str(), path.c_str()) != 0) {
+    LOG_ERROR("rename snapshot failed: " << tmp_path << " -> " << path);
+    return -1;
+  }
+  return entry_count;
+}
+
+}  // end of namespace
@@ -0,0 +1,99 @@
+#pragma once
+
+#include <cstdint>
+#include <functional>
+#include <memory>
+#include <string>
+#include <string_view>
+#include <vector>
+
+#include "feature/counter_index.h"
+
+namespace ad {
+
+enum class SnapshotKind : uint32_t {
+  kAdInfo = 1,
+  kAdCounter = 2,
+  kAdCounterDelta = 3,  // 只含upsert和删除的key，作用在seq为base_seq的版本上
+};
+
+
+struct SnapshotEntry {
+  KeyHash key;
+  std::string value;
+  bool deleted = false;  // 只允许出现在增量文件中
+  uint8_t key_kind = 0;  // ad_counter为SnapshotKeyKind(CounterKey)，0表示未记录
+};
+
+inline uint8_t SnapshotKeyKind(CounterKey kind) {
+  return static_cast<uint8_t>(kind) + 1;
+}
+
+
+// 只读快照文件：key的hash（KeyHash）-> 序列化的protobuf消息。
+// 文件以mmap映射，加载时只校验头部和hash表，不解析消息；
+// 多个进程映射同一文件时共享page cache
+class MappedSnapshot {
+ public:
+  ~MappedSnapshot();
+
+  MappedSnapshot(const MappedSnapshot&) = delete;
+  MappedSnapshot& operator=(const MappedSnapshot&) = delete;
+
+  // 文件须整体rename替换，原地改写会使已映射的进程读到SIGBUS
+  static std::shared_ptr<MappedSnapshot> Open(const std::string& path,
+      SnapshotKind kind);
+
+  // 未找到时返回值的data()为nullptr
+  std::string_view Find(const KeyHash& key) const;
+
+  using EntryFn = std::function<void (const KeyHash& key,
+      std::string_view value, bool deleted)>;
+  // 按slot顺序遍历所有条目
+  void ForEach(const EntryFn& fn) const;
+  // 只遍历key类型属于kinds（CounterKeyBit的组合）的条目，
+  // 未记录类型的条目总会遍历
+  void ForEach(uint32_t kinds, const EntryFn& fn) const;
+
+  size_t size() const { return entry_count_; }
+  size_t bytes() const { return length_; }  // 映射的文件长度
+  // 整个文件的内容
+  std::string_view contents() const {
+    return std::string_view(static_cast<const char*>(base_), length_);
+  }
+  uint64_t base_seq() const { return base_seq_; }
+  uint64_t seq() const { return seq_; }
+
+  struct Slot;  // hash表项，WriteSnapshot按同一布局写出
+
+ private:
+  MappedSnapshot() = default;
+
+  void* base_ = nullptr;
+  size_t length_ = 0;
+  const Slot* slots_ = nullptr;
+  uint64_t mask_ = 0;
+  const char* data_ = nullptr;
+  size_t entry_count_ = 0;
+  uint64_t base_seq_ = 0;
+  uint64_t seq_ = 0;
+};
+
+
+// 写快照文件：先写临时文件再rename到path；key重复时保留先出现的一项，
+// 只有64位hash相同的不同key都会写入，碰撞数记入日志。
+// 全量文件的base_seq为0。返回写入的条目数，失败返回-1
+int64_t WriteSnapshot(const std::string& path, SnapshotKind kind,
+    uint64_t base_seq, uint64_t seq, const std::vector<SnapshotEntry>& entries);
+
+
+// ad_info的key（包名、"ad_id#..."、"c_id#..."）整串参与hash
+inline KeyHash AdInfoKeyHash(std::string_view key) {
+  KeyHash h = HashKeyPart(KeyHash(), key);
+  if (h.hash == 0) {
+    h.hash = 1;
+  }
+  return h;
+}
+
+}  // end of namespace
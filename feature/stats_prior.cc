@@ -0,0 +1,355 @@
+#include "feature/stats_prior.h"
+
+#include <algorithm>
+#include <cmath>
+#include <limits>
+#include <map>
+#include <string>
+#include <type_traits>
+#include <utility>
+
+#include "feature/feature.h"
+#include "util/log.h"
+
+namespace ad {
+
+namespace {
+
+struct ChainStep {
+  int level;
+  int window;
+};
+
+// threshold在加载时使用，steps在请求中按顺序查找
+struct ScoreChain {
+  double threshold;
+  double default_value;
+  std::vector<ChainStep> steps;
+};
+
+// 默认值与原GetStatsCtr/GetStatsCvr一致
+ScoreChain ctr_chain{500, 0.05, {{0, 2}, {1, 2}, {2, 2}}};
+ScoreChain cvr_chain{300, 0.03, {{0, 0}, {0, 1}, {0, 2}, {1, 2}, {2, 2}}};
+
+constexpr double kNoValue = std::numeric_limits<double>::quiet_NaN();
+
+// LevelHash查找的key类型，其余计数项不建先验
+constexpr uint32_t kPriorKinds =
+  CounterKeyBit(CounterKey::kPackageNameCId) |
+  CounterKeyBit(CounterKey::kPackageNameAdPackageName) |
+  CounterKeyBit(CounterKey::kPackageNameAdPackageCategory);
+
+using CountWindow = std::remove_reference_t<
+  decltype(std::declval<const CountFeatures&>().count_features_1d())>;
+
+
+StatsPrior::Prior ComputePrior(const CountFeatures& count) {
+  const CountWindow* windows[StatsPrior::kWindowCount] = {
+    &count.count_features_1d(),
+    &count.count_features_3d(),
+    &count.count_features_7d(),
+  };
+  StatsPrior::Prior prior;
+  for (int w = 0; w < StatsPrior::kWindowCount; ++w) {
+    double imp = windows[w]->imp();
+    double click = windows[w]->click();
+    prior.ctr[w] = imp > ctr_chain.threshold ? click / imp : kNoValue;
+    prior.cvr[w] = click > cvr_chain.threshold ?
+      std::max<double>(windows[w]->attr_install(), 1) / click : kNoValue;
+  }
+  return prior;
+}
+
+
+StatsPrior::Prior EmptyPrior() {
+  StatsPrior::Prior prior;
+  std::fill(std::begin(prior.ctr), std::end(prior.ctr), kNoValue);
+  std::fill(std::begin(prior.cvr), std::end(prior.cvr), kNoValue);
+  return prior;
+}
+
+
+bool IsEmpty(const StatsPrior::Prior& prior) {
+  for (int w = 0; w < StatsPrior::kWindowCount; ++w) {
+    if (!std::isnan(prior.ctr[w]) || !std::isnan(prior.cvr[w])) {
+      return false;
+    }
+  }
+  return true;
+}
+
+
+KeyHash LevelHash(const Feature& feature, int level) {
+  const auto& app_name = feature.context().app_name();
+  const auto& ad_info = feature.ad_data().ad_info();
+  switch (level) {
+    case 0:
+      return CounterKeyHash(CounterKey::kPackageNameCId, app_name,
+        ad_info.creative_id());
+    case 1:
+      return CounterKeyHash(CounterKey::kPackageNameAdPackageName, app_name,
+        ad_info.app_id());
+    default:
+      return CounterKeyHash(CounterKey::kPackageNameAdPackageCategory,
+        app_name, ad_info.category());
+  }
+}
+
+}  // namespace
+
+
+// 开放寻址的key -> Prior表，构建后只读
+class StatsPrior::Table {
+ public:
+  using Entries = std::vector<std::pair<KeyHash, Prior>>;
+
+  // entries中同一key以后出现的为准
+  explicit Table(const Entries& entries) {
+    size_t capacity = 16;
+    while (capacity < entries.size() * 2) {
+      capacity <<= 1;
+    }
+    mask_ = capacity - 1;
+    slots_.assign(capacity, Slot{KeyHash(), Prior()});
+    for (const auto& e : entries) {
+      for (auto i = e.first.hash & mask_; ; i = (i + 1) & mask_) {
+        auto& slot = slots_[i];
+        if (slot.key.hash == 0) {
+          slot.key = e.first;
+          ++size_;
+        } else if (slot.key != e.first) {
+          continue;
+        }
+        slot.prior = e.second;
+        break;
+      }
+    }
+  }
+
+  const Prior* Find(const KeyHash& key) const {
+    for (auto i = key.hash & mask_; ; i = (i + 1) & mask_) {
+      const auto& slot = slots_[i];
+      if (slot.key == key) {
+        return &slot.prior;
+      }
+      if (slot.key.hash == 0) {
+        return nullptr;
+      }
+    }
+  }
+
+  void AppendTo(Entries& entries) const {
+    for (const auto& slot : slots_) {
+      if (slot.key.hash != 0) {
+        entries.emplace_back(slot.key, slot.prior);
+      }
+    }
+  }
+
+  size_t size() const { return size_; }
+
+ private:
+  struct Slot {
+    KeyHash key;  // hash为0表示空槽，CounterKeyHash不会返回0
+    Prior prior;
+  };
+
+  std::vector<Slot> slots_;
+  uint64_t mask_ = 0;
+  size_t size_ = 0;
+};
+
+
+std::shared_ptr<const StatsPrior> StatsPrior::Build(
+    const AdCounterBase& base) {
+  // 计数都不足的项与不存在等价，不放入表中
+  Table::Entries entries;
+  if (base.mapped != nullptr) {
+    CountFeatures count;
+    base.mapped->ForEach(kPriorKinds, [&entries, &count] (const KeyHash& key,
+        std::string_view value, bool) {
+      if (count.ParseFromArray(value.data(), value.size())) {
+        auto prior = ComputePrior(count);
+        if (!IsEmpty(prior)) {
+          entries.emplace_back(key, prior);
+        }
+      }
+    });
+  } else {
+    for (const auto& p : base.store.store_ad_counter()) {
+      KeyHash key;
+      CounterKey kind;
+      if (ParseCounterKey(p.first, &key, &kind) &&
+          (kPriorKinds & CounterKeyBit(kind))) {
+        auto prior = ComputePrior(p.second);
+        if (!IsEmpty(prior)) {
+          entries.emplace_back(key, prior);
+        }
+      }
+    }
+  }
+  auto prior = std::make_shared<StatsPrior>();
+  prior->base_ = std::make_shared<Table>(entries);
+  return prior;
+}
+
+
+std::shared_ptr<const StatsPrior> StatsPrior::Apply(
+    const MappedSnapshot& delta) const {
+  // 增量层中的项须遮住base_，计数不足或删除的项也要保留
+  std::map<size_t, Table::Entries> updates;
+  CountFeatures count;
+  delta.ForEach(kPriorKinds, [&updates, &count] (const KeyHash& key,
+      std::string_view value, bool deleted) {
+    auto& entries = updates[ShardOf(key.hash)];
+    if (!deleted && count.ParseFromArray(value.data(), value.size())) {
+      entries.emplace_back(key, ComputePrior(count));
+    } else {
+      entries.emplace_back(key, EmptyPrior());
+    }
+  });
+  auto next = std::make_shared<StatsPrior>(*this);
+  if (updates.empty()) {
+    return next;
+  }
+  if (next->overlay_.empty()) {
+    next->overlay_.resize(size_t(1) << kShardBits);
+  }
+  // 只重建被修改的分片，同一key以本次为准
+  for (auto& p : updates) {
+    auto& shard = next->overlay_[p.first];
+    Table::Entries entries;
+    size_t old_size = 0;
+    if (shard != nullptr) {
+      shard->AppendTo(entries);
+      old_size = shard->size();
+    }
+    entries.insert(entries.end(), p.second.begin(), p.second.end());
+    shard = std::make_shared<Table>(entries);
+    next->overlay_size_ += shard->size() - old_size;
+  }
+  return next;
+}
+
+
+const StatsPrior::Prior* StatsPrior::Find(const KeyHash& key) const {
+  if (!overlay_.empty()) {
+    const auto& shard = overlay_[ShardOf(key.hash)];
+    if (shard != nullptr) {
+      if (auto p = shard->Find(key)) {
+        return p;
+      }
+    }
+  }
+  return base_->Find(key);
+}
+
+
+double StatsPrior::Score(const Feature& feature, bool ctr) const {
+  const auto& chain = ctr ? ctr_chain : cvr_chain;
+  const Prior* levels[kLevelCount] = {};
+  bool found[kLevelCount] = {};
+  for (const auto& step : chain.steps) {
+    if (!found[step.level]) {
+      levels[step.level] = Find(LevelHash(feature, step.level));
+      found[step.level] = true;
+    }
+    const auto* prior = levels[step.level];
+    if (prior == nullptr) {
+      continue;
+    }
+    double value = ctr ? prior->ctr[step.window] : prior->cvr[step.window];
+    if (!std::isnan(value)) {
+      return value;
+    }
+  }
+  return chain.default_value;
+}
+
+
+double StatsPrior::Ctr(const Feature& feature) const {
+  return Score(feature, true);
+}
+
+
+double StatsPrior::Cvr(const Feature& feature) const {
+  return Score(feature, false);
+}
+
+
+size_t StatsPrior::size() const {
+  return base_->size() + overlay_size_;
+}
+
+
+// chain形如 ["c_id:7d", "ad_package_name:7d"]
+static bool ParseChain(const nlohmann::json& conf, const char* threshold_name,
+    ScoreChain& chain) {
+  if (!conf.is_object()) {
+    return false;
+  }
+  chain.threshold = conf.value(threshold_name, chain.threshold);
+  chain.default_value = conf.value("default", chain.default_value);
+  auto it = conf.find("chain");
+  if (it == conf.end()) {
+    return true;
+  }
+  if (!it.value().is_array() || it.value().empty()) {
+    return false;
+  }
+  static const char* levels[StatsPrior::kLevelCount] = {
+    "c_id", "ad_package_name", "ad_package_category"};
+  static const char* windows[StatsPrior::kWindowCount] = {"1d", "3d", "7d"};
+  std::vector<ChainStep> steps;
+  for (const auto& item : it.value()) {
+    if (!item.is_string()) {
+      return false;
+    }
+    auto step = item.get<std::string>();
+    auto pos = step.find(':');
+    ChainStep parsed{-1, -1};
+    for (int i = 0; i < StatsPrior::kLevelCount; ++i) {
+      if (step.compare(0, pos, levels[i]) == 0) {
+        parsed.level = i;
+      }
+    }
+    for (int i = 0; pos != std::string::npos &&
+        i < StatsPrior::kWindowCount; ++i) {
+      if (step.compare(pos + 1, std::string::npos, windows[i]) == 0) {
+        parsed.window = i;
+      }
+    }
+    if (parsed.level < 0 || parsed.window < 0) {
+      LOG_ERROR("stats_prior chain step invalid: " << step);
+      return false;
+    }
+    steps.push_back(parsed);
+  }
+  chain.steps = std::move(steps);
+  return true;
+}
+
+
+bool InitStatsPrior(const nlohmann::json& conf) {
+  auto it = conf.find("stats_prior");
+  if (it == conf.end()) {
+    return true;
+  }
+  const auto& prior_conf = it.value();
+  auto it_ctr = prior_conf.find("ctr");
+  auto it_cvr = prior_conf.find("cvr");
+  if (!prior_conf.is_object() ||
+      (it_ctr != prior_conf.end() &&
+        !ParseChain(it_ctr.value(), "min_imp", ctr_chain)) ||
+      (it_cvr != prior_conf.end() &&
+        !ParseChain(it_cvr.value(), "min_click", cvr_chain))) {
+    LOG_ERROR("stats_prior config invalid");
+    return false;
+  }
+  LOG_INFO("stats_prior ctr steps=" << ctr_chain.steps.size()
+    << " min_imp=" << ctr_chain.threshold << " cvr steps="
+    << cvr_chain.steps.size() << " min_click=" << cvr_chain.threshold);
+  return true;
+}
+
+}  // end of namespace
@@ -0,0 +1,63 @@
+#pragma once
+
+#include <cstdint>
+#include <memory>
+#include <vector>
+
+#include <nlohmann/json.hpp>
+
+#include "feature/snapshot_file.h"
+#include "model_feature.pb.h"
+
+namespace ad {
+
+struct AdCounterBase;
+
+// 统计CTR/CVR的先验表：ad_counter加载时为回退链用到的三类计数项
+// （package_name#c_id、#ad_package_name、#ad_package_category）预先算出
+// 各时间窗口的CTR（曝光数超过阈值时）和CVR（点击数超过阈值时），
+// 请求中按回退链依次查这三级，取第一个有值的窗口。
+// 阈值和回退链由"stats_prior"配置。
+// 增量修改按hash分片写时复制，应用增量只重建被修改的分片
+class StatsPrior {
+ public:
+  // 由全量数据计算
+  static std::shared_ptr<const StatsPrior> Build(const AdCounterBase& base);
+  // 返回应用增量文件后的新版本，this不变
+  std::shared_ptr<const StatsPrior> Apply(const MappedSnapshot& delta) const;
+
+  // feature为DataToFeatureInput生成的素材特征，用其context和ad_info定位计数项
+  double Ctr(const Feature& feature) const;
+  double Cvr(const Feature& feature) const;
+
+  size_t size() const;
+
+  static constexpr int kWindowCount = 3;  // 1d, 3d, 7d
+  static constexpr int kLevelCount = 3;   // c_id, ad_package_name, category
+
+  // 一个计数项各窗口的估计值，NaN表示计数不足
+  struct Prior {
+    double ctr[kWindowCount];
+    double cvr[kWindowCount];
+  };
+  class Table;
+
+ private:
+  static constexpr int kShardBits = 10;
+
+  static size_t ShardOf(uint64_t hash) { return hash >> (64 - kShardBits); }
+
+  const Prior* Find(const KeyHash& key) const;
+  double Score(const Feature& feature, bool ctr) const;
+
+  std::shared_ptr<const Table> base_;
+  // 增量修改和删除，按hash分片，先于base_查找；为空表示没有增量
+  std::vector<std::shared_ptr<const Table>> overlay_;
+  size_t overlay_size_ = 0;
+};
+
+// 读取server.json中的"stats_prior"配置，须在InitFeature之前调用；
+// 未配置时与原先的固定阈值和回退链一致
+bool InitStatsPrior(const nlohmann::json& conf);
+
+}  // end of namespace
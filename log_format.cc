@@ -0,0 +1,79 @@
+#include "rec/log_format.h"
+
+namespace ad {
+
+template <typename Row>
+static void CopyRequestFields(const Row& from, Row* to) {
+  to->set_request_id(from.request_id());
+  to->set_user_id(from.user_id());
+  to->set_pos_id(from.pos_id());
+  to->set_nation(from.nation());
+  to->set_package_name(from.package_name());
+  to->set_floor_price(from.floor_price());
+  to->set_req_time(from.req_time());
+  to->set_explore_flow(from.explore_flow());
+}
+
+
+static void CopyRequestFields(const metis::RecAdInfo& from,
+    metis::RecAdInfo* to) {
+  CopyRequestFields<metis::RecAdInfo>(from, to);
+  to->mutable_feature()->mutable_context()->CopyFrom(from.feature().context());
+  to->mutable_feature()->mutable_user_profile()->CopyFrom(
+    from.feature().user_profile());
+}
+
+
+// 逐行展开：头部行只更新当前请求，素材行拷贝后补上请求级字段
+template <typename Rows>
+static bool ExpandRows(const Rows& in, Rows* out) {
+  using Row = typename Rows::value_type;
+  const Row* header = nullptr;
+  for (const auto& row : in) {
+    if (row.camp_id() == kLogV2HeaderCampId) {
+      header = &row;
+      continue;
+    }
+    if (header == nullptr) {
+      return false;
+    }
+    auto expanded = out->Add();
+    expanded->CopyFrom(row);
+    CopyRequestFields(*header, expanded);
+  }
+  return true;
+}
+
+
+bool IsLogV2(const metis::ReqAds& req_ads) {
+  return req_ads.req_ads_size() > 0 &&
+    req_ads.req_ads(0).camp_id() == kLogV2HeaderCampId;
+}
+
+
+bool IsLogV2(const metis::RecAds& rec_ads) {
+  return rec_ads.rec_ads_size() > 0 &&
+    rec_ads.rec_ads(0).camp_id() == kLogV2HeaderCampId;
+}
+
+
+bool ExpandReqAds(const metis::ReqAds& in, metis::ReqAds* out) {
+  out->Clear();
+  if (!IsLogV2(in)) {
+    out->CopyFrom(in);
+    return true;
+  }
+  return ExpandRows(in.req_ads(), out->mutable_req_ads());
+}
+
+
+bool ExpandRecAds(const metis::RecAds& in, metis::RecAds* out) {
+  out->Clear();
+  if (!IsLogV2(in)) {
+    out->CopyFrom(in);
+    return true;
+  }
+  return ExpandRows(in.rec_ads(), out->mutable_rec_ads());
+}
+
+}  // end of namespace
@@ -0,0 +1,44 @@
+#pragma once
+
+#include <cstdint>
+
+#include "ad_model_service.pb.h"
+#include "metis_kafka.pb.h"
+
+namespace ad {
+
+// metis日志格式
+// v1: ReqAds/RecAds每行都带请求级字段，RecAdInfo带完整的Feature
+// v2: 每个请求先写一个头部行（camp_id为kLogV2HeaderCampId），带请求级字段，
+//     RecAds的头部行另带Feature的context和user_profile；其后各行只带素材级
+//     字段，RecAdInfo的Feature只有ad_data和user_ad_feature。
+//     多个请求合并发送时头部行与素材行交替出现
+constexpr int kLogFormatV1 = 1;
+constexpr int kLogFormatV2 = 2;
+constexpr int64_t kLogV2HeaderCampId = -1;
+
+
+// 写入请求级字段，ReqAd和RecAdInfo通用
+template <typename Row>
+void SetRequestFields(const modelx::PredictionRequest& ad_request,
+    int64_t req_time, bool explore_flow, Row* row) {
+  row->set_request_id(ad_request.request_id());
+  row->set_user_id(ad_request.user_id());
+  row->set_pos_id(ad_request.pos_id());
+  row->set_nation(ad_request.nation());
+  row->set_package_name(ad_request.contexts().package_name());
+  row->set_floor_price(ad_request.contexts().floor_price());
+  row->set_req_time(req_time);
+  row->set_explore_flow(explore_flow);
+}
+
+
+// 是否为v2格式（首行为头部行）
+bool IsLogV2(const metis::ReqAds& req_ads);
+bool IsLogV2(const metis::RecAds& rec_ads);
+
+// 将v2记录展开为v1，v1原样拷贝到out；素材行出现在头部行之前时返回false
+bool ExpandReqAds(const metis::ReqAds& in, metis::ReqAds* out);
+bool ExpandRecAds(const metis::RecAds& in, metis::RecAds* out);
+
+}  // end of namespace
@@ -0,0 +1,210 @@
+#include "rec/metis_log.h"
+
+#include <algorithm>
+#include <random>
+#include <utility>
+
+#include "metis/metis.h"
+#include "metrics/metrics.h"
+#include "util/log.h"
+
+namespace ad {
+
+// 队列空时worker的等待时间，也是空闲时记录发送延迟的上限
+constexpr auto kIdleWait = std::chrono::microseconds(500);
+// kBlock时请求线程重试入队的间隔
+constexpr auto kBlockWait = std::chrono::microseconds(50);
+
+
+MetisRecord::MetisRecord()
+  : req_ads(google::protobuf::Arena::CreateMessage<metis::ReqAds>(&arena)),
+    rec_ads(google::protobuf::Arena::CreateMessage<metis::RecAds>(&arena)) {
+}
+
+
+MetisLogger& MetisLogger::Instance() {
+  static MetisLogger logger;
+  return logger;
+}
+
+
+MetisLogger::MetisLogger()
+  : send_fn_(std::make_shared<const SendFn>(
+      [] (const metis::RecAds& rec_ads, const metis::ReqAds& req_ads) {
+        SendRecAds(rec_ads);
+        SendReqAds(req_ads);
+      })) {
+}
+
+
+MetisLogger::~MetisLogger() {
+  Stop();
+}
+
+
+void MetisLogger::Configure(const Options& options) {
+  Stop();
+  options_ = options;
+  options_.workers = std::max<size_t>(options_.workers, 1);
+  options_.batch = std::max<size_t>(options_.batch, 1);
+  if (!options_.async) {
+    return;
+  }
+  queue_.reset(new BoundedQueue<MetisRecordPtr>(options_.queue_size));
+  stop_ = false;
+  for (size_t i = 0; i < options_.workers; ++i) {
+    workers_.emplace_back(&MetisLogger::Run, this);
+  }
+}
+
+
+void MetisLogger::SetSendFn(SendFn fn) {
+  std::lock_guard<std::mutex> lock(send_fn_mutex_);
+  send_fn_ = std::make_shared<const SendFn>(std::move(fn));
+}
+
+
+// 停止并等待worker发完队列中剩余的记录
+void MetisLogger::Stop() {
+  stop_ = true;
+  for (auto& worker : workers_) {
+    worker.join();
+  }
+  workers_.clear();
+  queue_.reset();
+}
+
+
+void MetisLogger::Submit(MetisRecordPtr record) {
+  if (queue_ == nullptr) {
+    std::vector<MetisRecordPtr> batch;
+    batch.push_back(std::move(record));
+    Send(batch);
+    return;
+  }
+  record->enqueue_time = std::chrono::steady_clock::now();
+  if (!Push(record)) {
+    common::Stats::get()->Incr(metisLogDrop);
+  }
+  common::Stats::get()->AddMetric(metisQueueDepth, queue_->size());
+}
+
+
+bool MetisLogger::Push(MetisRecordPtr& record) {
+  switch (options_.overload) {
+    case Overload::kDrop:
+      return queue_->TryPush(record);
+    case Overload::kSample: {
+      size_t half = queue_->capacity() / 2;
+      size_t depth = queue_->size();
+      if (depth > half) {
+        thread_local std::minstd_rand random_gen(std::random_device{}());
+        std::uniform_int_distribution<size_t> udist(0, half - 1);
+        if (depth >= queue_->capacity() ||
+            udist(random_gen) >= queue_->capacity() - depth) {
+          return false;
+        }
+      }
+      return queue_->TryPush(record);
+    }
+    case Overload::kBlock:
+      while (!queue_->TryPush(record)) {
+        common::Stats::get()->Incr(metisLogBlock);
+        std::this_thread::sleep_for(kBlockWait);
+      }
+      return true;
+  }
+  return false;
+}
+
+
+void MetisLogger::Run() {
+  std::vector<MetisRecordPtr> batch;
+  MetisRecordPtr record;
+  for (;;) {
+    while (batch.size() < options_.batch && queue_->TryPop(record)) {
+      batch.push_back(std::move(record));
+    }
+    if (!batch.empty()) {
+      Send(batch);
+      continue;
+    }
+    if (stop_) {
+      return;
+    }
+    std::this_thread::sleep_for(kIdleWait);
+  }
+}
+
+
+// 多条记录时合并为一条ReqAds和一条RecAds发送
+void MetisLogger::Send(std::vector<MetisRecordPtr>& batch) {
+  auto now = std::chrono::steady_clock::now();
+  for (const auto& record : batch) {
+    if (record->enqueue_time.time_since_epoch().count() != 0) {
+      common::Stats::get()->AddMetric(metisLogDelayMs,
+        std::chrono::duration<double, std::milli>(
+          now - record->enqueue_time).count());
+    }
+  }
+  std::shared_ptr<const SendFn> send_fn;
+  {
+    std::lock_guard<std::mutex> lock(send_fn_mutex_);
+    send_fn = send_fn_;
+  }
+  if (batch.size() == 1) {
+    (*send_fn)(*batch[0]->rec_ads, *batch[0]->req_ads);
+  } else {
+    google::protobuf::Arena arena;
+    auto& rec_ads = *google::protobuf::Arena::CreateMessage<metis::RecAds>(
+      &arena);
+    auto& req_ads = *google::protobuf::Arena::CreateMessage<metis::ReqAds>(
+      &arena);
+    for (const auto& record : batch) {
+      rec_ads.MergeFrom(*record->rec_ads);
+      req_ads.MergeFrom(*record->req_ads);
+    }
+    (*send_fn)(rec_ads, req_ads);
+  }
+  batch.clear();
+}
+
+
+bool InitMetisLogger(const nlohmann::json& conf) {
+  MetisLogger::Options options;
+  auto it = conf.find("metis_log");
+  if (it != conf.end()) {
+    const auto& log_conf = it.value();
+    if (!log_conf.is_object()) {
+      LOG_ERROR("metis_log config invalid");
+      return false;
+    }
+    options.async = log_conf.value("async", options.async);
+    options.queue_size = log_conf.value("queue_size", options.queue_size);
+    options.workers = log_conf.value("workers", options.workers);
+    options.batch = log_conf.value("batch", options.batch);
+    options.format = log_conf.value("format", options.format);
+    if (options.format != kLogFormatV1 && options.format != kLogFormatV2) {
+      LOG_ERROR("metis_log format invalid: " << options.format);
+      return false;
+    }
+    auto overload = log_conf.value("overload", std::string("drop"));
+    if (overload == "drop") {
+      options.overload = MetisLogger::Overload::kDrop;
+    } else if (overload == "sample") {
+      options.overload = MetisLogger::Overload::kSample;
+    } else if (overload == "block") {
+      options.overload = MetisLogger::Overload::kBlock;
+    } else {
+      LOG_ERROR("metis_log overload invalid: " << overload);
+      return false;
+    }
+  }
+  MetisLogger::Instance().Configure(options);
+  LOG_INFO("metis_log async=" << options.async << " queue_size="
+    << options.queue_size << " workers=" << options.workers
+    << " batch=" << options.batch << " format=" << options.format);
+  return true;
+}
+
+}  // end of namespace
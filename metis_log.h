@@ -0,0 +1,89 @@
+#pragma once
+
+#include <atomic>
+#include <chrono>
+#include <functional>
+#include <memory>
+#include <mutex>
+#include <thread>
+#include <vector>
+
+#include <google/protobuf/arena.h>
+#include <nlohmann/json.hpp>
+
+#include "metis_kafka.pb.h"
+#include "rec/bounded_queue.h"
+#include "rec/log_format.h"
+
+namespace ad {
+
+// 一次请求的metis日志，消息分配在自身的arena上，整体移交给MetisLogger，
+// 请求结束后仍然有效
+struct MetisRecord {
+  MetisRecord();
+
+  google::protobuf::Arena arena;
+  metis::ReqAds* req_ads;
+  metis::RecAds* rec_ads;
+  std::chrono::steady_clock::time_point enqueue_time;
+};
+using MetisRecordPtr = std::unique_ptr<MetisRecord>;
+
+
+// metis日志的异步发送：请求线程只把记录放入定长无锁队列，
+// 后台线程批量取出、合并后调用SendReqAds/SendRecAds（序列化、压缩在其中）
+class MetisLogger {
+ public:
+  // 队列满时的处理方式
+  enum class Overload {
+    kDrop,    // 丢弃新记录
+    kSample,  // 队列过半后按剩余空间比例抽样保留，满时丢弃
+    kBlock,   // 请求线程等待队列有空位
+  };
+  struct Options {
+    bool async = false;
+    size_t queue_size = 8192;
+    size_t workers = 2;
+    Overload overload = Overload::kDrop;
+    size_t batch = 1;  // 合并为一条kafka消息的最大请求数
+    int format = kLogFormatV1;  // 见log_format.h
+  };
+
+  using SendFn = std::function<void (const metis::RecAds& rec_ads,
+      const metis::ReqAds& req_ads)>;
+
+  static MetisLogger& Instance();
+  ~MetisLogger();
+
+  // 须在开始处理请求前调用
+  void Configure(const Options& options);
+
+  // 替换实际发送的函数，默认为SendRecAds + SendReqAds
+  void SetSendFn(SendFn fn);
+
+  // 请求构建日志记录时使用的格式
+  int format() const { return options_.format; }
+
+  // 未开启async时在调用线程同步发送
+  void Submit(MetisRecordPtr record);
+
+ private:
+  MetisLogger();
+
+  bool Push(MetisRecordPtr& record);
+  void Run();
+  void Send(std::vector<MetisRecordPtr>& batch);
+  void Stop();
+
+  Options options_;
+  std::unique_ptr<BoundedQueue<MetisRecordPtr>> queue_;
+  std::vector<std::thread> workers_;
+  std::atomic<bool> stop_{false};
+  std::mutex send_fn_mutex_;
+  std::shared_ptr<const SendFn> send_fn_;
+};
+
+// 读取server.json中的"metis_log"配置，未配置时同步发送
+bool InitMetisLogger(const nlohmann::json& conf);
+
+}  // end of namespace
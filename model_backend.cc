@@ -0,0 +1,78 @@
+#include "rec/model_backend.h"
+
+#include <map>
+
+#include "rec/cpu_backend.h"
+#include "rec/rec.h"
+#include "util/log.h"
+
+namespace ad {
+
+ScoreFuture TfServingBackend::Score(const ScoreInput& input) {
+  // tf request，请求和应答分配在调用自有的arena上，由I/O线程共同持有
+  auto call = std::make_shared<PredictCall>();
+  call->request->mutable_model_spec()->set_name(input.model_name);
+  if (!FillTfFeatures(input.plan, input.features, input.packed, input.cache,
+      *call->request->mutable_inputs())) {
+    return ReadyScore(std::nullopt);
+  }
+  // call tf-serving；开启合批时与并发请求合并发出
+  size_t rows = input.features.size();
+  if (TfBatcher::Instance().enabled() && rows > 0) {
+    return TfBatcher::Instance().Submit(call, input.packed, rows,
+      input.tf_output);
+  }
+  return PredictScores(call, input.tf_output, rows);
+}
+
+/* ========================================================================== */
+
+// InitModelBackend之后只读
+static std::map<std::string, std::shared_ptr<ModelBackend>> model_backends;
+
+
+ModelBackend& GetModelBackend(const std::string& model_name) {
+  static TfServingBackend tf_serving;
+  auto it = model_backends.find(model_name);
+  return it != model_backends.end() ? *it->second : tf_serving;
+}
+
+
+bool InitModelBackend(const nlohmann::json& conf) {
+  auto it = conf.find("model_backend");
+  if (it == conf.end()) {
+    return true;
+  }
+  if (!it.value().is_object()) {
+    LOG_ERROR("model_backend config invalid");
+    return false;
+  }
+  std::map<std::string, std::shared_ptr<ModelBackend>> backends;
+  for (const auto& p : it.value().items()) {
+    const auto& model_conf = p.value();
+    if (!model_conf.is_object()) {
+      LOG_ERROR("model_backend config invalid: model=" << p.key());
+      return false;
+    }
+    auto type = model_conf.value("type", std::string("tf_serving"));
+    if (type == "tf_serving") {
+      continue;
+    }
+    if (type != "cpu") {
+      LOG_ERROR("model_backend type invalid: model=" << p.key()
+        << " type=" << type);
+      return false;
+    }
+    auto path = model_conf.value("path", std::string());
+    auto backend = CpuBackend::Create(p.key(), path);
+    if (backend == nullptr) {
+      return false;
+    }
+    backends[p.key()] = std::move(backend);
+    LOG_INFO("model_backend model=" << p.key() << " type=cpu path=" << path);
+  }
+  model_backends = std::move(backends);
+  return true;
+}
+
+}  // end of namespace
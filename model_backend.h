@@ -0,0 +1,61 @@
+#pragma once
+
+#include <chrono>
+#include <memory>
+#include <string>
+#include <vector>
+
+#include <nlohmann/json.hpp>
+
+#include "rec/tf_feature.h"
+#include "rec/tf_predict.h"
+
+namespace ad {
+
+// 一次打分的输入：各素材的稠密特征和模型的填充计划
+struct ScoreInput {
+  const std::string& model_name;
+  const FeatureFillPlan& plan;
+  const std::vector<DenseFeatures>& features;
+  bool packed;          // tf-serving：tensor_content紧凑编码
+  TensorCache& cache;   // tf-serving：本请求各模型共用的输入tensor
+  const std::string& tf_output;
+  // 调用方等待分数的截止时间，异步计算的后端超过后放弃未算完的部分
+  std::chrono::steady_clock::time_point until;
+};
+
+
+// 模型打分的实现。reads_input_async()为false时Score返回前读完input，
+// 之后不再访问；为true时future就绪前仍读取input引用的数据，调用方即使
+// 等待超时也须等future就绪后才能释放它们。
+// 返回的future就绪时为各素材的分数，失败或超时为nullopt
+class ModelBackend {
+ public:
+  virtual ~ModelBackend() = default;
+
+  virtual const char* name() const = 0;
+  // 是否使用ScoreInput中的packed和cache，否则不必在TensorCache中登记字段
+  virtual bool uses_tensors() const = 0;
+  virtual bool reads_input_async() const { return false; }
+  virtual ScoreFuture Score(const ScoreInput& input) = 0;
+};
+
+
+// 在调用线程上填充PredictRequest，经TfAsyncClient（或TfBatcher合批）异步调用
+class TfServingBackend : public ModelBackend {
+ public:
+  const char* name() const override { return "tf_serving"; }
+  bool uses_tensors() const override { return true; }
+  ScoreFuture Score(const ScoreInput& input) override;
+};
+
+
+// 按模型名取打分后端，未配置的模型使用tf-serving
+ModelBackend& GetModelBackend(const std::string& model_name);
+
+// 读取server.json中的"model_backend"配置，须在开始处理请求前调用：
+//   "model_backend": {"<model_name>": {"type": "cpu", "path": "..."}}
+// type为"tf_serving"（默认）或"cpu"，见cpu_backend.h
+bool InitModelBackend(const nlohmann::json& conf);
+
+}  // end of namespace
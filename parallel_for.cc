@@ -0,0 +1,118 @@
+#include "rec/parallel_for.h"
+
+#include <algorithm>
+#include <chrono>
+#include <condition_variable>
+#include <memory>
+#include <mutex>
+#include <thread>
+
+namespace ad {
+
+// 单段的最低预估耗时：远大于一次入队和唤醒的开销
+constexpr double kMinChunkNs = 30000;
+
+
+size_t CpuThreadCount() {
+  static const size_t count =
+    std::max(4u, std::thread::hardware_concurrency());
+  return count;
+}
+
+
+ThreadPool& CpuThreadPool() {
+  static ThreadPool pool(CpuThreadCount());
+  return pool;
+}
+
+
+void ParallelCost::Update(size_t items, int64_t ns) {
+  if (items == 0 || ns <= 0) {
+    return;
+  }
+  double sample = static_cast<double>(ns) / items;
+  double old = item_ns_.load(std::memory_order_relaxed);
+  item_ns_.store(old * 0.9 + sample * 0.1, std::memory_order_relaxed);
+}
+
+
+namespace {
+
+// 各段共享的状态；排队中的任务可能在ParallelFor返回后才执行，
+// 此时已领不到段，不会再调用fn
+struct ParallelState {
+  std::function<bool (size_t, size_t)> fn;
+  size_t n;
+  size_t chunks;
+  std::atomic<size_t> next{0};
+  std::atomic<int64_t> busy_ns{0};
+
+  std::mutex mutex;
+  std::condition_variable cv;
+  size_t done = 0;
+  bool ok = true;
+};
+
+
+void RunChunks(ParallelState& state) {
+  for (;;) {
+    size_t i = state.next.fetch_add(1, std::memory_order_relaxed);
+    if (i >= state.chunks) {
+      return;
+    }
+    // 均分，前 n % chunks 段各多一项
+    size_t base = state.n / state.chunks;
+    size_t extra = state.n % state.chunks;
+    size_t begin = i * base + std::min(i, extra);
+    size_t end = begin + base + (i < extra ? 1 : 0);
+
+    auto start = std::chrono::steady_clock::now();
+    bool ok = state.fn(begin, end);
+    state.busy_ns.fetch_add(std::chrono::duration_cast<
+      std::chrono::nanoseconds>(std::chrono::steady_clock::now() - start)
+      .count(), std::memory_order_relaxed);
+
+    std::lock_guard<std::mutex> lock(state.mutex);
+    state.ok = state.ok && ok;
+    if (++state.done == state.chunks) {
+      state.cv.notify_all();
+    }
+  }
+}
+
+}  // namespace
+
+
+bool ParallelFor(size_t n, ParallelCost& cost,
+    const std::function<bool (size_t begin, size_t end)>& fn) {
+  if (n == 0) {
+    return true;
+  }
+  double item_ns = std::max(cost.item_ns(), 1.0);
+  size_t grain = static_cast<size_t>(kMinChunkNs / item_ns) + 1;
+  size_t chunks = std::min((n + grain - 1) / grain, CpuThreadCount());
+
+  if (chunks <= 1) {
+    auto start = std::chrono::steady_clock::now();
+    bool ok = fn(0, n);
+    cost.Update(n, std::chrono::duration_cast<std::chrono::nanoseconds>(
+      std::chrono::steady_clock::now() - start).count());
+    return ok;
+  }
+
+  auto state = std::make_shared<ParallelState>();
+  state->fn = fn;
+  state->n = n;
+  state->chunks = chunks;
+  for (size_t i = 1; i < chunks; ++i) {
+    CpuThreadPool().enqueue([state] () { RunChunks(*state); });
+  }
+  RunChunks(*state);
+
+  std::unique_lock<std::mutex> lock(state->mutex);
+  state->cv.wait(lock, [&state] () { return state->done == state->chunks; });
+  cost.Update(n, state->busy_ns.load(std::memory_order_relaxed));
+  return state->ok;
+}
+
+}  // end of namespace
@@ -0,0 +1,38 @@
+#pragma once
+
+#include <atomic>
+#include <cstddef>
+#include <cstdint>
+#include <functional>
+
+#include "util/ThreadPool.h"
+
+namespace ad {
+
+// 进程内共用的CPU线程池，只执行不等待网络的计算任务
+ThreadPool& CpuThreadPool();
+size_t CpuThreadCount();
+
+
+// 一类循环的单项耗时估计（纳秒，滑动平均），每次ParallelFor后更新；
+// 并发更新时丢失个别样本无妨
+class ParallelCost {
+ public:
+  explicit ParallelCost(double init_ns) : item_ns_(init_ns) {}
+
+  double item_ns() const { return item_ns_.load(std::memory_order_relaxed); }
+  void Update(size_t items, int64_t ns);
+
+ private:
+  std::atomic<double> item_ns_;
+};
+
+
+// 把[0, n)切成若干段并行执行fn(begin, end)，fn返回false表示失败。
+// 每段的预估耗时不低于一个下限，段数不超过CPU线程数；只有一段时在调用线程
+// 直接执行。调用线程也参与执行，未开始的段由先空闲的线程领取，
+// 线程池繁忙时调用线程可以独自做完而不必等待排队的任务
+bool ParallelFor(size_t n, ParallelCost& cost,
+    const std::function<bool (size_t begin, size_t end)>& fn);
+
+}  // end of namespace
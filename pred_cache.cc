@@ -0,0 +1,108 @@
+#include "rec/pred_cache.h"
+
+#include <algorithm>
+
+#include "feature/counter_index.h"
+#include "util/log.h"
+
+namespace ad {
+
+// 每项的估计内存：Entry、链表节点指针、hash表节点和桶
+constexpr size_t kEntryBytes = 128;
+
+
+PredictionCache& PredictionCache::Instance() {
+  static PredictionCache cache;
+  return cache;
+}
+
+
+void PredictionCache::Configure(const Options& options) {
+  options_ = options;
+  options_.shards = std::max<size_t>(options_.shards, 1);
+  shards_.clear();
+  if (!options_.enable) {
+    return;
+  }
+  shard_capacity_ = std::max<size_t>(
+    options_.max_bytes / kEntryBytes / options_.shards, 1);
+  for (size_t i = 0; i < options_.shards; ++i) {
+    shards_.emplace_back(new Shard());
+  }
+}
+
+
+uint64_t PredictionCache::Key(const std::string& model_name,
+    uint64_t model_version, const std::string& user_id,
+    const std::string& pos_id, const std::string& creative_id,
+    uint64_t feature_version) {
+  uint64_t h = HashKeyPart(0, model_name);
+  h = HashKeyPart(h, static_cast<int64_t>(model_version));
+  h = HashKeyPart(h, user_id);
+  h = HashKeyPart(h, pos_id);
+  h = HashKeyPart(h, creative_id);
+  return HashKeyPart(h, static_cast<int64_t>(feature_version));
+}
+
+
+bool PredictionCache::Find(uint64_t key, double* score) {
+  auto& shard = ShardOf(key);
+  std::lock_guard<std::mutex> lock(shard.mutex);
+  auto it = shard.index.find(key);
+  if (it == shard.index.end()) {
+    return false;
+  }
+  if (it->second->expire <= std::chrono::steady_clock::now()) {
+    shard.lru.erase(it->second);
+    shard.index.erase(it);
+    return false;
+  }
+  shard.lru.splice(shard.lru.begin(), shard.lru, it->second);
+  *score = it->second->score;
+  return true;
+}
+
+
+void PredictionCache::Insert(uint64_t key, double score) {
+  auto& shard = ShardOf(key);
+  auto expire = std::chrono::steady_clock::now() +
+    std::chrono::milliseconds(options_.ttl_ms);
+  std::lock_guard<std::mutex> lock(shard.mutex);
+  auto it = shard.index.find(key);
+  if (it != shard.index.end()) {
+    it->second->score = score;
+    it->second->expire = expire;
+    shard.lru.splice(shard.lru.begin(), shard.lru, it->second);
+    return;
+  }
+  shard.lru.push_front(Entry{key, score, expire});
+  shard.index.emplace(key, shard.lru.begin());
+  while (shard.lru.size() > shard_capacity_) {
+    shard.index.erase(shard.lru.back().key);
+    shard.lru.pop_back();
+  }
+}
+
+
+bool InitPredictionCache(const nlohmann::json& conf) {
+  PredictionCache::Options options;
+  auto it = conf.find("pred_cache");
+  if (it != conf.end()) {
+    const auto& cache_conf = it.value();
+    if (!cache_conf.is_object()) {
+      LOG_ERROR("pred_cache config invalid");
+      return false;
+    }
+    options.enable = cache_conf.value("enable", options.enable);
+    options.ttl_ms = cache_conf.value("ttl_ms", options.ttl_ms);
+    options.max_bytes =
+      cache_conf.value("max_mb", options.max_bytes >> 20) << 20;
+    options.shards = cache_conf.value("shards", options.shards);
+  }
+  PredictionCache::Instance().Configure(options);
+  LOG_INFO("pred_cache enable=" << options.enable << " ttl_ms="
+    << options.ttl_ms << " max_bytes=" << options.max_bytes);
+  return true;
+}
+
+}  // end of namespace
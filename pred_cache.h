@@ -0,0 +1,67 @@
+#pragma once
+
+#include <chrono>
+#include <cstdint>
+#include <list>
+#include <memory>
+#include <mutex>
+#include <string>
+#include <unordered_map>
+#include <vector>
+
+#include <nlohmann/json.hpp>
+
+namespace ad {
+
+// 短TTL的预估分缓存：同一用户短时间内重复请求相同素材时直接取分，
+// 只把未命中的素材发给tf-serving。key由模型名、模型版本、user_id、pos_id、
+// creative_id和特征快照版本组成，任一变化即不再命中。按key分片，
+// 各分片按LRU淘汰到内存上限以内
+class PredictionCache {
+ public:
+  struct Options {
+    bool enable = false;
+    int64_t ttl_ms = 5000;
+    size_t max_bytes = 64 << 20;
+    size_t shards = 64;
+  };
+
+  static PredictionCache& Instance();
+
+  // 须在开始处理请求前调用
+  void Configure(const Options& options);
+  bool enabled() const { return !shards_.empty(); }
+
+  static uint64_t Key(const std::string& model_name, uint64_t model_version,
+      const std::string& user_id, const std::string& pos_id,
+      const std::string& creative_id, uint64_t feature_version);
+
+  // 命中且未过期时写入score
+  bool Find(uint64_t key, double* score);
+  void Insert(uint64_t key, double score);
+
+ private:
+  struct Entry {
+    uint64_t key;
+    double score;
+    std::chrono::steady_clock::time_point expire;
+  };
+  struct Shard {
+    std::mutex mutex;
+    std::list<Entry> lru;  // 头部为最近使用
+    std::unordered_map<uint64_t, std::list<Entry>::iterator> index;
+  };
+
+  PredictionCache() = default;
+
+  Shard& ShardOf(uint64_t key) { return *shards_[key % shards_.size()]; }
+
+  Options options_;
+  size_t shard_capacity_ = 0;
+  std::vector<std::unique_ptr<Shard>> shards_;
+};
+
+// 读取server.json中的"pred_cache"配置；请求中还须exp_params的pred_cache为1
+bool InitPredictionCache(const nlohmann::json& conf);
+
+}  // end of namespace
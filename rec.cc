@@ -1,17 +1,29 @@
 #include <algorithm>
+#include <atomic>
 #include <chrono>
 #include <future>
+#include <random>
 #include <tuple>
 
 #include "ads_feature.h"
+#include "feature/ad_cap.h"
 #include "feature/feature.h"
 #include "metis/metis.h"
 #include "metis_kafka.pb.h"
 #include "metrics/metrics.h"
 #include "prediction_service.pb.h"  // tf-serving
-#include "rec/beta_distribution.h"
+#include "rec/deadline.h"
+#include "rec/explore.h"
+#include "rec/log_format.h"
+#include "rec/metis_log.h"
+#include "rec/model_backend.h"
+#include "rec/parallel_for.h"
 #include "rec/rec.h"
-#include "sharestore/sharestore.h"
+#include "rec/tf_feature.h"
+#include "rec/tf_predict.h"
+#include "rec/trace.h"
+#include "rec/traffic_record.h"
+#include "rec/user_cache.h"
 #include "tf/tf.h"
 #include "tf/tf_model.h"
 #include "util/likely.h"
@@ -20,289 +32,133 @@
 
 namespace ad {
 
-static ThreadPool thread_pool(50);
-
 inline void swap(modelx::Model_result& lhs, modelx::Model_result& rhs) {
   lhs.Swap(&rhs);
 }
 
 
-void AdRec::InitShareStoreData() {
-  const auto& user_id = request_->request().user_id();
-  std::vector<std::string> keys;
-  keys.push_back("nt:ads:user_counter:" + user_id);
-  keys.push_back("nt:ads:user_profile:" + user_id);
-  std::vector<std::pair<std::string, std::string>> results;
-  {
-    common::Timer timer(sharestoreMgetMs);
-    if (!GetShareStore()->multiGetValue(GetSegment(), keys, &results)
-          || results.size() < 2) {
-      common::Stats::get()->Incr(sharestoreMgetError);
-      LOG_ERROR("sharestore mget failed, or size=" << results.size());
-      return;
-    }
-  }
-  if (!results[0].second.empty() &&
-      !store_user_counter_.ParseFromString(results[0].second)) {
-    common::Stats::get()->Incr(counterParseError);
-    LOG_ERROR("parse sharestore counter failed");
-  }
-  if (!results[1].second.empty() &&
-      !store_user_profile_.ParseFromString(results[1].second)) {
-    common::Stats::get()->Incr(userProfileParseError);
-    LOG_ERROR("parse sharestore user_profile failed");
-  }
+// 解析后的user_counter和user_profile，开启缓存时可能来自其他请求；
+// 等待其他请求的拉取超过until时按无用户数据处理
+void AdRec::InitShareStoreData(RequestTrace& trace,
+    Deadline::Clock::time_point until) {
+  user_data_ = UserDataCache::Instance().Get(request_->request().user_id(),
+    &trace, until);
+  trace.Mark(TraceStage::kMget);
 }
 
 /* ========================================================================== */
 
-inline long Mod(long l, long r) {
-  if (r < 2 || l == 0) {
-    return 0;
-  }
-  return l % (r - 1) + 1;
-}
-
-
-void FillSequenceFeature(
-    const DnnFieldItem& feature_info,
-    const std::vector<FeatureResultPtr>& creatives,
-    tensorflow::TensorProto& tensor_proto
-    ) {
-  auto field_seq_length = feature_info.field_seq_length;
-  tensor_proto.set_dtype(tensorflow::DataType::DT_INT64);
-  auto tensor_shape_proto = tensor_proto.mutable_tensor_shape();
-  tensor_shape_proto->add_dim()->set_size(creatives.size());
-  tensor_shape_proto->add_dim()->set_size(field_seq_length);
-
-  auto field_max_length = feature_info.field_max_length;
-  if (field_max_length <= 1) {
-    field_max_length = 2;
-    common::Stats::get()->Incr(fieldMaxLenError);
-    LOG_ERROR("invalid field_max_length: name=" << feature_info.field_name
-      << " field_max_length=" << field_max_length);
-  }
-
-  for (const auto& creative : creatives) {
-    decltype(field_seq_length) count = 0;
-    auto it_feature = creative->sequence_features.find(feature_info.field_name);
-    if (it_feature != creative->sequence_features.cend()) {
-      const auto& values = it_feature->second;
-      for (auto it_v = values.cbegin();
-          it_v != values.cend() && count < field_seq_length;
-          ++it_v, ++count) {
-        // 取模，降低空间size
-        tensor_proto.add_int64_val(Mod(*it_v, field_max_length));
-      }
-    }
-    for (; count < field_seq_length; ++count) {
-      tensor_proto.add_int64_val(0);
-    }
-  }
-}
-
-
-void FillIntFeature(
-    const DnnFieldItem& feature_info,
-    const std::vector<FeatureResultPtr>& creatives,
-    tensorflow::TensorProto& tensor_proto
-    ) {
-  tensor_proto.set_dtype(tensorflow::DataType::DT_INT64);
-  auto tensor_shape_proto = tensor_proto.mutable_tensor_shape();
-  tensor_shape_proto->add_dim()->set_size(creatives.size());
-  tensor_shape_proto->add_dim()->set_size(1);
-
-  const auto& feature_name = feature_info.field_name;
-  auto field_max_length = feature_info.field_max_length;
-  if (field_max_length <= 1) {
-    field_max_length = 2;
-    common::Stats::get()->Incr(fieldMaxLenError);
-    LOG_ERROR("invalid field_max_length: name=" << feature_info.field_name
-      << " field_max_length=" << field_max_length);
-  }
-  for (const auto& creative : creatives) {
-    auto it = creative->int_features.find(feature_name);
-    if (it == creative->int_features.cend()) {
-      tensor_proto.add_int64_val(0);
-    } else {
-      // 取模
-      tensor_proto.add_int64_val(Mod(it->second, field_max_length));
-    }
-  }
-}
-
-
-void FillFloatFeature(
-    const DnnFieldItem& feature_info,
-    const std::vector<FeatureResultPtr>& creatives,
-    tensorflow::TensorProto& tensor_proto
-    ) {
-  tensor_proto.set_dtype(tensorflow::DataType::DT_FLOAT);
-  auto tensor_shape_proto = tensor_proto.mutable_tensor_shape();
-  tensor_shape_proto->add_dim()->set_size(creatives.size());
-  tensor_shape_proto->add_dim()->set_size(1);
-
-  const auto& feature_name = feature_info.field_name;
-  for (const auto& creative : creatives) {
-    auto it_feature = creative->float_features.find(feature_name);
-    auto value = (it_feature == creative->float_features.cend() ? 0.0 :
-      it_feature->second);
-    tensor_proto.add_float_val(value);
-  }
-}
-
-
-bool FillTfFeatureTask(const std::map<std::string, DnnFieldItem>& model_dict,
-    const std::vector<std::string>& feature_names, size_t begin, size_t end,
-    const std::vector<FeatureResultPtr>& creatives,
-    google::protobuf::Map<std::string, tensorflow::TensorProto>& inputs) {
-  using Func = std::add_pointer_t<void (
-    const DnnFieldItem& feature_info,
-    const std::vector<FeatureResultPtr>& creatives,
-    tensorflow::TensorProto& tensor_proto
-    )>;
-  const static std::map<std::string, Func> functions {
-    {"float", FillFloatFeature},
-    {"int", FillIntFeature},
-    {"sequence", FillSequenceFeature},
-    };
+bool FillTfFeatureTask(const FeatureFillPlan& plan, size_t begin, size_t end,
+    const std::vector<DenseFeatures>& creatives, bool packed,
+    TensorCache& cache, std::vector<tensorflow::TensorProto*>& tensors) {
+  const auto& fields = plan.fields();
   for (; begin < end; ++begin) {
-    const auto& feature_name = feature_names[begin];
-    auto it_feature_info = model_dict.find(feature_name);
-    if (UNLIKELY(it_feature_info == model_dict.cend())) {
-      LOG_ERROR("invalid feature index: name=" << feature_name << " index="
-        << begin);
-      return false;
-    }
-    const auto& feature_info = it_feature_info->second;
-    auto it_fn = functions.find(feature_info.field_type);
-    if (UNLIKELY(it_fn == functions.cend())) {
-      common::Stats::get()->Incr(tfFeatureTypeError);
-      LOG_ERROR("invalid feature type: name=" << feature_name << " type="
-        << feature_info.field_type);
-      return false;
-    }
-    const auto it_proto = inputs.find(feature_name);
-    if (UNLIKELY(it_proto == inputs.end())) {
-      LOG_ERROR("invalid feature name of tf inputs: name=" << feature_name);
-      return false;
-    }
-    it_fn->second(feature_info, creatives, it_proto->second);
+    cache.Fill(fields[begin], creatives, packed, *tensors[begin]);
   }
   return true;
 }
 
 
-bool FillTfFeatures(const std::map<std::string, DnnFieldItem>& model_dict,
-    const std::vector<FeatureResultPtr>& features,
+// packed为true时各字段以tensor_content紧凑编码；
+// 与本请求其他模型共用的字段经cache只编码一次
+bool FillTfFeatures(const FeatureFillPlan& plan,
+    const std::vector<DenseFeatures>& features, bool packed,
+    TensorCache& cache,
     google::protobuf::Map<std::string, tensorflow::TensorProto>& inputs) {
   common::Timer timer(tfFeatureMs);
-  // 收集特征名字，预先创建TensorProto
-  std::vector<std::string> feature_names;
-  feature_names.reserve(model_dict.size());
-  for (const auto& p : model_dict) {
-    inputs.insert({p.first, tensorflow::TensorProto()});
-    feature_names.emplace_back(p.first);
-  }
-  // 创建线程任务
-  constexpr size_t batch_count = 2;
-  auto batch_size = feature_names.size() / batch_count + 1;
-  std::vector<std::future<bool>> results;
-  for (size_t i = 0; i < batch_count; ++i) {
-    auto begin = batch_size * i;
-    auto end = std::min(feature_names.size(), batch_size * (i + 1));
-    results.emplace_back(
-      thread_pool.enqueue(
-        [&model_dict, &feature_names, begin, end, &features, &inputs] () {
-          return FillTfFeatureTask(model_dict, feature_names, begin, end,
-            features, inputs);
-        }
-      )
-    );
-  }
-  // 判断处理结果
-  for (auto& result : results) {
-    if (UNLIKELY(!result.get())) {
-      return false;
-    }
-  }
-  return true;
+  // 按计划顺序预先创建TensorProto
+  const auto& fields = plan.fields();
+  std::vector<tensorflow::TensorProto*> tensors;
+  tensors.reserve(fields.size());
+  for (const auto& field : fields) {
+    tensors.push_back(&inputs[field.tensor_name]);
+  }
+  // 按字段切分，单个字段的耗时随候选数增长
+  static ParallelCost cost(2000);
+  return ParallelFor(fields.size(), cost,
+    [&plan, &features, packed, &cache, &tensors] (size_t begin, size_t end) {
+      return FillTfFeatureTask(plan, begin, end, features, packed, cache,
+        tensors);
+    });
 }
 
 /* ========================================================================== */
 
-// 从fs中删除预算超额的广告素材
-void AdRec::DelExcessCapAd(std::vector<Feature> &fs) {
-  std::vector<Feature> new_fs;
-  new_fs.reserve(fs.size());
-
-  auto model_exp_config_ite =
-      request_->exp_params().exp_params().find("freq_ctrl");
-  bool freq_ctrl(false);
-  if (model_exp_config_ite != request_->exp_params().exp_params().end() &&
-      model_exp_config_ite->second == 1) {
-    freq_ctrl = true;
-  }
-
-  for (const auto &feature : fs) {
-    auto day_ainst = feature.ad_data().ad_counter().
-        ad_id().count_features_bj_1d().attr_install();
-    auto cap = feature.ad_data().ad_info().day_attr_install_cap();
-    if (cap > 0 && day_ainst > cap) {
+// 在展开素材前按广告过滤：预算超额（cap>0且当日安装数超过cap），
+// 以及freq_ctrl开启时用户7天内对该包曝光超过10次的广告；返回保留的广告下标
+std::vector<int32_t> AdRec::SelectUncappedAds(const AdInfoSnapshot& ad_info,
+    const AdCounterSnapshot& ad_counter) {
+  bool freq_ctrl = ExpEnabled("freq_ctrl");
+  auto cap_table = GetAdCapTable();
+  bool use_table = cap_table != nullptr && cap_table->complete();
+  const auto& model_request = request_->request();
+  const auto& user_id = model_request.user_id();
+
+  std::vector<int32_t> ads;
+  ads.reserve(model_request.creatives_size());
+  CountFeatures count;
+  for (int32_t i = 0; i < model_request.creatives_size(); ++i) {
+    const auto& creatives = model_request.creatives(i);
+    int64_t ad_id = creatives.camp_id();
+    if (use_table ? cap_table->Capped(ad_id) :
+        AdBudgetCapped(ad_id, ad_info, ad_counter)) {
       continue;
     }
-    if (freq_ctrl && feature.user_ad_feature().user_ad_count().
-        user_id_ad_package_name().count_features_7d().imp() > 10) {
-      continue;
+    if (freq_ctrl) {
+      auto p = user_data_->counter_index.Find(CounterKey::kUserIdAdPackageName,
+        user_id, creatives.app_id());
+      if (p && p.CopyTo(&count) && count.count_features_7d().imp() > 10) {
+        continue;
+      }
     }
-    new_fs.emplace_back(std::move(feature));
+    ads.push_back(i);
   }
-  fs.swap(new_fs);
+  common::Stats::get()->AddMetric(adCapFiltered,
+    model_request.creatives_size() - ads.size());
+  return ads;
 }
 
 
-double GetExploreScore(
-    double ctr, double cvr, const Feature &feature,
-    std::default_random_engine &random_gen, bool is_random = false) {
-  if (is_random) {
-    std::uniform_int_distribution<int> udist(1, 1000);
-    auto rand_num = udist(random_gen);
-    double up_num(0.005), low_num(0.0002);
-    double score = (up_num - low_num) * rand_num / 1000.0 + low_num;
-    return score;
-  }
-
+// Thompson采样：7天内创建且7天曝光不超过10万的素材，分数按
+// Beta(score * imp, imp - score * imp)抽样，imp至少取1000；其余保持ctr * cvr。
+// 整批素材一次采样，随机数取自本线程的FastRng
+void ExploreScores(const FeatureList& fs, double large_shape,
+    std::vector<double>& score) {
+  auto now_time = time(NULL);
   auto time_delta = 7 * 24 * 3600;
-  auto time_diff =
-      time(NULL) - feature.ad_data().ad_info().creative_create_time();
-  double cid_imp =
-      feature.ad_data().ad_counter().c_id().count_features_7d().imp();
-  double score = ctr * cvr;
-  if ((time_diff > time_delta) || (cid_imp > 100000)) {
-    return score;
-  }
-
-  if (score > 0.999) {
-    score = 0.01;
+  std::vector<int32_t> index;
+  std::vector<double> alpha, beta;
+  for (int32_t i = 0; i < fs.size(); ++i) {
+    auto time_diff =
+      now_time - fs[i].ad_data().ad_info().creative_create_time();
+    double cid_imp =
+      fs[i].ad_data().ad_counter().c_id().count_features_7d().imp();
+    if ((time_diff > time_delta) || (cid_imp > 100000)) {
+      continue;
+    }
+    double s = score[i] > 0.999 ? 0.01 : score[i];
+    double imp(std::max(cid_imp, 1000.0));
+    index.push_back(i);
+    alpha.push_back(s * imp);
+    beta.push_back(imp - s * imp);
+  }
+  std::vector<double> sampled(index.size());
+  SampleBeta(ThreadRng(), alpha.data(), beta.data(), index.size(),
+    large_shape, sampled.data());
+  for (size_t k = 0; k < index.size(); ++k) {
+    score[index[k]] = sampled[k];
   }
-
-  double imp(std::max(cid_imp, 1000.0));
-  double alpha = score * imp;
-  double beta = imp - alpha;
-  BetaDistribution dist(alpha, beta);
-  double explore_score = dist(random_gen);
-  return explore_score;
 }
 
 
 bool AdRec::FillScore(
     const std::vector<double> &ctr_vec,
     const std::vector<double> &cvr_vec,
-    std::vector<modelx::Model_result>& ads,
     const modelx::PredictionRequest& ad_request,
     bool is_explore_flow,
-    metis::ReqAds& req_ads,
-    std::map<std::string, metis::RecAdInfo>& rec_ads
+    bool log_v2,
+    ScoredAds& scored,
+    metis::ReqAds& req_ads
     ) {
   const auto& fs = raw_features_;
   if (ctr_vec.size() != fs.size()) {
@@ -315,153 +171,132 @@ bool AdRec::FillScore(
     LOG_ERROR("cvr size invalid: " << cvr_vec.size() << " " << fs.size());
     return false;
   }
-  ads.reserve(fs.size());
+  scored.score.resize(fs.size());
+  scored.ecpm.resize(fs.size());
+  scored.order.resize(fs.size());
   double floor_price = ad_request.contexts().floor_price();
-  std::default_random_engine random_gen(
-      std::chrono::system_clock::now().time_since_epoch().count());
+  for (size_t i = 0; i < fs.size(); ++i) {
+    scored.score[i] = ctr_vec[i] * cvr_vec[i];
+  }
+  const auto& explore = GetExploreOptions();
+  if (is_explore_flow && explore.enable) {
+    ExploreScores(fs, explore.large_shape, scored.score);
+  }
+  // v2格式：请求级字段只写在头部行
+  if (log_v2 && fs.size() > 0) {
+    auto header = req_ads.mutable_req_ads()->Add();
+    header->set_camp_id(kLogV2HeaderCampId);
+    SetRequestFields(ad_request, request_feature_.context.req_time(),
+      is_explore_flow, header);
+  }
   for (int i = 0; i < ctr_vec.size(); ++i) {
     const auto& ad_info = fs[i].ad_data().ad_info();
-    modelx::Model_result result;
-    double score = ctr_vec[i] * cvr_vec[i];
-    /*
-    if (is_explore_flow) {
-      score = GetExploreScore(
-          ctr_vec[i], cvr_vec[i], fs[i], random_gen);
-    }
-    */
-    double ecpm = std::max(floor_price, score * 1000.0 * ad_info.bid_price());
-    result.set_creative_id(ad_info.creative_id());
-    result.set_camp_id(ad_info.ad_id());
-    result.set_model_spec(score);
-    result.set_ecpm(ecpm);
-    result.set_app_id(ad_info.app_id());
-    result.set_ext(1);
-    result.set_samplerate(1.0);
-    ads.emplace_back(std::move(result));
+    double score = scored.score[i];
+    scored.ecpm[i] =
+      std::max(floor_price, score * 1000.0 * ad_info.bid_price());
+    scored.order[i] = i;
     // req_ads
     {
       auto req_ad = req_ads.mutable_req_ads()->Add();
-      req_ad->set_request_id(ad_request.request_id());
-      req_ad->set_user_id(ad_request.user_id());
-      req_ad->set_pos_id(ad_request.pos_id());
-      req_ad->set_nation(ad_request.nation());
-      req_ad->set_package_name(ad_request.contexts().package_name());
-      req_ad->set_floor_price(floor_price);
+      if (!log_v2) {
+        SetRequestFields(ad_request, fs[i].context().req_time(),
+          is_explore_flow, req_ad);
+      }
       req_ad->set_creative_id(ad_info.creative_id());
       req_ad->set_camp_id(ad_info.ad_id());
       req_ad->set_app_id(ad_info.app_id());
-      req_ad->set_req_time(fs[i].context().req_time());
       req_ad->set_bid_price(ad_info.bid_price());
       req_ad->set_pctr(ctr_vec[i]);
       req_ad->set_pcvr(cvr_vec[i]);
-      req_ad->set_explore_flow(is_explore_flow);
     }
+  }
+  return true;
+}
+
+
+// 只为排序后保留的候选生成返回结果和RecAdInfo；同一creative_id只记录一次。
+// RecAdInfo分配在log_arena上；v2格式时先在rec_ads_log中写入头部行
+void AdRec::FillResults(
+    const std::vector<double> &ctr_vec,
+    const std::vector<double> &cvr_vec,
+    const modelx::PredictionRequest& ad_request,
+    bool is_explore_flow,
+    bool log_v2,
+    const ScoredAds& scored,
+    std::vector<modelx::Model_result>& ads,
+    google::protobuf::Arena* log_arena,
+    metis::RecAds& rec_ads_log,
+    RecAdMap& rec_ads) {
+  const auto& fs = raw_features_;
+  if (log_v2 && scored.order.size() > 0) {
+    auto header = rec_ads_log.mutable_rec_ads()->Add();
+    header->set_camp_id(kLogV2HeaderCampId);
+    SetRequestFields(ad_request, request_feature_.context.req_time(),
+      is_explore_flow, header);
+    header->mutable_feature()->mutable_context()->CopyFrom(
+      request_feature_.context);
+    header->mutable_feature()->mutable_user_profile()->CopyFrom(
+      request_feature_.user_profile);
+  }
+  ads.reserve(ads.size() + scored.order.size());
+  for (auto i : scored.order) {
+    const auto& ad_info = fs[i].ad_data().ad_info();
+    modelx::Model_result result;
+    result.set_creative_id(ad_info.creative_id());
+    result.set_camp_id(ad_info.ad_id());
+    result.set_model_spec(scored.score[i]);
+    result.set_ecpm(scored.ecpm[i]);
+    result.set_app_id(ad_info.app_id());
+    result.set_ext(1);
+    result.set_samplerate(1.0);
+    ads.emplace_back(std::move(result));
     // rec_ads
     {
-      auto rec_ad = &rec_ads[ad_info.creative_id()];
-      rec_ad->set_request_id(ad_request.request_id());
-      rec_ad->set_user_id(ad_request.user_id());
-      rec_ad->set_pos_id(ad_request.pos_id());
-      rec_ad->set_nation(ad_request.nation());
-      rec_ad->set_package_name(ad_request.contexts().package_name());
-      rec_ad->set_floor_price(floor_price);
+      auto& rec_ad = rec_ads[ad_info.creative_id()];
+      if (rec_ad != nullptr) {
+        continue;
+      }
+      rec_ad = google::protobuf::Arena::CreateMessage<metis::RecAdInfo>(
+        log_arena);
       rec_ad->set_creative_id(ad_info.creative_id());
       rec_ad->set_camp_id(ad_info.ad_id());
       rec_ad->set_app_id(ad_info.app_id());
-      rec_ad->set_req_time(fs[i].context().req_time());
       rec_ad->set_bid_price(ad_info.bid_price());
       rec_ad->set_pctr(ctr_vec[i]);
       rec_ad->set_pcvr(cvr_vec[i]);
-      rec_ad->mutable_feature()->CopyFrom(fs[i]);
-      rec_ad->set_explore_flow(is_explore_flow);
+      if (log_v2) {
+        auto feature = rec_ad->mutable_feature();
+        feature->mutable_ad_data()->CopyFrom(fs[i].ad_data());
+        feature->mutable_user_ad_feature()->CopyFrom(fs[i].user_ad_feature());
+      } else {
+        SetRequestFields(ad_request, fs[i].context().req_time(),
+          is_explore_flow, rec_ad);
+        rec_ad->mutable_feature()->CopyFrom(fs[i]);
+      }
     }
   }
-  return true;
 }
 
 
+// 统计CTR/CVR：按ad_counter加载时预先算好的先验表查找，回退链见StatsPrior
 std::optional<std::vector<double>>
-GetStatsCtr(const std::vector<Feature> &features) {
+GetStatsCtr(const StatsPrior &prior, const FeatureList &features) {
   std::vector<double> ctr_vec;
   ctr_vec.reserve(features.size());
-  for (uint32_t i = 0; i < features.size(); ++i) {
-    const auto &feature = features[i];
-    double ctr = 0.05;
-    double click = 0.0;
-    double cid_imp =feature.ad_data().ad_counter().
-        c_id().count_features_7d().imp();
-    double pkg_imp = feature.ad_data().ad_counter().
-        ad_package_name().count_features_7d().imp();
-    double cate_imp = feature.ad_data().ad_counter().
-        ad_package_category().count_features_7d().imp();
-    if (cid_imp > 500) {
-      click = feature.ad_data().ad_counter().
-          c_id().count_features_7d().click();
-      ctr = click / cid_imp;
-    } else if (pkg_imp > 500) {
-      click = feature.ad_data().ad_counter().
-          ad_package_name().count_features_7d().click();
-      ctr = click / pkg_imp;
-    } else if (cate_imp > 500) {
-      click = feature.ad_data().ad_counter().
-          ad_package_category().count_features_7d().click();
-      ctr = click / cate_imp;
-    }
-    ctr_vec.push_back(ctr);
+  for (const auto &feature : features) {
+    ctr_vec.push_back(prior.Ctr(feature));
   }
   return std::make_optional(std::move(ctr_vec));
 }
 
 
 std::optional<std::vector<double>>
-GetStatsCvr(const std::vector<Feature> &features) {
+GetStatsCvr(const StatsPrior &prior, const FeatureList &features) {
   common::Timer timer(cvrMs);
   std::vector<double> cvr_vec;
   cvr_vec.reserve(features.size());
-  for (uint32_t i = 0; i < features.size(); ++i) {
-    const auto &feature = features[i];
-    double cvr = 0.03;
-    double attr_install(0.0);
-    double click(0.0);
-    double clk_thres(300);
-    do {
-      click = feature.ad_data().ad_counter().c_id().count_features_1d().click();
-      if (click > clk_thres) {
-        attr_install = std::max(feature.ad_data().ad_counter().
-            c_id().count_features_1d().attr_install(), 1);
-        break;
-      }
-      click = feature.ad_data().ad_counter().c_id().count_features_3d().click();
-      if (click > clk_thres) {
-        attr_install = std::max(feature.ad_data().ad_counter().
-            c_id().count_features_3d().attr_install(), 1);
-        break;
-      }
-      click = feature.ad_data().ad_counter().c_id().count_features_7d().click();
-      if (click > clk_thres) {
-        attr_install = std::max(feature.ad_data().ad_counter().
-            c_id().count_features_7d().attr_install(), 1);
-        break;
-      }
-      click = feature.ad_data().ad_counter().ad_package_name().
-          count_features_7d().click();
-      if (click > clk_thres) {
-        attr_install = std::max(feature.ad_data().ad_counter().
-            ad_package_name().count_features_7d().attr_install(), 1);
-        break;
-      }
-      click = feature.ad_data().ad_counter().
-          ad_package_category().count_features_7d().click();
-      if (click > clk_thres) {
-        attr_install = std::max(feature.ad_data().ad_counter().
-            ad_package_category().count_features_7d().attr_install(), 1);
-        break;
-      }
-    } while(0);
-    if (click > clk_thres) {
-      cvr = attr_install / click;
-    }
-    cvr_vec.push_back(cvr);
+  for (const auto &feature : features) {
+    cvr_vec.push_back(prior.Cvr(feature));
   }
   return std::make_optional(std::move(cvr_vec));
 }
@@ -469,19 +304,20 @@ GetStatsCvr(const std::vector<Feature> &features) {
 
 /*
   优先返回新广告
-  1 将新广告放到ads前面
+  1 将新广告放到order前面
   2 shuffle新广告
-  3 截断ads为size_limit
+  3 截断order为size_limit
+  order为候选在fs中的下标
 */
 void NewAdBoost(
-    const std::vector<Feature>& fs,
-    std::vector<modelx::Model_result> ads,
+    const FeatureList& fs,
+    std::vector<int32_t> order,
     size_t size_limit,
-    std::map<std::string, metis::RecAdInfo> &rec_ad_map) {
-  std::vector<const modelx::Model_result*> new_ad, old_ad;
+    RecAdMap &rec_ad_map) {
+  std::vector<int32_t> new_ad, old_ad;
   auto now_time = time(NULL);
   auto time_delta = 3 * 24 * 3600;
-  for (size_t i = 0; i < fs.size() && i < ads.size(); ++i) {
+  for (auto i : order) {
     const auto &ad = fs[i];
     auto time_diff = now_time - ad.ad_data().ad_info().creative_create_time();
     auto cid_imp = ad.ad_data().ad_counter().c_id().count_features_7d().imp();
@@ -489,209 +325,633 @@ void NewAdBoost(
       const auto &cid = ad.ad_data().ad_info().creative_id();
       auto it = rec_ad_map.find(cid);
       if (it != rec_ad_map.end()) {
-        it->second.set_new_ad_flow(true);
+        it->second->set_new_ad_flow(true);
       }
-      new_ad.push_back(&ads[i]);  // 不能提前终止，因为要shuffle
+      new_ad.push_back(i);  // 不能提前终止，因为要shuffle
     } else {
-      old_ad.push_back(&ads[i]);
+      old_ad.push_back(i);
     }
   }
   if (new_ad.empty()) {
     return;
   }
   std::random_shuffle(new_ad.begin(), new_ad.end());
-  std::vector<modelx::Model_result> ad_result;
-  for (auto p : new_ad) {
-    ad_result.emplace_back(*p);
+  std::vector<int32_t> ad_result;
+  for (auto i : new_ad) {
+    ad_result.push_back(i);
     if (ad_result.size() >= size_limit) {
       break;
     }
   }
-  for (auto p : old_ad) {
+  for (auto i : old_ad) {
     if (ad_result.size() >= size_limit) {
       break;
     }
-    ad_result.emplace_back(*p);
+    ad_result.push_back(i);
   }
-  ads.swap(ad_result);
+  order.swap(ad_result);
 }
 
 
-void FeatureExtractTask(const std::vector<Feature> &fs,
-    std::vector<FeatureResultPtr>& features, size_t begin, size_t end) {
+// 只读视图：以别名方式引用Feature的部分字段，析构前解除别名
+class FeatureView {
+ public:
+  // 请求级：仅含context和user_profile
+  explicit FeatureView(RequestFeature& rf) {
+    view_.unsafe_arena_set_allocated_context(&rf.context);
+    view_.unsafe_arena_set_allocated_user_profile(&rf.user_profile);
+  }
+
+  // 候选级：仅含ad_data和user_ad_feature，只借用f中已有的子消息。
+  // view_只经get()以const方式访问，不会修改f
+  explicit FeatureView(const Feature& f) {
+    if (f.has_ad_data()) {
+      view_.unsafe_arena_set_allocated_ad_data(
+        const_cast<AdData*>(&f.ad_data()));
+    }
+    if (f.has_user_ad_feature()) {
+      view_.unsafe_arena_set_allocated_user_ad_feature(
+        const_cast<UserAdFeature*>(&f.user_ad_feature()));
+    }
+  }
+
+  FeatureView(const FeatureView&) = delete;
+  FeatureView& operator=(const FeatureView&) = delete;
+
+  ~FeatureView() {
+    view_.unsafe_arena_release_context();
+    view_.unsafe_arena_release_user_profile();
+    view_.unsafe_arena_release_ad_data();
+    view_.unsafe_arena_release_user_ad_feature();
+  }
+
+  const Feature& get() const { return view_; }
+
+ private:
+  Feature view_;
+};
+
+
+// 分层抽取时各特征的来源，由"layered_extract"配置按特征名声明
+enum class FeatureSide : uint8_t {
+  kRequest,  // 只取决于context和user_profile，每个请求抽取一次
+  kAd,       // 只取决于ad_data和user_ad_feature，各候选分别抽取
+  kCross,    // 同时取决于两侧，只能用完整Feature抽取
+};
+
+struct LayeredExtractOptions {
+  std::map<std::string, FeatureSide, std::less<>> sides;
+  double verify_percent = 1;  // 抽样用完整Feature复算并比对的候选比例
+};
+
+static LayeredExtractOptions layered_options;
+static std::atomic<int64_t> layered_mismatch_minute{0};
+
+
+// full中声明为请求级的特征写入out
+template <typename M>
+void SelectRequestFeatures(const M& full, M& out) {
+  const auto& sides = layered_options.sides;
+  for (const auto& p : full) {
+    auto it = sides.find(p.first);
+    if (it != sides.end() && it->second == FeatureSide::kRequest) {
+      out.insert(p);
+    }
+  }
+}
+
+
+// out为仅含广告侧的抽取结果，其中的请求级特征改用request中的取值。
+// out中有未声明的特征或交叉特征，或请求级特征在request中没有时
+// 返回false，由调用方改用完整Feature抽取
+template <typename M>
+bool MergeFeatures(const M& request, M& out) {
+  const auto& sides = layered_options.sides;
+  for (auto& p : out) {
+    auto it = sides.find(p.first);
+    if (it == sides.end() || it->second == FeatureSide::kCross) {
+      return false;
+    }
+    if (it->second == FeatureSide::kRequest) {
+      auto it_request = request.find(p.first);
+      if (it_request == request.end()) {
+        return false;
+      }
+      p.second = it_request->second;
+    }
+  }
+  for (const auto& p : request) {
+    out.insert(p);
+  }
+  return true;
+}
+
+
+// 第一个取值不同或只在一侧出现的特征名，相同时返回空
+template <typename M>
+std::string FirstDiff(const M& a, const M& b) {
+  for (const auto& p : a) {
+    auto it = b.find(p.first);
+    if (it == b.end() || !(it->second == p.second)) {
+      return p.first;
+    }
+  }
+  for (const auto& p : b) {
+    if (a.find(p.first) == a.end()) {
+      return p.first;
+    }
+  }
+  return std::string();
+}
+
+
+// 分层结果与完整抽取不同时计数，并每分钟至多记一次日志，指出配置有误的特征
+void VerifyLayered(const FeatureResult& layered, const FeatureResult& full) {
+  auto diff = FirstDiff(layered.int_features, full.int_features);
+  if (diff.empty()) {
+    diff = FirstDiff(layered.float_features, full.float_features);
+  }
+  if (diff.empty()) {
+    diff = FirstDiff(layered.sequence_features, full.sequence_features);
+  }
+  if (diff.empty()) {
+    return;
+  }
+  common::Stats::get()->Incr(layeredExtractMismatch);
+  int64_t minute = std::chrono::duration_cast<std::chrono::minutes>(
+    std::chrono::steady_clock::now().time_since_epoch()).count();
+  auto last = layered_mismatch_minute.load(std::memory_order_relaxed);
+  if (minute > last &&
+      layered_mismatch_minute.compare_exchange_strong(last, minute)) {
+    LOG_ERROR("layered extract mismatch, check layered_extract config: "
+      << "feature=" << diff);
+  }
+}
+
+
+// 是否抽中该候选做比对
+bool SampleLayeredVerify() {
+  if (layered_options.verify_percent <= 0) {
+    return false;
+  }
+  return ThreadRng().Uniform() * 100 < layered_options.verify_percent;
+}
+
+
+// 请求级特征：仅含user/context的Feature抽取结果中声明为请求级的部分
+FeatureResult ExtractRequestFeature(RequestFeature& rf) {
+  ModelFeature mf;
+  auto full = mf.extract_feature(FeatureView(rf).get());
+  FeatureResult result;
+  SelectRequestFeatures(full->int_features, result.int_features);
+  SelectRequestFeatures(full->float_features, result.float_features);
+  SelectRequestFeatures(full->sequence_features, result.sequence_features);
+  return result;
+}
+
+
+void ExtractOne(ModelFeature& mf, const Feature& f,
+    const FeatureResult* request_result, FeatureResultPtr& out) {
+  if (request_result != nullptr) {
+    auto result = mf.extract_feature(FeatureView(f).get());
+    if (MergeFeatures(request_result->int_features, result->int_features) &&
+        MergeFeatures(request_result->float_features,
+          result->float_features) &&
+        MergeFeatures(request_result->sequence_features,
+          result->sequence_features)) {
+      if (!SampleLayeredVerify()) {
+        out = std::move(result);
+        return;
+      }
+      // 抽中的候选使用完整抽取的结果
+      out = mf.extract_feature(f);
+      VerifyLayered(*result, *out);
+      return;
+    }
+    common::Stats::get()->Incr(layeredExtractFallback);
+  }
+  out = mf.extract_feature(f);
+}
+
+
+void FeatureExtractTask(const FeatureList &fs,
+    const FeatureResult* request_result,
+    const DenseLayout& layout,
+    std::vector<FeatureResultPtr>& features,
+    std::vector<DenseFeatures>& dense, size_t begin, size_t end) {
   ModelFeature mf;
   for (; begin < end; ++begin) {
-    features[begin] = mf.extract_feature(fs[begin]);
+    ExtractOne(mf, fs[begin], request_result, features[begin]);
+    BuildDenseFeatures(layout, *features[begin], dense[begin]);
   }
 }
 
 
-std::vector<FeatureResultPtr> FeatureExtract(const std::vector<Feature> &fs) {
+// layout中的字段是否都声明为请求级或广告侧。交叉特征和未声明的特征
+// 在两个部分视图中都可能抽取不到，合并时无从发现，模型用到时须完整抽取
+static bool LayeredCovers(const DenseLayout& layout) {
+  const auto& sides = layered_options.sides;
+  for (size_t i = 0; i < kFieldTypeCount; ++i) {
+    for (const auto& field : layout.fields(static_cast<FieldType>(i))) {
+      auto it = sides.find(*field.name);
+      if (it == sides.end() || it->second == FeatureSide::kCross) {
+        return false;
+      }
+    }
+  }
+  return true;
+}
+
+
+// layered为true且配置了layered_extract时，请求级特征每个请求只抽取一次，
+// 各候选只抽取广告侧；模型用到交叉或未声明的特征时仍完整抽取。
+// 同时按layout生成各候选的稠密特征
+std::vector<FeatureResultPtr> FeatureExtract(RequestFeature &rf,
+    const FeatureList &fs, bool layered, const DenseLayout& layout,
+    std::vector<DenseFeatures>& dense) {
   common::Timer timer(featureExtractMs);
   std::vector<FeatureResultPtr> features(fs.size());
-  constexpr size_t batch_count = 2;
-  auto batch_size = fs.size() / batch_count + 1;
-  std::vector<std::future<void>> results;
-  for (size_t i = 0; i < batch_count; ++i) {
-    auto begin = batch_size * i;
-    auto end = std::min(fs.size(), batch_size * (i + 1));
-    results.emplace_back(
-      thread_pool.enqueue(
-        [&fs, &features, begin, end] () {
-          FeatureExtractTask(fs, features, begin, end);
-        }
-      )
-    );
-  }
-  // 等待所有任务执行完毕
-  for (auto& result : results) {
-    result.get();
+  dense.resize(fs.size());
+  std::optional<FeatureResult> request_result;
+  if (layered && !fs.empty() && !layered_options.sides.empty()) {
+    if (LayeredCovers(layout)) {
+      request_result = ExtractRequestFeature(rf);
+    } else {
+      common::Stats::get()->Incr(layeredExtractFallback);
+    }
   }
+  const auto* request_result_ptr =
+      request_result.has_value() ? &request_result.value() : nullptr;
+  static ParallelCost cost(20000);
+  ParallelFor(fs.size(), cost,
+    [&fs, request_result_ptr, &layout, &features, &dense] (size_t begin,
+        size_t end) {
+      FeatureExtractTask(fs, request_result_ptr, layout, features, dense,
+        begin, end);
+      return true;
+    });
   return features;
 }
 
 
-std::optional<std::vector<double>>
-AdRec::GetModelScore(
+// names为特征名的数组，写入sides；重复声明的特征返回false
+static bool ParseFeatureSides(const nlohmann::json& names, FeatureSide side,
+    std::map<std::string, FeatureSide, std::less<>>& sides) {
+  if (!names.is_array()) {
+    return false;
+  }
+  for (const auto& name : names) {
+    if (!name.is_string() ||
+        !sides.emplace(name.get<std::string>(), side).second) {
+      return false;
+    }
+  }
+  return true;
+}
+
+
+bool InitLayeredExtract(const nlohmann::json& conf) {
+  LayeredExtractOptions options;
+  auto it = conf.find("layered_extract");
+  if (it != conf.end()) {
+    const auto& layered_conf = it.value();
+    if (!layered_conf.is_object() ||
+        !ParseFeatureSides(layered_conf.value("request_features",
+          nlohmann::json::array()), FeatureSide::kRequest, options.sides) ||
+        !ParseFeatureSides(layered_conf.value("ad_features",
+          nlohmann::json::array()), FeatureSide::kAd, options.sides) ||
+        !ParseFeatureSides(layered_conf.value("cross_features",
+          nlohmann::json::array()), FeatureSide::kCross, options.sides)) {
+      LOG_ERROR("layered_extract config invalid");
+      return false;
+    }
+    options.verify_percent = layered_conf.value("verify_percent",
+      options.verify_percent);
+    if (options.verify_percent < 0 || options.verify_percent > 100) {
+      LOG_ERROR("layered_extract verify_percent invalid: "
+        << options.verify_percent);
+      return false;
+    }
+  }
+  auto count = [&options] (FeatureSide side) {
+    return std::count_if(options.sides.begin(), options.sides.end(),
+      [side] (const auto& p) { return p.second == side; });
+  };
+  LOG_INFO("layered_extract request_features=" << count(FeatureSide::kRequest)
+    << " ad_features=" << count(FeatureSide::kAd)
+    << " cross_features=" << count(FeatureSide::kCross)
+    << " verify_percent=" << options.verify_percent);
+  layered_options = std::move(options);
+  return true;
+}
+
+
+// 按模型配置的后端打分：tf-serving在调用线程上填充特征后异步发出Predict，
+// cpu后端提交到CPU线程池计算；返回的future在分数可用后就绪
+ScoreFuture AdRec::GetModelScore(
     const std::string &model_name,
-    const std::string &tf_output) {
-  auto model = GetTfModel(model_name);
-  if (model == nullptr) {
+    const std::string &tf_output,
+    Deadline::Clock::time_point until) {
+  auto it_plan = fill_plans_.find(model_name);
+  if (it_plan == fill_plans_.end() || it_plan->second.plan == nullptr) {
     common::Stats::get()->Incr(tfModelNameError);
     LOG_ERROR("invalid tf model_name: " << model_name);
-    return std::nullopt;
+    return ReadyScore(std::nullopt);
+  }
+  const auto& plan = *it_plan->second.plan;
+  if (!plan.valid()) {
+    common::Stats::get()->Incr(tfFeatureTypeError);
+    return ReadyScore(std::nullopt);
+  }
+  auto& fill = it_plan->second;
+  if (fill.use_cache && fill.misses.empty()) {
+    // 没有需要预估的素材，由MergePredCache取缓存的分数
+    return ReadyScore(std::make_optional(std::vector<double>()));
+  }
+  // 部分命中时只为未命中的素材填充特征；行数不同，不与其他模型共用tensor。
+  // 异步读取输入的后端在future就绪前仍访问features，故保存在fill中
+  const auto* features = &dense_features_;
+  auto* cache = &tensor_cache_;
+  TensorCache missed_cache(arena_.get());
+  if (fill.use_cache && fill.misses.size() < dense_features_.size()) {
+    fill.missed_features.clear();
+    fill.missed_features.reserve(fill.misses.size());
+    for (auto i : fill.misses) {
+      fill.missed_features.push_back(dense_features_[i]);
+    }
+    features = &fill.missed_features;
+    cache = &missed_cache;
   }
-  // tf request
-  tensorflow::serving::PredictRequest request;
-  request.mutable_model_spec()->set_name(model_name);
-  if (!FillTfFeatures(model->dnn_dict, model_features_,
-      *request.mutable_inputs())) {
-    return std::nullopt;
+  return GetModelBackend(model_name).Score(ScoreInput{model_name, plan,
+    *features, fill.packed, *cache, tf_output, until});
+}
+
+
+// 开启pred_cache时把模型对未命中素材的打分与命中的分数合并，并写入缓存
+std::optional<std::vector<double>> AdRec::MergePredCache(
+    const std::string& model_name,
+    std::optional<std::vector<double>> predicted) {
+  auto it = fill_plans_.find(model_name);
+  if (!predicted.has_value() || it == fill_plans_.end() ||
+      !it->second.use_cache) {
+    return predicted;
   }
-  // call tf-serving
-  tensorflow::serving::PredictResponse response;
-  if (!GetTfClient().Predict(request, response)) {
+  auto& fill = it->second;
+  if (predicted->size() != fill.misses.size()) {
+    LOG_ERROR("predicted size invalid: model=" << model_name << " "
+      << predicted->size() << " " << fill.misses.size());
     return std::nullopt;
   }
-  const auto& it_resp = response.outputs().find(tf_output);
-  if (it_resp == response.outputs().end()) {
-    common::Stats::get()->Incr(tfModelOutputError);
-    LOG_ERROR("tf output not found: model=" << model_name
-      << " output=" << tf_output);
-    return std::nullopt;
+  for (size_t k = 0; k < fill.misses.size(); ++k) {
+    auto i = fill.misses[k];
+    fill.cached[i] = (*predicted)[k];
+    PredictionCache::Instance().Insert(fill.cache_keys[i], fill.cached[i]);
   }
+  return std::make_optional(std::move(fill.cached));
+}
 
-  const auto &tensor_proto = it_resp->second;
-  if (tensor_proto.dtype() != tensorflow::DataType::DT_FLOAT) {
-    common::Stats::get()->Incr(tfDataTypeError);
-    LOG_ERROR("tf response data_type is not float: " << tensor_proto.dtype());
-    return std::nullopt;
-  }
-  if (tensor_proto.float_val_size() != model_features_.size()) {
-    common::Stats::get()->Incr(tfTensorSizeError);
-    LOG_ERROR("tf response size invalid: " << tensor_proto.float_val_size() <<
-      " " << model_features_.size());
-    return std::nullopt;
+/* ========================================================================== */
+
+static const std::string kCtrModel = "dnn_model_t1";
+static const std::string kCvrModel = "dnn_model_cvr_t1";
+
+
+bool AdRec::ExpEnabled(const std::string& name) const {
+  auto it = request_->exp_params().exp_params().find(name);
+  return it != request_->exp_params().exp_params().end() && it->second == 1;
+}
+
+
+// 取本请求要用到的模型的填充计划并登记其字段，须在生成稠密特征之前调用
+void AdRec::PrepareFillPlans() {
+  for (const auto* model_name : {
+      ExpEnabled("stats_ctr") ? nullptr : &kCtrModel,
+      ExpEnabled("stats_cvr") ? nullptr : &kCvrModel}) {
+    if (model_name == nullptr) {
+      continue;
+    }
+    auto& fill = fill_plans_[*model_name];
+    auto model = FindTfModel(*model_name);
+    if (model == nullptr) {
+      continue;
+    }
+    fill.plan = FeatureFillPlan::Get(*model_name, model);
+    if (fill.plan->valid()) {
+      dense_layout_.Add(*fill.plan);
+    }
+    // 紧凑编码按模型灰度：exp_params中 tf_packed:<model_name> 为1时开启
+    fill.packed = ExpEnabled("tf_packed:" + *model_name);
+    if (!GetModelBackend(*model_name).uses_tensors()) {
+      continue;
+    }
+    for (const auto& field : fill.plan->fields()) {
+      tensor_cache_.Declare(field, fill.packed);
+    }
   }
+}
 
-  // set score
-  std::vector<double> score_vec;
-  score_vec.reserve(model_features_.size());
-  for (int i = 0; i < tensor_proto.float_val_size(); ++i) {
-    score_vec.push_back(tensor_proto.float_val(i));
+
+// 开启pred_cache实验时按素材查预估缓存；返回是否仍有素材需要请求模型
+bool AdRec::LookupPredCache() {
+  if (!ExpEnabled("pred_cache") || !PredictionCache::Instance().enabled()) {
+    return true;
   }
-  return std::make_optional(std::move(score_vec));
+  auto& cache = PredictionCache::Instance();
+  const auto& model_request = request_->request();
+  bool need_predict = false;
+  for (auto& p : fill_plans_) {
+    auto& fill = p.second;
+    if (fill.plan == nullptr || !fill.plan->valid()) {
+      need_predict = true;
+      continue;
+    }
+    fill.use_cache = true;
+    fill.cache_keys.resize(raw_features_.size());
+    fill.cached.resize(raw_features_.size());
+    fill.misses.clear();
+    for (int i = 0; i < raw_features_.size(); ++i) {
+      fill.cache_keys[i] = PredictionCache::Key(p.first, fill.plan->version(),
+        model_request.user_id(), model_request.pos_id(),
+        raw_features_[i].ad_data().ad_info().creative_id(), feature_version_);
+      if (!cache.Find(fill.cache_keys[i], &fill.cached[i])) {
+        fill.misses.push_back(i);
+      }
+    }
+    if (!raw_features_.empty()) {
+      common::Stats::get()->AddMetric(predCacheHitRatio,
+        1.0 - double(fill.misses.size()) / raw_features_.size());
+    }
+    need_predict = need_predict || !fill.misses.empty();
+  }
+  return need_predict;
 }
 
-/* ========================================================================== */
 
-std::optional<std::vector<double>> AdRec::GetCtr() {
-  auto model_exp_config_ite =
-      request_->exp_params().exp_params().find("stats_ctr");
-  if (model_exp_config_ite != request_->exp_params().exp_params().end() &&
-      model_exp_config_ite->second == 1) {
-    return GetStatsCtr(raw_features_);
+ScoreFuture AdRec::GetCtr(Deadline::Clock::time_point until) {
+  if (ExpEnabled("stats_ctr")) {
+    return ReadyScore(GetStatsCtr(*stats_prior_, raw_features_));
   }
-  return GetModelScore("dnn_model_t1", "predictions");
+  return GetModelScore(kCtrModel, "predictions", until);
 }
 
-std::optional<std::vector<double>> AdRec::GetCvr() {
-  auto model_exp_config_ite =
-      request_->exp_params().exp_params().find("stats_cvr");
-  if (model_exp_config_ite != request_->exp_params().exp_params().end() &&
-      model_exp_config_ite->second == 1) {
-    return GetStatsCvr(raw_features_);
+ScoreFuture AdRec::GetCvr(Deadline::Clock::time_point until) {
+  if (ExpEnabled("stats_cvr")) {
+    return ReadyScore(GetStatsCvr(*stats_prior_, raw_features_));
   }
-  return GetModelScore("dnn_model_cvr_t1", "predictions");
+  return GetModelScore(kCvrModel, "predictions", until);
 }
 
 /* ========================================================================== */
 
 std::tuple<bool, bool> GetEEConfig() {
+  const auto& explore = GetExploreOptions();
   bool is_explore_flow(false), is_new_ad_sup(false);
   std::uniform_int_distribution<int> udist(1, 100);
-  std::default_random_engine random_gen(
-      std::chrono::system_clock::now().time_since_epoch().count());
-  auto rand_num = udist(random_gen);
-  if (rand_num <= 5) {
+  auto rand_num = udist(ThreadRng());
+  if (rand_num <= explore.explore_percent) {
     is_explore_flow = true;
-  } else if (rand_num <= 10) {
+  } else if (rand_num <= explore.explore_percent + explore.new_ad_percent) {
     is_new_ad_sup = true;
   }
   return std::make_tuple(is_explore_flow, is_new_ad_sup);
 }
 
 
+// 日志记录交给MetisLogger后即返回，发送不计入请求耗时
 void SendMetisLog(
     const std::vector<modelx::Model_result>& ads,
-    const metis::ReqAds& req_ads,
-    std::map<std::string, metis::RecAdInfo>& rec_ad_map) {
-  // prepare rec ads for metis log
-  metis::RecAds rec_ads;
-  auto rec_ads_list = rec_ads.mutable_rec_ads();
+    MetisRecordPtr record,
+    RecAdMap& rec_ad_map) {
+  // prepare rec ads for metis log，与rec_ad_map同在record的arena上，只移交指针
+  auto rec_ads_list = record->rec_ads->mutable_rec_ads();
   for (const auto& ad : ads) {
     const auto& cid = ad.creative_id();
     auto it = rec_ad_map.find(cid);
     if (it == rec_ad_map.end()) {
       continue;
     }
-    rec_ads_list->Add()->Swap(&it->second);
+    rec_ads_list->AddAllocated(it->second);
+    rec_ad_map.erase(it);
   }
-  // send kafka
-  SendRecAds(rec_ads);
-  SendReqAds(req_ads);
+  MetisLogger::Instance().Submit(std::move(record));
 }
 
 
-inline bool cmp (const modelx::Model_result& a, const modelx::Model_result& b) {
-  return a.ecpm() > b.ecpm();
+// 按ecpm从高到低取前size个候选的下标，只对这size个排序
+void TopByEcpm(const std::vector<double>& ecpm, size_t size,
+    std::vector<int32_t>& order) {
+  auto cmp = [&ecpm] (int32_t a, int32_t b) { return ecpm[a] > ecpm[b]; };
+  std::nth_element(order.begin(), order.begin() + size, order.end(), cmp);
+  std::sort(order.begin(), order.begin() + size, cmp);
 }
 
 
-std::pair<AdRec::FutureCtr, AdRec::FutureCvr> AdRec::GetCtrCvr() {
-  auto ctr_fut = thread_pool.enqueue([this] () { return GetCtr(); });
-  auto cvr_fut = thread_pool.enqueue([this] () { return GetCvr(); });
+// 在until之前取模型分数，超时则改用统计值；fallback_metric记录降级次数
+// （超时常成批出现，不逐次打日志）。tf-serving的PredictCall由I/O线程持有，
+// 超时后直接放弃；cpu后端的任务仍读取本请求的特征，须等它结束，
+// 它在until之后最多再算完手头的一个分块
+std::optional<std::vector<double>> AdRec::WaitScore(
+    const std::string& model_name, ScoreFuture& future,
+    Deadline::Clock::time_point until, StatsScoreFn stats_fn,
+    int fallback_metric) {
+  if (until != Deadline::Clock::time_point::max() &&
+      future.wait_until(until) != std::future_status::ready) {
+    if (GetModelBackend(model_name).reads_input_async()) {
+      future.wait();
+    }
+    common::Stats::get()->Incr(fallback_metric);
+    return stats_fn(*stats_prior_, raw_features_);
+  }
+  return MergePredCache(model_name, future.get());
+}
+
+
+// 特征填充在请求线程上进行（内部经ParallelFor并行），CTR的Predict发出
+// （或提交到CPU线程池）后即开始填充CVR；网络等待不占用CPU线程池
+std::pair<AdRec::FutureCtr, AdRec::FutureCvr> AdRec::GetCtrCvr(
+    RequestTrace& trace, Deadline::Clock::time_point until) {
+  auto ctr_fut = GetCtr(until);
+  trace.Mark(TraceStage::kFillCtr);
+  auto cvr_fut = GetCvr(until);
+  trace.Mark(TraceStage::kFillCvr);
   return std::make_pair(std::move(ctr_fut), std::move(cvr_fut));
 }
 
 
+// 关闭arena时raw_features_中的Feature随RequestArena逐个析构，
+// 须先解除与request_feature_共享的Context和UserProfile
+AdRec::~AdRec() {
+  if (arena_.get() == nullptr) {
+    for (auto& feature : raw_features_) {
+      DetachRequestFeature(&feature);
+    }
+  }
+}
+
+
 bool AdRec::Recommend(std::vector<modelx::Model_result>& ads) {
-  common::Stats::get()->AddMetric(ad::modelTaskCount, thread_pool.task_count());
-  InitShareStoreData();
+  common::Stats::get()->AddMetric(ad::modelTaskCount,
+      CpuThreadPool().task_count());
+  RequestTrace trace(request_->request().user_id());
+  trace.set_candidates(request_->request().creatives_size());
+  Deadline deadline;
+  InitShareStoreData(trace, deadline.StageDeadline(Stage::kSharestore));
+  deadline.Finish(Stage::kSharestore);
   // convert raw data to feature_input
-  if (!DataToFeatureInput(*request_, store_user_counter_, store_user_profile_,
-        *GetStoreAdInfo(), *GetStoreAdCounter(), raw_features_)) {
+  auto ad_info = GetStoreAdInfo();
+  auto ad_counter = GetStoreAdCounter();
+  stats_prior_ = ad_counter->prior;
+  if (UNLIKELY(TrafficRecorder::Instance().Sample())) {
+    TrafficRecorder::Instance().Record(*request_, *user_data_, *ad_info,
+      *ad_counter);
+  }
+  auto ads_selected = SelectUncappedAds(*ad_info, *ad_counter);
+  trace.Mark(TraceStage::kCapFilter);
+  if (!DataToFeatureInput(*request_, ads_selected, user_data_->counter_index,
+        *user_data_->profile,
+        *ad_info, *ad_counter, request_feature_,
+        raw_features_)) {
     common::Stats::get()->Incr(data2FeatureInputError);
     LOG_ERROR("convert raw data to feature_input failed");
     return false;
   }
-
-  DelExcessCapAd(raw_features_);
-  model_features_ = FeatureExtract(raw_features_);
-
-  auto ctr_cvr = GetCtrCvr();
-  auto ctr_opt = ctr_cvr.first.get();
-  auto cvr_opt = ctr_cvr.second.get();
+  trace.set_candidates(raw_features_.size());
+  trace.Mark(TraceStage::kFeature);
+  deadline.Finish(Stage::kFeature);
+
+  // 已超过总截止时间时不再抽取特征和请求模型，直接用统计值打分
+  bool use_model = !deadline.Expired();
+  PrepareFillPlans();
+  feature_version_ = HashKeyPart(ad_info->version,
+    static_cast<int64_t>(ad_counter->version));
+  // 所有模型都命中预估缓存时无需抽取特征
+  if (use_model && LookupPredCache()) {
+    model_features_ = FeatureExtract(request_feature_, raw_features_,
+      ExpEnabled("layered_extract"), dense_layout_, dense_features_);
+  }
+  trace.Mark(TraceStage::kExtract);
+  deadline.Finish(Stage::kExtract);
+
+  std::optional<std::vector<double>> ctr_opt, cvr_opt;
+  if (use_model && !deadline.Expired()) {
+    auto until = deadline.StageDeadline(Stage::kPredict);
+    auto ctr_cvr = GetCtrCvr(trace, until);
+    ctr_opt = WaitScore(kCtrModel, ctr_cvr.first, until, GetStatsCtr,
+      ctrFallback);
+    trace.Mark(TraceStage::kPredictCtr);
+    cvr_opt = WaitScore(kCvrModel, ctr_cvr.second, until, GetStatsCvr,
+      cvrFallback);
+    trace.Mark(TraceStage::kPredictCvr);
+  } else {
+    common::Stats::get()->Incr(deadlineExpired);
+    common::Stats::get()->Incr(ctrFallback);
+    common::Stats::get()->Incr(cvrFallback);
+    ctr_opt = GetStatsCtr(*stats_prior_, raw_features_);
+    trace.Mark(TraceStage::kPredictCtr);
+    cvr_opt = GetStatsCvr(*stats_prior_, raw_features_);
+    trace.Mark(TraceStage::kPredictCvr);
+  }
+  deadline.Finish(Stage::kPredict);
   if (!ctr_opt.has_value() || !cvr_opt.has_value()) {
     return false;
   }
@@ -699,33 +959,42 @@ bool AdRec::Recommend(std::vector<modelx::Model_result>& ads) {
   bool is_explore_flow(false), is_new_ad_sup(false);
   std::tie (is_explore_flow, is_new_ad_sup) = GetEEConfig();
 
-  metis::ReqAds req_ads;  // metis logging for all ads in request
-  std::map<std::string, metis::RecAdInfo> rec_ad_map;
-  if (!FillScore(ctr_opt.value(), cvr_opt.value(), ads, request_->request(),
-      is_explore_flow, req_ads, rec_ad_map)) {
+  // metis logging for all ads in request
+  auto record = std::make_unique<MetisRecord>();
+  bool log_v2 = MetisLogger::Instance().format() == kLogFormatV2;
+  ScoredAds scored;
+  if (!FillScore(ctr_opt.value(), cvr_opt.value(), request_->request(),
+      is_explore_flow, log_v2, scored, *record->req_ads)) {
     return false;
   }
+  trace.Mark(TraceStage::kScore);
 
-  auto size = std::min(ads.size(),
+  auto size = std::min(scored.order.size(),
     static_cast<size_t>(request_->request().contexts().ad_count()));
 
-  auto model_exp_config_ite =
-      request_->exp_params().exp_params().find("random");
-  if (model_exp_config_ite != request_->exp_params().exp_params().end() &&
-      model_exp_config_ite->second == 1) {
-    if (ads.size() > 0) {
-      std::random_shuffle(ads.begin(), ads.end());
+  if (ExpEnabled("random")) {
+    if (scored.order.size() > 0) {
+      std::random_shuffle(scored.order.begin(), scored.order.end());
     }
   } else {
-    std::partial_sort(ads.begin(), ads.begin() + size, ads.end(), cmp);
-    if (is_new_ad_sup) {
-      NewAdBoost(raw_features_, ads, size, rec_ad_map);
-    }
+    TopByEcpm(scored.ecpm, size, scored.order);
   }
+  scored.order.resize(size);
+  trace.Mark(TraceStage::kSort);
 
-  ads.resize(size);
+  RecAdMap rec_ad_map(RecAdMap::allocator_type(arena_.get()));
+  FillResults(ctr_opt.value(), cvr_opt.value(), request_->request(),
+    is_explore_flow, log_v2, scored, ads, &record->arena, *record->rec_ads,
+    rec_ad_map);
+  trace.Mark(TraceStage::kResult);
+  if (is_new_ad_sup && !ExpEnabled("random")) {
+    NewAdBoost(raw_features_, scored.order, size, rec_ad_map);
+  }
+  trace.Mark(TraceStage::kNewAdBoost);
 
-  SendMetisLog(ads, req_ads, rec_ad_map);
+  SendMetisLog(ads, std::move(record), rec_ad_map);
+  trace.Mark(TraceStage::kLog);
+  deadline.Finish(Stage::kLog);
   return true;
 }
 
@@ -2,48 +2,152 @@
 
 #include <future>
 #include <memory>
+#include <map>
 #include <optional>
+#include <string_view>
 #include <vector>
 
 #include "ad_model_service.pb.h"
+#include "metis_kafka.pb.h"
+#include "feature/counter_index.h"
+#include "feature/feature.h"
+#include "rec/deadline.h"
+#include "rec/pred_cache.h"
+#include "rec/request_arena.h"
+#include "rec/tf_feature.h"
+#include "rec/tf_predict.h"
+#include "rec/trace.h"
+#include "rec/user_cache.h"
 #include "store_table.pb.h"
 
 struct FeatureResult;
 
 namespace ad {
 
+// creative_id -> RecAdInfo，key引用raw_features_中的字符串，节点分配在Arena上
+using RecAdMap = std::map<std::string_view, metis::RecAdInfo*, std::less<>,
+  ArenaAllocator<std::pair<const std::string_view, metis::RecAdInfo*>>>;
+
+// 候选的打分结果，按下标与raw_features_对应；order为排序后的候选下标
+struct ScoredAds {
+  std::vector<double> score;
+  std::vector<double> ecpm;
+  std::vector<int32_t> order;
+};
+
+// Recommend的各步骤，在此声明供bench/单独测量
+std::vector<FeatureResultPtr> FeatureExtract(RequestFeature &rf,
+    const FeatureList &fs, bool layered, const DenseLayout& layout,
+    std::vector<DenseFeatures>& dense);
+bool FillTfFeatures(const FeatureFillPlan& plan,
+    const std::vector<DenseFeatures>& features, bool packed,
+    TensorCache& cache,
+    google::protobuf::Map<std::string, tensorflow::TensorProto>& inputs);
+std::optional<std::vector<double>> GetStatsCtr(const StatsPrior &prior,
+    const FeatureList &features);
+std::optional<std::vector<double>> GetStatsCvr(const StatsPrior &prior,
+    const FeatureList &features);
+void TopByEcpm(const std::vector<double>& ecpm, size_t size,
+    std::vector<int32_t>& order);
+void ExploreScores(const FeatureList& fs, double large_shape,
+    std::vector<double>& score);
+void NewAdBoost(const FeatureList& fs, std::vector<int32_t> order,
+    size_t size_limit, RecAdMap &rec_ad_map);
+
+// 读取server.json中的"layered_extract"配置，须在开始处理请求前调用：
+//   "layered_extract": {"request_features": [...], "ad_features": [...],
+//     "cross_features": [...], "verify_percent": 1}
+// request_features只取决于context和user_profile，ad_features只取决于
+// ad_data和user_ad_feature，cross_features同时取决于两侧，均为ModelFeature
+// 抽取结果中的特征名。未配置时layered_extract实验不生效；本请求的模型用到
+// 交叉或未声明的特征时整个请求改用完整抽取，候选有这类特征时该候选改用
+// 完整抽取，并按verify_percent抽样复算、比对分层结果
+bool InitLayeredExtract(const nlohmann::json& conf);
+
 class AdRec {
  public:
-  AdRec(const ad_model::AdRequest* request) : request_(request) {}
+  AdRec(const ad_model::AdRequest* request)
+    : request_(request),
+      raw_features_(*arena_.Create<FeatureList>()),
+      tensor_cache_(arena_.get()) {}
+  ~AdRec();
   bool Recommend(std::vector<modelx::Model_result>& ads);
 
  private:
+  friend class AdRecBench;  // bench/rec_bench.cc
+
   bool FillScore(
     const std::vector<double> &ctr_vec,
     const std::vector<double> &cvr_vec,
-    std::vector<modelx::Model_result>& ads,
     const modelx::PredictionRequest& ad_request,
     bool is_explore_flow,
-    metis::ReqAds& req_ads,
-    std::map<std::string, metis::RecAdInfo>& rec_ads);
+    bool log_v2,
+    ScoredAds& scored,
+    metis::ReqAds& req_ads);
+  void FillResults(
+    const std::vector<double> &ctr_vec,
+    const std::vector<double> &cvr_vec,
+    const modelx::PredictionRequest& ad_request,
+    bool is_explore_flow,
+    bool log_v2,
+    const ScoredAds& scored,
+    std::vector<modelx::Model_result>& ads,
+    google::protobuf::Arena* log_arena,
+    metis::RecAds& rec_ads_log,
+    RecAdMap& rec_ads);
 
-  void DelExcessCapAd(std::vector<Feature> &fs);
+  std::vector<int32_t> SelectUncappedAds(const AdInfoSnapshot& ad_info,
+      const AdCounterSnapshot& ad_counter);
 
-  std::optional<std::vector<double>> GetModelScore(
+  ScoreFuture GetModelScore(
       const std::string &model_name,
-      const std::string &tf_output);
-  std::optional<std::vector<double>> GetCtr();
-  std::optional<std::vector<double>> GetCvr();
-  using FutureCtr = std::future<std::optional<std::vector<double>>>;
-  using FutureCvr = std::future<std::optional<std::vector<double>>>;
-  std::pair<FutureCtr, FutureCvr> GetCtrCvr();
-  void InitShareStoreData();
+      const std::string &tf_output,
+      Deadline::Clock::time_point until);
+  std::optional<std::vector<double>> MergePredCache(
+      const std::string& model_name,
+      std::optional<std::vector<double>> predicted);
+  using StatsScoreFn = std::optional<std::vector<double>> (*)(
+      const StatsPrior&, const FeatureList&);
+  std::optional<std::vector<double>> WaitScore(
+      const std::string& model_name, ScoreFuture& future,
+      Deadline::Clock::time_point until, StatsScoreFn stats_fn,
+      int fallback_metric);
+  ScoreFuture GetCtr(Deadline::Clock::time_point until);
+  ScoreFuture GetCvr(Deadline::Clock::time_point until);
+  using FutureCtr = ScoreFuture;
+  using FutureCvr = ScoreFuture;
+  std::pair<FutureCtr, FutureCvr> GetCtrCvr(RequestTrace& trace,
+      Deadline::Clock::time_point until);
+  void InitShareStoreData(RequestTrace& trace,
+      Deadline::Clock::time_point until);
+  void PrepareFillPlans();
+  bool LookupPredCache();
+  bool ExpEnabled(const std::string& name) const;
 
   const ad_model::AdRequest* request_;
-  StoreUserCounter store_user_counter_;
-  StoreUserProfile store_user_profile_;
-  std::vector<Feature> raw_features_;
+  // 请求内的protobuf消息均分配在arena_上，须先于它们构造、晚于它们析构
+  RequestArena arena_;
+  UserDataPtr user_data_;  // 可能与并发请求共享，只读
+  uint64_t feature_version_ = 0;  // 本请求所用ad_info和ad_counter的版本
+  std::shared_ptr<const StatsPrior> stats_prior_;  // 与本请求的ad_counter对应
+  RequestFeature request_feature_;  // raw_features_中的Feature以别名共享
+  FeatureList& raw_features_;
   std::vector<std::shared_ptr<FeatureResult>> model_features_;
+  // model_features_的稠密形式，只含dense_layout_中的字段
+  std::vector<DenseFeatures> dense_features_;
+  DenseLayout dense_layout_;  // 由fill_plans_中的计划构建
+  struct ModelFill {
+    std::shared_ptr<const FeatureFillPlan> plan;
+    bool packed = false;
+    // 开启pred_cache时：各素材的缓存key和分数，misses为未命中的素材下标
+    bool use_cache = false;
+    std::vector<uint64_t> cache_keys;
+    std::vector<double> cached;
+    std::vector<int32_t> misses;
+    std::vector<DenseFeatures> missed_features;  // misses对应的稠密特征
+  };
+  std::map<std::string, ModelFill> fill_plans_;
+  TensorCache tensor_cache_;  // 本请求各模型共用的输入tensor
 };
 
 }  // end of namespace
@@ -0,0 +1,65 @@
+#include "rec/request_arena.h"
+
+#include <vector>
+
+#include "metrics/metrics.h"
+
+namespace ad {
+
+// 初始块随Arena一起复用，常规请求不再向堆申请内存
+constexpr size_t kInitialBlockSize = 512 << 10;
+constexpr size_t kMaxPooledPerThread = 4;
+
+struct RequestArena::Pooled {
+  Pooled() : block(new char[kInitialBlockSize]) {
+    google::protobuf::ArenaOptions options;
+    options.initial_block = block.get();
+    options.initial_block_size = kInitialBlockSize;
+    arena.reset(new google::protobuf::Arena(options));
+  }
+
+  std::unique_ptr<char[]> block;
+  std::unique_ptr<google::protobuf::Arena> arena;
+};
+
+static thread_local std::vector<std::unique_ptr<RequestArena::Pooled>>
+  arena_pool;
+static bool arena_enabled = true;
+
+
+void RequestArena::SetEnabled(bool enabled) {
+  arena_enabled = enabled;
+}
+
+
+RequestArena::RequestArena() {
+  if (!arena_enabled) {
+    return;
+  }
+  if (arena_pool.empty()) {
+    pooled_.reset(new Pooled());
+  } else {
+    pooled_ = std::move(arena_pool.back());
+    arena_pool.pop_back();
+  }
+  arena_ = pooled_->arena.get();
+}
+
+
+RequestArena::~RequestArena() {
+  if (arena_ == nullptr) {
+    return;
+  }
+  // 本请求向Arena申请的内存；超出初始块的部分来自堆，会在Reset时归还
+  auto space_allocated = arena_->SpaceAllocated();
+  common::Stats::get()->AddMetric(requestArenaKB, space_allocated >> 10);
+  if (space_allocated > kInitialBlockSize) {
+    common::Stats::get()->Incr(requestArenaOverflow);
+  }
+  arena_->Reset();
+  if (arena_pool.size() < kMaxPooledPerThread) {
+    arena_pool.emplace_back(std::move(pooled_));
+  }
+}
+
+}  // end of namespace
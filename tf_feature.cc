@@ -0,0 +1,347 @@
+#include "rec/tf_feature.h"
+
+#include <algorithm>
+#include <atomic>
+#include <map>
+#include <mutex>
+#include <unordered_map>
+#include <utility>
+
+#include "metrics/metrics.h"
+#include "util/log.h"
+
+namespace ad {
+
+static std::mutex slots_mutex;
+static std::unordered_map<std::string, int> slot_ids[kFieldTypeCount];
+
+
+int FeatureSlots::Register(FieldType type, const std::string& name) {
+  auto index = static_cast<size_t>(type);
+  std::lock_guard<std::mutex> lock(slots_mutex);
+  auto it = slot_ids[index].find(name);
+  if (it != slot_ids[index].end()) {
+    return it->second;
+  }
+  int slot = slot_ids[index].size();
+  slot_ids[index].emplace(name, slot);
+  return slot;
+}
+
+
+void DenseLayout::Add(const FeatureFillPlan& plan) {
+  for (const auto& field : plan.fields()) {
+    auto index = static_cast<size_t>(field.type);
+    auto& added = added_[index];
+    if (added.size() <= static_cast<size_t>(field.slot)) {
+      added.resize(field.slot + 1, false);
+    }
+    if (!added[field.slot]) {
+      added[field.slot] = true;
+      fields_[index].push_back(Field{field.slot, &field.field_name});
+      size_[index] = std::max<size_t>(size_[index], field.slot + 1);
+    }
+  }
+}
+
+
+void BuildDenseFeatures(const DenseLayout& layout,
+    const FeatureResult& result, DenseFeatures& dense) {
+  dense.ints.assign(layout.size(FieldType::kInt), 0);
+  for (const auto& field : layout.fields(FieldType::kInt)) {
+    auto it = result.int_features.find(*field.name);
+    if (it != result.int_features.cend()) {
+      dense.ints[field.slot] = it->second;
+    }
+  }
+  dense.floats.assign(layout.size(FieldType::kFloat), 0.0);
+  for (const auto& field : layout.fields(FieldType::kFloat)) {
+    auto it = result.float_features.find(*field.name);
+    if (it != result.float_features.cend()) {
+      dense.floats[field.slot] = it->second;
+    }
+  }
+  dense.sequences.assign(layout.size(FieldType::kSequence), nullptr);
+  for (const auto& field : layout.fields(FieldType::kSequence)) {
+    auto it = result.sequence_features.find(*field.name);
+    if (it != result.sequence_features.cend()) {
+      dense.sequences[field.slot] = &it->second;
+    }
+  }
+}
+
+/* ========================================================================== */
+
+static_assert(__BYTE_ORDER__ == __ORDER_LITTLE_ENDIAN__,
+  "tensor_content is written in host byte order");
+
+
+FastDivisor::FastDivisor(uint64_t d) : d_(d) {
+  int floor_log2 = 63 - __builtin_clzll(d);
+  shift_ = floor_log2;
+  if ((d & (d - 1)) == 0) {
+    pow2_ = true;
+    return;
+  }
+  // magic = floor(2^(64+floor_log2) / d) + 1，不精确时多取一位并走add路径
+  auto num = static_cast<unsigned __int128>(1) << (64 + floor_log2);
+  auto proposed = static_cast<uint64_t>(num / d);
+  auto rem = static_cast<uint64_t>(num % d);
+  if (d - rem >= (static_cast<uint64_t>(1) << floor_log2)) {
+    proposed += proposed;
+    auto twice_rem = rem + rem;
+    if (twice_rem >= d || twice_rem < rem) {
+      proposed += 1;
+    }
+    add_ = true;
+  }
+  magic_ = proposed + 1;
+}
+
+
+void ModBatch(const int64_t* in, size_t n, const FastDivisor& divisor,
+    int64_t* out) {
+  for (size_t i = 0; i < n; ++i) {
+    // C++取模结果与被除数同号：对绝对值取模后还原符号
+    int64_t l = in[i];
+    uint64_t sign = static_cast<uint64_t>(l >> 63);
+    uint64_t mag = (static_cast<uint64_t>(l) ^ sign) - sign;
+    uint64_t r = (divisor.Mod(mag) ^ sign) - sign;
+    out[i] = (l == 0) ? 0 : static_cast<int64_t>(r) + 1;
+  }
+}
+
+
+// 按编码方式写出int64数据
+inline void WriteInt64(const std::vector<int64_t>& values, bool packed,
+    tensorflow::TensorProto& tensor_proto) {
+  if (packed) {
+    tensor_proto.mutable_tensor_content()->assign(
+      reinterpret_cast<const char*>(values.data()),
+      values.size() * sizeof(int64_t));
+  } else {
+    auto* field = tensor_proto.mutable_int64_val();
+    field->Reserve(values.size());
+    field->Add(values.begin(), values.end());
+  }
+}
+
+
+template <FieldType T>
+void Fill(const FillField& field, const std::vector<DenseFeatures>& creatives,
+    bool packed, tensorflow::TensorProto& tensor_proto);
+
+
+template <>
+void Fill<FieldType::kSequence>(const FillField& field,
+    const std::vector<DenseFeatures>& creatives, bool packed,
+    tensorflow::TensorProto& tensor_proto) {
+  auto field_seq_length = field.seq_length;
+  tensor_proto.set_dtype(tensorflow::DataType::DT_INT64);
+  auto tensor_shape_proto = tensor_proto.mutable_tensor_shape();
+  tensor_shape_proto->add_dim()->set_size(creatives.size());
+  tensor_shape_proto->add_dim()->set_size(field_seq_length);
+
+  // 预先按形状分配，不足部分补0
+  std::vector<int64_t> values(creatives.size() * field_seq_length, 0);
+  auto* row = values.data();
+  for (const auto& creative : creatives) {
+    const auto* seq = creative.sequences[field.slot];
+    if (seq != nullptr) {
+      int64_t count = 0;
+      for (auto it_v = seq->cbegin();
+          it_v != seq->cend() && count < field_seq_length;
+          ++it_v, ++count) {
+        row[count] = *it_v;
+      }
+      // 取模，降低空间size
+      ModBatch(row, count, field.divisor, row);
+    }
+    row += field_seq_length;
+  }
+  WriteInt64(values, packed, tensor_proto);
+}
+
+
+template <>
+void Fill<FieldType::kInt>(const FillField& field,
+    const std::vector<DenseFeatures>& creatives, bool packed,
+    tensorflow::TensorProto& tensor_proto) {
+  tensor_proto.set_dtype(tensorflow::DataType::DT_INT64);
+  auto tensor_shape_proto = tensor_proto.mutable_tensor_shape();
+  tensor_shape_proto->add_dim()->set_size(creatives.size());
+  tensor_shape_proto->add_dim()->set_size(1);
+
+  std::vector<int64_t> values(creatives.size());
+  for (size_t i = 0; i < creatives.size(); ++i) {
+    values[i] = creatives[i].ints[field.slot];
+  }
+  // 取模，缺失值为0，取模后仍为0
+  ModBatch(values.data(), values.size(), field.divisor, values.data());
+  WriteInt64(values, packed, tensor_proto);
+}
+
+
+template <>
+void Fill<FieldType::kFloat>(const FillField& field,
+    const std::vector<DenseFeatures>& creatives, bool packed,
+    tensorflow::TensorProto& tensor_proto) {
+  tensor_proto.set_dtype(tensorflow::DataType::DT_FLOAT);
+  auto tensor_shape_proto = tensor_proto.mutable_tensor_shape();
+  tensor_shape_proto->add_dim()->set_size(creatives.size());
+  tensor_shape_proto->add_dim()->set_size(1);
+
+  std::vector<float> values(creatives.size());
+  for (size_t i = 0; i < creatives.size(); ++i) {
+    values[i] = creatives[i].floats[field.slot];
+  }
+  if (packed) {
+    tensor_proto.mutable_tensor_content()->assign(
+      reinterpret_cast<const char*>(values.data()),
+      values.size() * sizeof(float));
+  } else {
+    auto* float_val = tensor_proto.mutable_float_val();
+    float_val->Reserve(values.size());
+    float_val->Add(values.begin(), values.end());
+  }
+}
+
+/* ========================================================================== */
+
+static std::shared_ptr<const TfModelFn> tf_model_fn =
+  std::make_shared<const TfModelFn>(
+    [] (const std::string& model_name) { return GetTfModel(model_name); });
+
+
+void SetTfModelFn(TfModelFn fn) {
+  std::atomic_store(&tf_model_fn,
+    std::make_shared<const TfModelFn>(std::move(fn)));
+}
+
+
+TfModelPtr FindTfModel(const std::string& model_name) {
+  return (*std::atomic_load(&tf_model_fn))(model_name);
+}
+
+
+struct PlanEntry {
+  TfModelPtr model;
+  std::shared_ptr<const FeatureFillPlan> plan;
+};
+static std::mutex plans_mutex;
+static std::map<std::string, PlanEntry> plans;
+
+
+std::shared_ptr<const FeatureFillPlan> FeatureFillPlan::Get(
+    const std::string& model_name, const TfModelPtr& model) {
+  {
+    std::lock_guard<std::mutex> lock(plans_mutex);
+    auto it = plans.find(model_name);
+    if (it != plans.end() && it->second.model == model) {
+      return it->second.plan;
+    }
+  }
+  // 模型首次使用或已重新加载，编译新计划；并发编译结果相同，后写者覆盖
+  auto plan = Compile(model_name, model->dnn_dict);
+  std::lock_guard<std::mutex> lock(plans_mutex);
+  plans[model_name] = PlanEntry{model, plan};
+  return plan;
+}
+
+
+std::shared_ptr<const FeatureFillPlan> FeatureFillPlan::Compile(
+    const std::string& model_name,
+    const std::map<std::string, DnnFieldItem>& model_dict) {
+  const static std::map<std::string, std::pair<FieldType, FillFunc>> types {
+    {"float", {FieldType::kFloat, Fill<FieldType::kFloat>}},
+    {"int", {FieldType::kInt, Fill<FieldType::kInt>}},
+    {"sequence", {FieldType::kSequence, Fill<FieldType::kSequence>}},
+  };
+  static std::atomic<uint64_t> next_version{1};
+  auto plan = std::make_shared<FeatureFillPlan>();
+  plan->version_ = next_version++;
+  plan->fields_.reserve(model_dict.size());
+  for (const auto& p : model_dict) {
+    const auto& feature_info = p.second;
+    auto it_type = types.find(feature_info.field_type);
+    if (it_type == types.cend()) {
+      common::Stats::get()->Incr(tfFeatureTypeError);
+      LOG_ERROR("invalid feature type: model=" << model_name << " name="
+        << p.first << " type=" << feature_info.field_type);
+      return plan;
+    }
+    FillField field;
+    field.tensor_name = p.first;
+    field.field_name = feature_info.field_name;
+    field.type = it_type->second.first;
+    field.fill = it_type->second.second;
+    field.seq_length = feature_info.field_seq_length;
+    field.max_length = feature_info.field_max_length;
+    if (field.type != FieldType::kFloat && field.max_length <= 1) {
+      common::Stats::get()->Incr(fieldMaxLenError);
+      LOG_ERROR("invalid field_max_length: name=" << feature_info.field_name
+        << " field_max_length=" << field.max_length);
+      field.max_length = 2;
+    }
+    if (field.type != FieldType::kFloat) {
+      field.divisor = FastDivisor(field.max_length - 1);
+    }
+    field.slot = FeatureSlots::Register(field.type, field.field_name);
+    plan->fields_.emplace_back(std::move(field));
+  }
+  plan->valid_ = true;
+  LOG_INFO("feature fill plan compiled: model=" << model_name
+    << " fields=" << plan->fields_.size());
+  return plan;
+}
+
+/* ========================================================================== */
+
+// arena为nullptr时编码结果在堆上，随缓存释放
+TensorCache::~TensorCache() {
+  if (arena_ == nullptr) {
+    for (auto& p : entries_) {
+      delete p.second.tensor;
+    }
+  }
+}
+
+
+void TensorCache::Declare(const FillField& field, bool packed) {
+  std::lock_guard<std::mutex> lock(mutex_);
+  ++entries_[MakeKey(field, packed)].uses;
+}
+
+
+void TensorCache::Fill(const FillField& field,
+    const std::vector<DenseFeatures>& creatives, bool packed,
+    tensorflow::TensorProto& tensor_proto) {
+  std::unique_lock<std::mutex> lock(mutex_);
+  auto it = entries_.find(MakeKey(field, packed));
+  if (it == entries_.end() || it->second.uses < 2) {
+    lock.unlock();
+    field.fill(field, creatives, packed, tensor_proto);
+    return;
+  }
+  auto& entry = it->second;
+  if (entry.tensor != nullptr) {
+    // 已有模型在编码或编码完成；编码方不会再等待其他条目，不会死锁
+    auto ready = entry.ready;
+    lock.unlock();
+    ready.wait();
+    common::Stats::get()->Incr(tensorCacheHit);
+    tensor_proto.CopyFrom(*entry.tensor);
+    return;
+  }
+  std::promise<void> promise;
+  entry.ready = promise.get_future().share();
+  entry.tensor =
+    google::protobuf::Arena::CreateMessage<tensorflow::TensorProto>(arena_);
+  auto* tensor = entry.tensor;
+  lock.unlock();
+  field.fill(field, creatives, packed, *tensor);
+  promise.set_value();
+  tensor_proto.CopyFrom(*tensor);
+}
+
+}  // end of namespace
@@ -0,0 +1,197 @@
+#pragma once
+
+#include <cstdint>
+#include <functional>
+#include <future>
+#include <map>
+#include <memory>
+#include <mutex>
+#include <string>
+#include <tuple>
+#include <vector>
+
+#include <google/protobuf/arena.h>
+
+#include "ads_feature.h"
+#include "prediction_service.pb.h"  // tf-serving
+#include "tf/tf_model.h"
+
+namespace ad {
+
+enum class FieldType : uint8_t {
+  kInt = 0,
+  kFloat,
+  kSequence,
+};
+constexpr size_t kFieldTypeCount = 3;
+
+
+// 特征名 -> 稠密slot，各类型独立编号；同名特征的slot在进程内固定，
+// 进程内所有模型共用
+class FeatureSlots {
+ public:
+  static int Register(FieldType type, const std::string& name);
+};
+
+
+// 一个候选的稠密特征，按slot下标访问；缺失的int/float为0，sequence为空
+struct DenseFeatures {
+  using SequenceValue = decltype(FeatureResult::sequence_features)::mapped_type;
+
+  std::vector<int64_t> ints;
+  std::vector<float> floats;
+  std::vector<const SequenceValue*> sequences;  // 指向FeatureResult，不拷贝
+};
+
+
+class FeatureFillPlan;
+
+// 本请求各模型填充计划所用字段的并集。稠密特征只为这些字段取值，
+// 长度为其中最大的slot + 1，与进程内注册过的特征总数无关
+class DenseLayout {
+ public:
+  // plan须比本对象活得更久
+  void Add(const FeatureFillPlan& plan);
+
+  struct Field {
+    int slot;
+    const std::string* name;  // 指向plan中的field_name
+  };
+  const std::vector<Field>& fields(FieldType type) const {
+    return fields_[static_cast<size_t>(type)];
+  }
+  size_t size(FieldType type) const {
+    return size_[static_cast<size_t>(type)];
+  }
+
+ private:
+  std::vector<Field> fields_[kFieldTypeCount];
+  std::vector<bool> added_[kFieldTypeCount];  // 按slot标记已加入的字段
+  size_t size_[kFieldTypeCount] = {};
+};
+
+void BuildDenseFeatures(const DenseLayout& layout,
+    const FeatureResult& result, DenseFeatures& dense);
+
+
+// 除数固定时用乘法和移位代替硬件除法（libdivide的无符号64位算法）
+class FastDivisor {
+ public:
+  FastDivisor() : FastDivisor(1) {}
+  explicit FastDivisor(uint64_t d);
+
+  uint64_t Div(uint64_t n) const {
+    if (pow2_) {
+      return n >> shift_;
+    }
+    uint64_t q = static_cast<uint64_t>(
+      (static_cast<unsigned __int128>(magic_) * n) >> 64);
+    if (add_) {
+      return (((n - q) >> 1) + q) >> shift_;
+    }
+    return q >> shift_;
+  }
+
+  uint64_t Mod(uint64_t n) const { return n - Div(n) * d_; }
+
+ private:
+  uint64_t d_;
+  uint64_t magic_ = 0;
+  uint8_t shift_ = 0;
+  bool add_ = false;
+  bool pow2_ = false;
+};
+
+
+// 与Mod(l, r)等价：l为0时为0，否则为 l % (r - 1) + 1（r已校正为>=2）
+// divisor为r-1；无分支，便于编译器展开
+void ModBatch(const int64_t* in, size_t n, const FastDivisor& divisor,
+    int64_t* out);
+
+
+struct FillField;
+// packed为true时写入tensor_content（小端紧凑编码），否则写入int64_val/float_val
+using FillFunc = void (*)(const FillField& field,
+    const std::vector<DenseFeatures>& creatives, bool packed,
+    tensorflow::TensorProto& tensor_proto);
+
+struct FillField {
+  std::string tensor_name;
+  std::string field_name;
+  FieldType type;
+  int slot;
+  int64_t max_length;  // 已校正，>= 2
+  int64_t seq_length;
+  FastDivisor divisor;  // max_length - 1
+  FillFunc fill;
+};
+
+
+using TfModelPtr = decltype(GetTfModel(std::string()));
+
+// 按模型名取模型的函数，默认为GetTfModel
+using TfModelFn = std::function<TfModelPtr (const std::string& model_name)>;
+// 替换模型来源（基准测试用合成的模型），须在开始处理请求前调用
+void SetTfModelFn(TfModelFn fn);
+// 经当前的模型来源取模型，取不到时为nullptr
+TfModelPtr FindTfModel(const std::string& model_name);
+
+
+// 模型的特征填充计划：模型加载或重新加载后首次使用时编译一次，
+// 之后每个请求按fields顺序线性填充，不再做字符串查找
+class FeatureFillPlan {
+ public:
+  // model为GetTfModel的返回值；模型对象变化时重新编译
+  static std::shared_ptr<const FeatureFillPlan> Get(
+      const std::string& model_name, const TfModelPtr& model);
+
+  bool valid() const { return valid_; }
+  const std::vector<FillField>& fields() const { return fields_; }
+  // 每次编译递增，模型重新加载后随之变化
+  uint64_t version() const { return version_; }
+
+ private:
+  static std::shared_ptr<const FeatureFillPlan> Compile(
+      const std::string& model_name,
+      const std::map<std::string, DnnFieldItem>& model_dict);
+
+  bool valid_ = false;
+  uint64_t version_ = 0;
+  std::vector<FillField> fields_;
+};
+
+
+// 请求级tensor缓存：同一请求内多个模型声明的相同字段（名字和填充参数都相同）
+// 只编码一次，其他模型直接拷贝编码结果
+class TensorCache {
+ public:
+  explicit TensorCache(google::protobuf::Arena* arena) : arena_(arena) {}
+  ~TensorCache();
+
+  // 登记一次模型对字段的使用，须在Fill之前对本请求的所有模型完成
+  void Declare(const FillField& field, bool packed);
+
+  // 字段被多个模型使用时从缓存取（首个调用者负责编码），否则直接编码
+  void Fill(const FillField& field, const std::vector<DenseFeatures>& creatives,
+      bool packed, tensorflow::TensorProto& tensor_proto);
+
+ private:
+  // (类型, slot, max_length, seq_length, packed)，slot已唯一确定字段名
+  using Key = std::tuple<FieldType, int, int64_t, int64_t, bool>;
+  struct Entry {
+    int uses = 0;
+    tensorflow::TensorProto* tensor = nullptr;
+    std::shared_future<void> ready;
+  };
+
+  static Key MakeKey(const FillField& field, bool packed) {
+    return Key(field.type, field.slot, field.max_length, field.seq_length,
+      packed);
+  }
+
+  google::protobuf::Arena* arena_;
+  std::mutex mutex_;
+  std::map<Key, Entry> entries_;
+};
+
+}  // end of namespace
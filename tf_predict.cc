@@ -0,0 +1,330 @@
+#include "rec/tf_predict.h"
+
+#include "metrics/metrics.h"
+#include "tf/tf.h"
+#include "util/log.h"
+
+namespace ad {
+
+std::optional<std::vector<double>> ParseScores(
+    const tensorflow::serving::PredictResponse& response,
+    const std::string& model_name, const std::string& tf_output,
+    size_t offset, size_t rows, size_t total_rows) {
+  const auto& it_resp = response.outputs().find(tf_output);
+  if (it_resp == response.outputs().end()) {
+    common::Stats::get()->Incr(tfModelOutputError);
+    LOG_ERROR("tf output not found: model=" << model_name
+      << " output=" << tf_output);
+    return std::nullopt;
+  }
+
+  const auto &tensor_proto = it_resp->second;
+  if (tensor_proto.dtype() != tensorflow::DataType::DT_FLOAT) {
+    common::Stats::get()->Incr(tfDataTypeError);
+    LOG_ERROR("tf response data_type is not float: " << tensor_proto.dtype());
+    return std::nullopt;
+  }
+  if (tensor_proto.float_val_size() != total_rows) {
+    common::Stats::get()->Incr(tfTensorSizeError);
+    LOG_ERROR("tf response size invalid: " << tensor_proto.float_val_size() <<
+      " " << total_rows);
+    return std::nullopt;
+  }
+
+  // set score
+  std::vector<double> score_vec(tensor_proto.float_val().begin() + offset,
+    tensor_proto.float_val().begin() + offset + rows);
+  return std::make_optional(std::move(score_vec));
+}
+
+/* ========================================================================== */
+
+ScoreFuture ReadyScore(std::optional<std::vector<double>> score) {
+  std::promise<std::optional<std::vector<double>>> promise;
+  promise.set_value(std::move(score));
+  return promise.get_future();
+}
+
+
+PredictCall::PredictCall()
+  : request(google::protobuf::Arena::CreateMessage<
+      tensorflow::serving::PredictRequest>(&arena)),
+    response(google::protobuf::Arena::CreateMessage<
+      tensorflow::serving::PredictResponse>(&arena)) {
+}
+
+
+TfAsyncClient& TfAsyncClient::Instance() {
+  static TfAsyncClient client;
+  return client;
+}
+
+
+TfAsyncClient::TfAsyncClient()
+  : io_pool_(std::make_shared<ThreadPool>(kDefaultIoThreads)),
+    predict_fn_(std::make_shared<PredictFn>(
+      [] (const tensorflow::serving::PredictRequest& request,
+          tensorflow::serving::PredictResponse& response) {
+        return GetTfClient().Predict(request, response);
+      })) {
+}
+
+
+void TfAsyncClient::Configure(size_t io_threads) {
+  std::lock_guard<std::mutex> lock(mutex_);
+  io_pool_ = std::make_shared<ThreadPool>(io_threads);
+}
+
+
+void TfAsyncClient::SetPredictFn(PredictFn fn) {
+  std::lock_guard<std::mutex> lock(mutex_);
+  predict_fn_ = std::make_shared<const PredictFn>(std::move(fn));
+}
+
+
+void TfAsyncClient::Predict(std::shared_ptr<PredictCall> call,
+    Callback done) {
+  std::shared_ptr<ThreadPool> io_pool;
+  std::shared_ptr<const PredictFn> predict_fn;
+  {
+    std::lock_guard<std::mutex> lock(mutex_);
+    io_pool = io_pool_;
+    predict_fn = predict_fn_;
+  }
+  io_pool->enqueue([call, done, predict_fn] () {
+    done((*predict_fn)(*call->request, *call->response));
+  });
+}
+
+
+ScoreFuture PredictScores(std::shared_ptr<PredictCall> call,
+    const std::string& tf_output, size_t rows) {
+  auto promise =
+    std::make_shared<std::promise<std::optional<std::vector<double>>>>();
+  auto future = promise->get_future();
+  TfAsyncClient::Instance().Predict(call,
+    [call, promise, tf_output, rows] (bool ok) {
+      promise->set_value(ok ? ParseScores(*call->response,
+        call->request->model_spec().name(), tf_output, 0, rows, rows) :
+        std::nullopt);
+    });
+  return future;
+}
+
+/* ========================================================================== */
+
+// src能否沿第0维追加到dst：dtype、编码方式、维数及其余维度须一致
+static bool Appendable(const tensorflow::TensorProto& src,
+    const tensorflow::TensorProto& dst) {
+  const auto& src_shape = src.tensor_shape();
+  const auto& dst_shape = dst.tensor_shape();
+  if (src.dtype() != dst.dtype() ||
+      src_shape.dim_size() == 0 ||
+      src_shape.dim_size() != dst_shape.dim_size() ||
+      src.tensor_content().empty() != dst.tensor_content().empty()) {
+    return false;
+  }
+  for (int i = 1; i < src_shape.dim_size(); ++i) {
+    if (src_shape.dim(i).size() != dst_shape.dim(i).size()) {
+      return false;
+    }
+  }
+  return true;
+}
+
+
+// 将item的所有输入沿第0维追加到batch中；输入不一致时返回false，batch不变
+static bool AppendRequest(const tensorflow::serving::PredictRequest& item,
+    tensorflow::serving::PredictRequest& batch) {
+  if (item.inputs().size() != batch.inputs().size()) {
+    return false;
+  }
+  for (const auto& p : item.inputs()) {
+    auto it = batch.inputs().find(p.first);
+    if (it == batch.inputs().end() || !Appendable(p.second, it->second)) {
+      return false;
+    }
+  }
+  for (const auto& p : item.inputs()) {
+    const auto& src = p.second;
+    auto& dst = (*batch.mutable_inputs())[p.first];
+    auto* dim0 = dst.mutable_tensor_shape()->mutable_dim(0);
+    dim0->set_size(dim0->size() + src.tensor_shape().dim(0).size());
+    dst.mutable_tensor_content()->append(src.tensor_content());
+    dst.mutable_int64_val()->MergeFrom(src.int64_val());
+    dst.mutable_float_val()->MergeFrom(src.float_val());
+  }
+  return true;
+}
+
+
+TfBatcher& TfBatcher::Instance() {
+  static TfBatcher batcher;
+  return batcher;
+}
+
+
+TfBatcher::~TfBatcher() {
+  {
+    std::lock_guard<std::mutex> lock(mutex_);
+    stop_ = true;
+  }
+  cv_.notify_all();
+  if (thread_.joinable()) {
+    thread_.join();
+  }
+}
+
+
+void TfBatcher::Configure(const Options& options) {
+  std::lock_guard<std::mutex> lock(mutex_);
+  options_ = options;
+  if (options_.enable && !thread_.joinable()) {
+    thread_ = std::thread([this] () { Run(); });
+  }
+  enabled_.store(options_.enable && thread_.joinable(),
+    std::memory_order_release);
+}
+
+
+ScoreFuture TfBatcher::Submit(std::shared_ptr<PredictCall> call,
+    bool packed, size_t rows, const std::string& tf_output) {
+  const auto& model_name = call->request->model_spec().name();
+  Pending pending{call, rows, std::chrono::steady_clock::now(), {}};
+  auto future = pending.promise.get_future();
+  {
+    std::lock_guard<std::mutex> lock(mutex_);
+    auto key = model_name + "#" + tf_output + (packed ? "#packed" : "");
+    auto& group = groups_[key];
+    if (group.queue.empty()) {
+      group.model_name = model_name;
+      group.tf_output = tf_output;
+    }
+    group.rows += rows;
+    group.queue.emplace_back(std::move(pending));
+  }
+  cv_.notify_one();
+  return future;
+}
+
+
+void TfBatcher::TakeBatches(Group& group, std::vector<Batch>& batches) {
+  auto now = std::chrono::steady_clock::now();
+  Batch batch;
+  std::vector<Pending> solo;
+  while (!group.queue.empty() &&
+      (batch.items.empty() ||
+       batch.rows + group.queue.front().rows <= options_.max_rows)) {
+    auto& item = group.queue.front();
+    group.rows -= item.rows;
+    common::Stats::get()->AddMetric(tfBatchQueueUs,
+      std::chrono::duration_cast<std::chrono::microseconds>(
+        now - item.enqueue_time).count());
+    if (batch.items.empty()) {
+      batch.call = std::make_shared<PredictCall>();
+      batch.call->request->CopyFrom(*item.call->request);
+    } else if (!AppendRequest(*item.call->request, *batch.call->request)) {
+      // 输入与batch不一致（如模型重新加载前后的请求），单独发出
+      solo.emplace_back(std::move(item));
+      group.queue.pop_front();
+      continue;
+    }
+    batch.rows += item.rows;
+    batch.items.emplace_back(std::move(item));
+    group.queue.pop_front();
+  }
+  if (!batch.items.empty()) {
+    batch.model_name = group.model_name;
+    batch.tf_output = group.tf_output;
+    batches.emplace_back(std::move(batch));
+  }
+  for (auto& item : solo) {
+    Batch one;
+    one.model_name = group.model_name;
+    one.tf_output = group.tf_output;
+    one.call = item.call;
+    one.rows = item.rows;
+    one.items.emplace_back(std::move(item));
+    batches.emplace_back(std::move(one));
+  }
+}
+
+
+void TfBatcher::Run() {
+  std::unique_lock<std::mutex> lock(mutex_);
+  while (!stop_) {
+    auto now = std::chrono::steady_clock::now();
+    auto wake = now + std::chrono::seconds(1);
+    std::vector<Batch> batches;
+    for (auto& p : groups_) {
+      auto& group = p.second;
+      if (group.queue.empty()) {
+        continue;
+      }
+      auto expire = group.queue.front().enqueue_time +
+        std::chrono::microseconds(options_.window_us);
+      if (group.rows >= options_.max_rows || expire <= now) {
+        TakeBatches(group, batches);
+      } else {
+        wake = std::min(wake, expire);
+      }
+    }
+    if (!batches.empty()) {
+      lock.unlock();
+      for (auto& batch : batches) {
+        Dispatch(std::make_shared<Batch>(std::move(batch)));
+      }
+      lock.lock();
+      continue;
+    }
+    cv_.wait_until(lock, wake);
+  }
+}
+
+
+void TfBatcher::Dispatch(std::shared_ptr<Batch> batch) {
+  common::Stats::get()->AddMetric(tfBatchRows, batch->rows);
+  common::Stats::get()->AddMetric(tfBatchRequests, batch->items.size());
+  TfAsyncClient::Instance().Predict(batch->call, [batch] (bool ok) {
+    const auto& response = *batch->call->response;
+    size_t offset = 0;
+    for (auto& item : batch->items) {
+      item.promise.set_value(ok ? ParseScores(response, batch->model_name,
+        batch->tf_output, offset, item.rows, batch->rows) : std::nullopt);
+      offset += item.rows;
+    }
+  });
+}
+
+
+bool InitTfPredict(const nlohmann::json& conf) {
+  auto it_io = conf.find("tf_io_threads");
+  if (it_io != conf.end()) {
+    if (!it_io.value().is_number_unsigned() ||
+        it_io.value().get<size_t>() == 0) {
+      LOG_ERROR("tf_io_threads config invalid");
+      return false;
+    }
+    TfAsyncClient::Instance().Configure(it_io.value().get<size_t>());
+    LOG_INFO("tf io threads=" << it_io.value().get<size_t>());
+  }
+
+  TfBatcher::Options options;
+  auto it = conf.find("tf_batch");
+  if (it != conf.end()) {
+    if (!it.value().is_object()) {
+      LOG_ERROR("tf_batch config invalid");
+      return false;
+    }
+    const auto& batch_conf = it.value();
+    options.enable = batch_conf.value("enable", options.enable);
+    options.window_us = batch_conf.value("window_us", options.window_us);
+    options.max_rows = batch_conf.value("max_rows", options.max_rows);
+  }
+  TfBatcher::Instance().Configure(options);
+  LOG_INFO("tf batcher enable=" << options.enable << " window_us="
+    << options.window_us << " max_rows=" << options.max_rows);
+  return true;
+}
+
+}  // end of namespace
@@ -0,0 +1,146 @@
+#pragma once
+
+#include <atomic>
+#include <chrono>
+#include <condition_variable>
+#include <deque>
+#include <functional>
+#include <future>
+#include <map>
+#include <memory>
+#include <mutex>
+#include <optional>
+#include <string>
+#include <thread>
+#include <vector>
+
+#include <google/protobuf/arena.h>
+#include <nlohmann/json.hpp>
+
+#include "prediction_service.pb.h"  // tf-serving
+#include "util/ThreadPool.h"
+
+namespace ad {
+
+using ScoreFuture = std::future<std::optional<std::vector<double>>>;
+
+// 已就绪的分数
+ScoreFuture ReadyScore(std::optional<std::vector<double>> score);
+
+// 一次Predict调用的请求和应答，分配在自有Arena上；
+// 由调用方和I/O线程共同持有，调用方提前放弃等待也不会悬空
+struct PredictCall {
+  PredictCall();
+
+  google::protobuf::Arena arena;
+  tensorflow::serving::PredictRequest* request;
+  tensorflow::serving::PredictResponse* response;
+};
+
+
+// tf-serving异步调用：阻塞的Predict在专用的I/O线程上执行，
+// 完成后回调；CPU线程池中的任务不再等待网络。
+// 每个I/O线程同一时刻只等待一个Predict，线程数即在途RPC的上限，
+// 超出的调用在I/O线程池中排队；默认值与原先模型线程池的并发一致
+class TfAsyncClient {
+ public:
+  static constexpr size_t kDefaultIoThreads = 50;
+
+  using PredictFn = std::function<bool (
+    const tensorflow::serving::PredictRequest& request,
+    tensorflow::serving::PredictResponse& response)>;
+  using Callback = std::function<void (bool ok)>;
+
+  static TfAsyncClient& Instance();
+
+  void Configure(size_t io_threads);
+  // 替换实际发出调用的函数，默认为GetTfClient().Predict
+  void SetPredictFn(PredictFn fn);
+
+  void Predict(std::shared_ptr<PredictCall> call, Callback done);
+
+ private:
+  TfAsyncClient();
+
+  std::mutex mutex_;
+  std::shared_ptr<ThreadPool> io_pool_;
+  std::shared_ptr<const PredictFn> predict_fn_;
+};
+
+
+// 异步调用并解析tf_output的分数
+ScoreFuture PredictScores(std::shared_ptr<PredictCall> call,
+    const std::string& tf_output, size_t rows);
+
+// 取出应答中tf_output的第[offset, offset+rows)行分数；total_rows为应答应有的行数
+std::optional<std::vector<double>> ParseScores(
+    const tensorflow::serving::PredictResponse& response,
+    const std::string& model_name, const std::string& tf_output,
+    size_t offset, size_t rows, size_t total_rows);
+
+
+// 跨请求合批：并发请求中同一模型的PredictRequest沿batch维拼接，
+// 达到行数上限或等待窗口到期后发出一次Predict，再按行拆分分数
+class TfBatcher {
+ public:
+  struct Options {
+    bool enable = false;
+    int64_t window_us = 1000;  // 首个请求入队后最多等待的时间
+    size_t max_rows = 2048;    // 单个batch的行数上限
+  };
+
+  static TfBatcher& Instance();
+
+  void Configure(const Options& options);
+  bool enabled() const {
+    return enabled_.load(std::memory_order_acquire);
+  }
+
+  // call->request的各输入第0维为rows；返回的future在batch完成后就绪
+  ScoreFuture Submit(std::shared_ptr<PredictCall> call,
+      bool packed, size_t rows, const std::string& tf_output);
+
+ private:
+  struct Pending {
+    std::shared_ptr<PredictCall> call;
+    size_t rows;
+    std::chrono::steady_clock::time_point enqueue_time;
+    std::promise<std::optional<std::vector<double>>> promise;
+  };
+  struct Batch {
+    std::string model_name;
+    std::string tf_output;
+    std::shared_ptr<PredictCall> call;
+    std::vector<Pending> items;
+    size_t rows = 0;
+  };
+  // 同一模型、同一输出且编码方式相同的请求才能合批
+  struct Group {
+    std::string model_name;
+    std::string tf_output;
+    std::deque<Pending> queue;
+    size_t rows = 0;
+  };
+
+  TfBatcher() = default;
+  ~TfBatcher();
+
+  void Run();
+  // 从group取出一批并拼接，须持有mutex_；不能拼接的请求单独成批
+  void TakeBatches(Group& group, std::vector<Batch>& batches);
+  void Dispatch(std::shared_ptr<Batch> batch);
+
+  Options options_;
+  std::atomic<bool> enabled_{false};
+  bool stop_ = false;
+  std::mutex mutex_;
+  std::condition_variable cv_;
+  std::map<std::string, Group> groups_;
+  std::thread thread_;
+};
+
+// 读取server.json中的"tf_io_threads"和"tf_batch"配置，未配置"tf_batch"时不合批
+// "tf_io_threads"限制在途Predict数，默认TfAsyncClient::kDefaultIoThreads
+bool InitTfPredict(const nlohmann::json& conf);
+
+}  // end of namespace
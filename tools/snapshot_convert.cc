@@ -0,0 +1,170 @@
+// 把ad_info.pb / ad_counter.pb转换为mmap快照文件（.snap），或由前后两个
+// ad_counter.pb生成增量文件（.delta）
+// 用法:
+//   snapshot_convert ad_info <input.pb> <output.snap>
+//   snapshot_convert ad_counter <input.pb> <output.snap> [seq]
+//   snapshot_convert ad_counter_delta <old.pb> <new.pb> <output.delta>
+//       <base_seq> <seq>
+// 输出先写到<output>.tmp再rename，可以直接写到线上数据目录
+
+#include <cstdlib>
+#include <iostream>
+#include <string>
+#include <unordered_map>
+#include <vector>
+
+#include "feature/counter_index.h"
+#include "feature/snapshot_file.h"
+#include "store_table.pb.h"
+#include "util/util.h"
+
+namespace ad {
+namespace {
+
+int ConvertAdInfo(const std::string& input, const std::string& output) {
+  StoreAdInfo store;
+  if (!store.ParseFromString(ReadFile(input))) {
+    std::cerr << "parse " << input << " failed" << std::endl;
+    return 1;
+  }
+  std::vector<SnapshotEntry> entries;
+  entries.reserve(store.ad_infos().size());
+  for (const auto& p : store.ad_infos()) {
+    entries.push_back(SnapshotEntry{AdInfoKeyHash(p.first),
+      p.second.SerializeAsString()});
+  }
+  auto written = WriteSnapshot(output, SnapshotKind::kAdInfo, 0, 0, entries);
+  if (written < 0) {
+    return 1;
+  }
+  std::cout << "ad_info: " << store.ad_infos().size() << " keys, "
+    << written << " written" << std::endl;
+  return 0;
+}
+
+
+struct KeyHashHasher {
+  size_t operator()(const KeyHash& key) const { return key.hash; }
+};
+
+// 序列化的CountFeatures和key类型（SnapshotKeyKind）
+struct CounterBlob {
+  std::string bytes;
+  uint8_t key_kind;
+};
+using CounterBlobs = std::unordered_map<KeyHash, CounterBlob, KeyHashHasher>;
+
+
+// 复合key hash -> 序列化的CountFeatures，前缀无法识别的key计入skipped
+bool LoadAdCounter(const std::string& input, CounterBlobs& counters,
+    size_t& skipped) {
+  StoreAdCounter store;
+  if (!store.ParseFromString(ReadFile(input))) {
+    std::cerr << "parse " << input << " failed" << std::endl;
+    return false;
+  }
+  counters.reserve(store.store_ad_counter().size());
+  for (const auto& p : store.store_ad_counter()) {
+    KeyHash hash;
+    CounterKey kind;
+    if (!ParseCounterKey(p.first, &hash, &kind)) {
+      ++skipped;
+      continue;
+    }
+    counters.emplace(hash, CounterBlob{p.second.SerializeAsString(),
+      SnapshotKeyKind(kind)});
+  }
+  return true;
+}
+
+
+int ConvertAdCounter(const std::string& input, const std::string& output,
+    uint64_t seq) {
+  CounterBlobs counters;
+  size_t skipped = 0;
+  if (!LoadAdCounter(input, counters, skipped)) {
+    return 1;
+  }
+  std::vector<SnapshotEntry> entries;
+  entries.reserve(counters.size());
+  for (auto& p : counters) {
+    entries.push_back(SnapshotEntry{p.first, std::move(p.second.bytes), false,
+      p.second.key_kind});
+  }
+  auto written = WriteSnapshot(output, SnapshotKind::kAdCounter, 0, seq,
+    entries);
+  if (written < 0) {
+    return 1;
+  }
+  std::cout << "ad_counter: " << written << " written, " << skipped
+    << " unknown key prefix, seq=" << seq << std::endl;
+  return 0;
+}
+
+
+int DiffAdCounter(const std::string& old_input, const std::string& new_input,
+    const std::string& output, uint64_t base_seq, uint64_t seq) {
+  if (seq <= base_seq) {
+    std::cerr << "seq must be greater than base_seq" << std::endl;
+    return 2;
+  }
+  CounterBlobs old_counters;
+  CounterBlobs new_counters;
+  size_t skipped = 0;
+  if (!LoadAdCounter(old_input, old_counters, skipped) ||
+      !LoadAdCounter(new_input, new_counters, skipped)) {
+    return 1;
+  }
+  // 序列化结果相同视为未变化
+  std::vector<SnapshotEntry> entries;
+  size_t upserted = 0;
+  size_t deleted = 0;
+  for (auto& p : new_counters) {
+    auto it = old_counters.find(p.first);
+    if (it == old_counters.end() || it->second.bytes != p.second.bytes) {
+      entries.push_back(SnapshotEntry{p.first, std::move(p.second.bytes),
+        false, p.second.key_kind});
+      ++upserted;
+    }
+  }
+  for (const auto& p : old_counters) {
+    if (new_counters.count(p.first) == 0) {
+      entries.push_back(SnapshotEntry{p.first, std::string(), true,
+        p.second.key_kind});
+      ++deleted;
+    }
+  }
+  auto written = WriteSnapshot(output, SnapshotKind::kAdCounterDelta, base_seq,
+    seq, entries);
+  if (written < 0) {
+    return 1;
+  }
+  std::cout << "ad_counter delta: " << upserted << " upserted, " << deleted
+    << " deleted, seq " << base_seq << " -> " << seq << std::endl;
+  return 0;
+}
+
+}  // namespace
+}  // end of namespace
+
+
+int main(int argc, char* argv[]) {
+  std::string kind = argc > 1 ? argv[1] : "";
+  if (kind == "ad_info" && argc == 4) {
+    return ad::ConvertAdInfo(argv[2], argv[3]);
+  }
+  if (kind == "ad_counter" && (argc == 4 || argc == 5)) {
+    return ad::ConvertAdCounter(argv[2], argv[3],
+      argc == 5 ? std::strtoull(argv[4], nullptr, 10) : 0);
+  }
+  if (kind == "ad_counter_delta" && argc == 7) {
+    return ad::DiffAdCounter(argv[2], argv[3], argv[4],
+      std::strtoull(argv[5], nullptr, 10), std::strtoull(argv[6], nullptr, 10));
+  }
+  std::cerr << "usage:\n"
+    << "  " << argv[0] << " ad_info <input.pb> <output.snap>\n"
+    << "  " << argv[0] << " ad_counter <input.pb> <output.snap> [seq]\n"
+    << "  " << argv[0] << " ad_counter_delta <old.pb> <new.pb>"
+    << " <output.delta> <base_seq> <seq>" << std::endl;
+  return 2;
+}
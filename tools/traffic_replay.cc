@@ -0,0 +1,416 @@
+// 回放traffic_record录制的请求，在本机压测Recommend：sharestore由录制的
+// 用户数据代替，tf-serving由按给定耗时分布sleep的假Predict代替，
+// metis日志只序列化不发送。ad_info/ad_counter按server.json从本地加载，
+// 应使用录制时的快照文件（格式也须相同，增量按原顺序应用），
+// 内容hash不一致的记录数会在报告中给出
+// 用法:
+//   traffic_replay <server.json> <traffic.rec> [--qps=N | --concurrency=N]
+//       [--threads=64] [--duration=60] [--warmup=5]
+//       [--predict_p50_ms=5] [--predict_p99_ms=20] [--predict_error=0]
+// --qps为开环：按固定速率发出，耗时从计划发出的时刻算起，含排队时间；
+// --concurrency为闭环：N个线程各自串行发请求。都不指定时为--concurrency=1。
+// GetTfModel取不到模型时请求走统计CTR/CVR兜底；"model_backend"中配置为cpu的
+// 模型在进程内计算，不经过假Predict
+
+#include <sys/resource.h>
+
+#include <algorithm>
+#include <atomic>
+#include <chrono>
+#include <cmath>
+#include <condition_variable>
+#include <cstdlib>
+#include <deque>
+#include <iostream>
+#include <map>
+#include <mutex>
+#include <random>
+#include <string>
+#include <thread>
+#include <unordered_map>
+#include <vector>
+
+#include <nlohmann/json.hpp>
+
+#include "feature/feature.h"
+#include "feature/stats_prior.h"
+#include "rec/deadline.h"
+#include "rec/explore.h"
+#include "rec/metis_log.h"
+#include "rec/model_backend.h"
+#include "rec/pred_cache.h"
+#include "rec/rec.h"
+#include "rec/tf_predict.h"
+#include "rec/trace.h"
+#include "rec/traffic_record.h"
+#include "rec/user_cache.h"
+#include "util/util.h"
+
+namespace ad {
+namespace {
+
+using Clock = std::chrono::steady_clock;
+
+struct ReplayOptions {
+  double qps = 0;
+  size_t concurrency = 0;
+  size_t threads = 64;     // 开环时执行请求的线程数
+  double duration_s = 60;
+  double warmup_s = 5;     // 预热期间的请求不计入结果
+  double predict_p50_ms = 5;
+  double predict_p99_ms = 20;
+  double predict_error = 0;  // 假Predict返回失败的比例
+};
+
+
+struct Traffic {
+  std::vector<TrafficRecord> records;
+  std::vector<ad_model::AdRequest> requests;
+  std::unordered_map<std::string, size_t> latest;  // user_id -> 最后一条记录
+};
+Traffic traffic;
+
+// 当前线程正在回放的记录，sharestore桩优先返回其中的用户数据
+thread_local const TrafficRecord* current_record = nullptr;
+
+
+struct Result {
+  LatencyHistogram latency;
+  std::atomic<bool> measuring{false};
+  std::atomic<uint64_t> ok{0};
+  std::atomic<uint64_t> failed{0};
+  std::atomic<uint64_t> dropped{0};  // 开环时积压过多未发出的请求
+};
+Result result;
+
+
+bool LoadTraffic(const std::string& path) {
+  TrafficRecordReader reader;
+  if (!reader.Open(path)) {
+    return false;
+  }
+  TrafficRecord record;
+  while (reader.Next(&record)) {
+    ad_model::AdRequest request;
+    if (!request.ParseFromString(record.request)) {
+      std::cerr << "skip unparsable request #" << traffic.records.size()
+        << std::endl;
+      continue;
+    }
+    traffic.latest[request.request().user_id()] = traffic.records.size();
+    traffic.requests.push_back(std::move(request));
+    traffic.records.push_back(std::move(record));
+  }
+  return !traffic.records.empty();
+}
+
+
+// 录制时的快照与本地加载的内容hash不一致的记录数
+size_t SnapshotMismatch() {
+  auto ad_info = GetStoreAdInfo();
+  auto ad_counter = GetStoreAdCounter();
+  size_t mismatch = 0;
+  for (const auto& record : traffic.records) {
+    if (record.ad_info_hash != ad_info->content_hash ||
+        record.ad_counter_hash != ad_counter->content_hash) {
+      ++mismatch;
+    }
+  }
+  return mismatch;
+}
+
+
+// 对数正态分布，中位数为p50，99分位为p99
+class LatencyModel {
+ public:
+  LatencyModel(double p50_ms, double p99_ms)
+    : mu_(std::log(std::max(p50_ms, 1e-3))),
+      sigma_(p99_ms > p50_ms ? std::log(p99_ms / p50_ms) / 2.3263 : 0) {}
+
+  std::chrono::microseconds Sample(std::mt19937_64& rng) const {
+    std::normal_distribution<double> normal(mu_, sigma_);
+    double ms = sigma_ > 0 ? std::exp(normal(rng)) : std::exp(mu_);
+    return std::chrono::microseconds(static_cast<int64_t>(ms * 1000));
+  }
+
+ private:
+  double mu_;
+  double sigma_;
+};
+
+
+void InstallStubs(const ReplayOptions& options) {
+  UserDataCache::Instance().SetFetchFn(
+    [] (const std::string& user_id, std::string* counter,
+        std::string* profile) {
+      const auto* record = current_record;
+      if (record == nullptr ||
+          traffic.requests[record - traffic.records.data()].request().user_id()
+            != user_id) {
+        auto it = traffic.latest.find(user_id);
+        if (it == traffic.latest.end()) {
+          return true;
+        }
+        record = &traffic.records[it->second];
+      }
+      *counter = record->user_counter;
+      *profile = record->user_profile;
+      return true;
+    });
+
+  LatencyModel latency(options.predict_p50_ms, options.predict_p99_ms);
+  double error = options.predict_error;
+  TfAsyncClient::Instance().SetPredictFn(
+    [latency, error] (const tensorflow::serving::PredictRequest& request,
+        tensorflow::serving::PredictResponse& response) {
+      thread_local std::mt19937_64 rng(std::random_device{}());
+      std::this_thread::sleep_for(latency.Sample(rng));
+      if (std::uniform_real_distribution<double>(0.0, 1.0)(rng) < error) {
+        return false;
+      }
+      int64_t rows = 0;
+      if (!request.inputs().empty()) {
+        rows = request.inputs().begin()->second.tensor_shape().dim(0).size();
+      }
+      auto& output = (*response.mutable_outputs())["predictions"];
+      output.set_dtype(tensorflow::DataType::DT_FLOAT);
+      for (int64_t i = 0; i < rows; ++i) {
+        output.add_float_val(0.001f * (rng() % 100 + 1));
+      }
+      return true;
+    });
+
+  // 与SendRecAds一样序列化，计入CPU开销，但不发往kafka
+  MetisLogger::Instance().SetSendFn(
+    [] (const metis::RecAds& rec_ads, const metis::ReqAds& req_ads) {
+      thread_local std::string buffer;
+      rec_ads.SerializeToString(&buffer);
+      req_ads.SerializeToString(&buffer);
+    });
+}
+
+
+void RunOne(size_t index, Clock::time_point start) {
+  current_record = &traffic.records[index];
+  std::vector<modelx::Model_result> ads;
+  AdRec rec(&traffic.requests[index]);
+  bool ok = rec.Recommend(ads);
+  current_record = nullptr;
+  if (!result.measuring.load(std::memory_order_relaxed)) {
+    return;
+  }
+  result.latency.Record(std::chrono::duration_cast<std::chrono::microseconds>(
+    Clock::now() - start).count());
+  (ok ? result.ok : result.failed).fetch_add(1, std::memory_order_relaxed);
+}
+
+
+// 闭环：每个线程发完一个再发下一个
+std::vector<std::thread> StartClosedLoop(size_t concurrency,
+    std::atomic<bool>& stop) {
+  static std::atomic<size_t> next{0};
+  std::vector<std::thread> threads;
+  for (size_t i = 0; i < concurrency; ++i) {
+    threads.emplace_back([&stop] {
+      while (!stop.load(std::memory_order_relaxed)) {
+        RunOne(next.fetch_add(1) % traffic.records.size(), Clock::now());
+      }
+    });
+  }
+  return threads;
+}
+
+
+// 开环：调度线程按固定间隔把请求放入队列，工作线程取出执行；
+// 积压超过工作线程数的100倍时丢弃新请求，避免内存无限增长
+class OpenLoop {
+ public:
+  OpenLoop(double qps, size_t threads) : qps_(qps), threads_(threads) {}
+
+  std::vector<std::thread> Start(std::atomic<bool>& stop) {
+    std::vector<std::thread> threads;
+    for (size_t i = 0; i < threads_; ++i) {
+      threads.emplace_back([this, &stop] { Work(stop); });
+    }
+    threads.emplace_back([this, &stop] { Dispatch(stop); });
+    return threads;
+  }
+
+ private:
+  struct Task {
+    size_t index;
+    Clock::time_point scheduled;
+  };
+
+  void Dispatch(std::atomic<bool>& stop) {
+    auto begin = Clock::now();
+    auto interval = std::chrono::duration<double>(1.0 / qps_);
+    for (size_t k = 0; !stop.load(std::memory_order_relaxed); ++k) {
+      auto scheduled = begin +
+        std::chrono::duration_cast<Clock::duration>(interval * k);
+      std::this_thread::sleep_until(scheduled);
+      std::lock_guard<std::mutex> lock(mutex_);
+      if (queue_.size() >= threads_ * 100) {
+        if (result.measuring.load(std::memory_order_relaxed)) {
+          result.dropped.fetch_add(1, std::memory_order_relaxed);
+        }
+        continue;
+      }
+      queue_.push_back(Task{k % traffic.records.size(), scheduled});
+      cv_.notify_one();
+    }
+    std::lock_guard<std::mutex> lock(mutex_);
+    cv_.notify_all();
+  }
+
+  void Work(std::atomic<bool>& stop) {
+    while (true) {
+      Task task;
+      {
+        std::unique_lock<std::mutex> lock(mutex_);
+        cv_.wait(lock, [&] {
+          return !queue_.empty() || stop.load(std::memory_order_relaxed);
+        });
+        if (stop.load(std::memory_order_relaxed)) {
+          return;
+        }
+        task = queue_.front();
+        queue_.pop_front();
+      }
+      RunOne(task.index, task.scheduled);
+    }
+  }
+
+  double qps_;
+  size_t threads_;
+  std::mutex mutex_;
+  std::condition_variable cv_;
+  std::deque<Task> queue_;
+};
+
+
+int64_t CpuMicros() {
+  struct rusage usage;
+  getrusage(RUSAGE_SELF, &usage);
+  return (usage.ru_utime.tv_sec + usage.ru_stime.tv_sec) * 1000000LL +
+    usage.ru_utime.tv_usec + usage.ru_stime.tv_usec;
+}
+
+
+bool ParseArgs(int argc, char* argv[], ReplayOptions& options) {
+  std::map<std::string, double*> doubles = {
+    {"--qps", &options.qps},
+    {"--duration", &options.duration_s},
+    {"--warmup", &options.warmup_s},
+    {"--predict_p50_ms", &options.predict_p50_ms},
+    {"--predict_p99_ms", &options.predict_p99_ms},
+    {"--predict_error", &options.predict_error},
+  };
+  std::map<std::string, size_t*> sizes = {
+    {"--concurrency", &options.concurrency},
+    {"--threads", &options.threads},
+  };
+  for (int i = 3; i < argc; ++i) {
+    std::string arg = argv[i];
+    auto eq = arg.find('=');
+    if (eq == std::string::npos) {
+      return false;
+    }
+    auto name = arg.substr(0, eq);
+    auto value = arg.c_str() + eq + 1;
+    if (doubles.count(name) != 0) {
+      *doubles[name] = std::strtod(value, nullptr);
+    } else if (sizes.count(name) != 0) {
+      *sizes[name] = std::strtoull(value, nullptr, 10);
+    } else {
+      return false;
+    }
+  }
+  if (options.qps > 0 && options.concurrency > 0) {
+    return false;
+  }
+  if (options.qps <= 0 && options.concurrency == 0) {
+    options.concurrency = 1;
+  }
+  return options.threads > 0 && options.duration_s > 0;
+}
+
+
+int Replay(const std::string& conf_path, const std::string& traffic_path,
+    const ReplayOptions& options) {
+  auto conf = nlohmann::json::parse(ReadFile(conf_path), nullptr, false);
+  if (conf.is_discarded()) {
+    std::cerr << "parse " << conf_path << " failed" << std::endl;
+    return 1;
+  }
+  // 与录制时的content_hash比较，判断本地数据是否与录制时一致
+  EnableContentHash();
+  if (!InitStatsPrior(conf) || !InitFeature(conf) ||
+      !InitUserDataCache(conf) || !InitTfPredict(conf) ||
+      !InitModelBackend(conf) || !InitPredictionCache(conf) ||
+      !InitDeadline(conf) || !InitTrace(conf) || !InitMetisLogger(conf) ||
+      !InitExplore(conf) || !InitLayeredExtract(conf)) {
+    std::cerr << "init from " << conf_path << " failed" << std::endl;
+    return 1;
+  }
+  if (!LoadTraffic(traffic_path)) {
+    std::cerr << "no records in " << traffic_path << std::endl;
+    return 1;
+  }
+  InstallStubs(options);
+  std::cout << "records: " << traffic.records.size() << ", users: "
+    << traffic.latest.size() << ", snapshot mismatch: " << SnapshotMismatch()
+    << std::endl;
+
+  std::atomic<bool> stop{false};
+  OpenLoop open_loop(options.qps, options.threads);
+  auto threads = options.qps > 0 ? open_loop.Start(stop) :
+    StartClosedLoop(options.concurrency, stop);
+
+  std::this_thread::sleep_for(std::chrono::duration<double>(options.warmup_s));
+  auto cpu_begin = CpuMicros();
+  auto begin = Clock::now();
+  result.measuring = true;
+  std::this_thread::sleep_for(
+    std::chrono::duration<double>(options.duration_s));
+  result.measuring = false;
+  auto seconds = std::chrono::duration<double>(Clock::now() - begin).count();
+  auto cpu_us = CpuMicros() - cpu_begin;
+  stop = true;
+  for (auto& t : threads) {
+    t.join();
+  }
+
+  auto completed = result.ok + result.failed;
+  if (options.qps > 0) {
+    std::cout << "open loop, target qps: " << options.qps << "\n";
+  } else {
+    std::cout << "closed loop, concurrency: " << options.concurrency << "\n";
+  }
+  std::cout << "completed: " << completed << ", failed: " << result.failed
+    << ", dropped: " << result.dropped << "\n"
+    << "qps: " << completed / seconds << "\n"
+    << "latency_us p50: " << result.latency.Percentile(0.5)
+    << ", p99: " << result.latency.Percentile(0.99)
+    << ", p999: " << result.latency.Percentile(0.999) << "\n"
+    << "cpu_us per request: " << (completed > 0 ? cpu_us / completed : 0)
+    << ", cpu cores: " << cpu_us / 1e6 / seconds << std::endl;
+  return 0;
+}
+
+}  // namespace
+}  // end of namespace
+
+
+int main(int argc, char* argv[]) {
+  ad::ReplayOptions options;
+  if (argc < 3 || !ad::ParseArgs(argc, argv, options)) {
+    std::cerr << "usage:\n"
+      << "  " << argv[0] << " <server.json> <traffic.rec>"
+      << " [--qps=N | --concurrency=N] [--threads=N] [--duration=S]"
+      << " [--warmup=S] [--predict_p50_ms=X] [--predict_p99_ms=X]"
+      << " [--predict_error=R]" << std::endl;
+    return 2;
+  }
+  return ad::Replay(argv[1], argv[2], options);
+}
@@ -0,0 +1,291 @@
+#include "rec/trace.h"
+
+#include <algorithm>
+#include <sstream>
+
+#include "util/log.h"
+
+namespace ad {
+
+static const char* stage_names[] = {
+  "mget", "parse", "cap_filter", "feature", "extract", "fill_ctr", "fill_cvr",
+  "predict_ctr", "predict_cvr", "score", "sort", "result", "new_ad_boost",
+  "log", "total",
+};
+static_assert(sizeof(stage_names) / sizeof(stage_names[0]) ==
+  TraceCollector::kTotal + 1, "stage_names size mismatch");
+
+
+static int BucketIndex(int64_t us) {
+  constexpr int sub_count = 1 << LatencyHistogram::kSubBits;
+  if (us < sub_count) {
+    return std::max<int64_t>(us, 0);
+  }
+  int exp = 63 - __builtin_clzll(us);
+  if (exp > LatencyHistogram::kMaxExp) {
+    return LatencyHistogram::kBucketCount - 1;
+  }
+  int sub = (us >> (exp - LatencyHistogram::kSubBits)) & (sub_count - 1);
+  return ((exp - LatencyHistogram::kSubBits + 1) << LatencyHistogram::kSubBits)
+    + sub;
+}
+
+
+// 第index档的下界
+static int64_t BucketLower(int index) {
+  constexpr int sub_count = 1 << LatencyHistogram::kSubBits;
+  if (index < sub_count) {
+    return index;
+  }
+  int exp = (index >> LatencyHistogram::kSubBits) + LatencyHistogram::kSubBits
+    - 1;
+  int64_t sub = index & (sub_count - 1);
+  return (sub_count + sub) << (exp - LatencyHistogram::kSubBits);
+}
+
+
+void LatencyHistogram::Record(int64_t us) {
+  counts_[BucketIndex(us)].fetch_add(1, std::memory_order_relaxed);
+}
+
+
+int64_t LatencyHistogram::Percentile(double q) const {
+  uint64_t counts[kBucketCount];
+  uint64_t total = 0;
+  for (int i = 0; i < kBucketCount; ++i) {
+    counts[i] = counts_[i].load(std::memory_order_relaxed);
+    total += counts[i];
+  }
+  if (total == 0) {
+    return 0;
+  }
+  auto rank = static_cast<uint64_t>(std::clamp(q, 0.0, 1.0) * (total - 1));
+  uint64_t seen = 0;
+  for (int i = 0; i < kBucketCount; ++i) {
+    seen += counts[i];
+    if (seen > rank) {
+      return i + 1 < kBucketCount ? BucketLower(i + 1) - 1 : BucketLower(i);
+    }
+  }
+  return BucketLower(kBucketCount - 1);
+}
+
+
+uint64_t LatencyHistogram::count() const {
+  uint64_t total = 0;
+  for (const auto& c : counts_) {
+    total += c.load(std::memory_order_relaxed);
+  }
+  return total;
+}
+
+
+void LatencyHistogram::Reset() {
+  for (auto& c : counts_) {
+    c.store(0, std::memory_order_relaxed);
+  }
+}
+
+/* ========================================================================== */
+
+RequestTrace::RequestTrace(std::string_view user_id)
+  : start_(Clock::now()),
+    mark_(start_) {
+  if (TraceCollector::Instance().enabled()) {
+    trace_.time_ms = std::chrono::duration_cast<std::chrono::milliseconds>(
+      std::chrono::system_clock::now().time_since_epoch()).count();
+    trace_.user_id = user_id;
+  }
+}
+
+
+RequestTrace::~RequestTrace() {
+  auto& collector = TraceCollector::Instance();
+  if (!collector.enabled()) {
+    return;
+  }
+  trace_.total_us = std::chrono::duration_cast<std::chrono::microseconds>(
+    Clock::now() - start_).count();
+  collector.Record(trace_);
+}
+
+
+void RequestTrace::Mark(TraceStage stage) {
+  auto now = Clock::now();
+  trace_.stage_us[static_cast<int>(stage)] +=
+    std::chrono::duration_cast<std::chrono::microseconds>(now - mark_).count();
+  mark_ = now;
+}
+
+/* ========================================================================== */
+
+TraceCollector& TraceCollector::Instance() {
+  static TraceCollector collector;
+  return collector;
+}
+
+
+void TraceCollector::Configure(const Options& options) {
+  std::lock_guard<std::mutex> lock(mutex_);
+  options_ = options;
+  std::sort(options_.candidate_buckets.begin(),
+    options_.candidate_buckets.end());
+  histograms_.clear();
+  for (size_t i = 0; i <= options_.candidate_buckets.size(); ++i) {
+    histograms_.emplace_back(new Histograms());
+  }
+  slow_.clear();
+  slow_threshold_ = 0;
+  ring_.clear();
+  ring_.reserve(options_.ring_size);
+  ring_next_ = 0;
+  enabled_ = options_.enable;
+}
+
+
+size_t TraceCollector::BucketOf(size_t candidates) const {
+  const auto& bounds = options_.candidate_buckets;
+  return std::lower_bound(bounds.begin(), bounds.end(), candidates) -
+    bounds.begin();
+}
+
+
+void TraceCollector::Record(const SlowTrace& trace) {
+  int64_t minute = trace.time_ms / 60000;
+  auto last = minute_.load(std::memory_order_relaxed);
+  if (minute > last &&
+      minute_.compare_exchange_strong(last, minute)) {
+    Rollover(last);
+  }
+
+  auto& histograms = *histograms_[BucketOf(trace.candidates)];
+  for (int i = 0; i < kTotal; ++i) {
+    if (trace.stage_us[i] > 0) {
+      histograms[i].Record(trace.stage_us[i]);
+    }
+  }
+  histograms[kTotal].Record(trace.total_us);
+
+  // 多数请求不比已记录的慢，无需加锁
+  if (options_.slow_per_minute == 0 ||
+      trace.total_us <= slow_threshold_.load(std::memory_order_relaxed)) {
+    return;
+  }
+  auto cmp = [] (const SlowTrace& a, const SlowTrace& b) {
+    return a.total_us > b.total_us;
+  };
+  std::lock_guard<std::mutex> lock(mutex_);
+  if (slow_.size() == options_.slow_per_minute) {
+    if (trace.total_us <= slow_.front().total_us) {
+      return;
+    }
+    std::pop_heap(slow_.begin(), slow_.end(), cmp);
+    slow_.back() = trace;
+  } else {
+    slow_.push_back(trace);
+  }
+  std::push_heap(slow_.begin(), slow_.end(), cmp);
+  if (slow_.size() == options_.slow_per_minute) {
+    slow_threshold_.store(slow_.front().total_us, std::memory_order_relaxed);
+  }
+}
+
+
+// 由进入新一分钟的第一个请求调用：输出上一分钟各档的分位数，
+// 最慢的请求按耗时从高到低移入环形缓冲区。切换前后并发记录的少量请求
+// 可能计入相邻的一分钟
+void TraceCollector::Rollover(int64_t minute) {
+  for (size_t b = 0; b < histograms_.size(); ++b) {
+    auto& histograms = *histograms_[b];
+    auto count = histograms[kTotal].count();
+    if (count > 0) {
+      std::ostringstream os;
+      for (int i = 0; i < kTotal; ++i) {
+        if (histograms[i].count() > 0) {
+          os << " " << stage_names[i] << "=" << histograms[i].Percentile(0.5)
+            << "/" << histograms[i].Percentile(0.99);
+        }
+      }
+      LOG_INFO("trace minute=" << minute << " candidates<="
+        << (b < options_.candidate_buckets.size() ?
+          std::to_string(options_.candidate_buckets[b]) : "inf")
+        << " count=" << count << " total_us p50="
+        << histograms[kTotal].Percentile(0.5) << " p99="
+        << histograms[kTotal].Percentile(0.99) << " p999="
+        << histograms[kTotal].Percentile(0.999) << " stages_us p50/p99:"
+        << os.str());
+    }
+    for (auto& h : histograms) {
+      h.Reset();
+    }
+  }
+
+  std::lock_guard<std::mutex> lock(mutex_);
+  std::sort(slow_.begin(), slow_.end(),
+    [] (const SlowTrace& a, const SlowTrace& b) {
+      return a.total_us > b.total_us;
+    });
+  for (auto& trace : slow_) {
+    if (options_.ring_size == 0) {
+      break;
+    }
+    if (ring_.size() < options_.ring_size) {
+      ring_.push_back(std::move(trace));
+    } else {
+      ring_[ring_next_] = std::move(trace);
+    }
+    ring_next_ = (ring_next_ + 1) % options_.ring_size;
+  }
+  slow_.clear();
+  slow_threshold_.store(0, std::memory_order_relaxed);
+}
+
+
+int64_t TraceCollector::Percentile(size_t bucket, int stage, double q) const {
+  if (bucket >= histograms_.size() || stage < 0 || stage > kTotal) {
+    return 0;
+  }
+  return (*histograms_[bucket])[stage].Percentile(q);
+}
+
+
+std::vector<SlowTrace> TraceCollector::SlowTraces() const {
+  std::lock_guard<std::mutex> lock(mutex_);
+  std::vector<SlowTrace> traces;
+  traces.reserve(ring_.size());
+  size_t begin = ring_.size() < options_.ring_size ? 0 : ring_next_;
+  for (size_t i = 0; i < ring_.size(); ++i) {
+    traces.push_back(ring_[(begin + i) % ring_.size()]);
+  }
+  return traces;
+}
+
+
+const char* TraceCollector::StageName(int stage) {
+  return stage >= 0 && stage <= kTotal ? stage_names[stage] : "";
+}
+
+
+bool InitTrace(const nlohmann::json& conf) {
+  TraceCollector::Options options;
+  auto it = conf.find("trace");
+  if (it != conf.end()) {
+    const auto& trace_conf = it.value();
+    if (!trace_conf.is_object()) {
+      LOG_ERROR("trace config invalid");
+      return false;
+    }
+    options.enable = trace_conf.value("enable", options.enable);
+    options.candidate_buckets = trace_conf.value("candidate_buckets",
+      options.candidate_buckets);
+    options.slow_per_minute = trace_conf.value("slow_per_minute",
+      options.slow_per_minute);
+    options.ring_size = trace_conf.value("ring_size", options.ring_size);
+  }
+  TraceCollector::Instance().Configure(options);
+  LOG_INFO("trace enable=" << options.enable << " slow_per_minute="
+    << options.slow_per_minute << " ring_size=" << options.ring_size);
+  return true;
+}
+
+}  // end of namespace
@@ -0,0 +1,142 @@
+#pragma once
+
+#include <array>
+#include <atomic>
+#include <chrono>
+#include <cstdint>
+#include <memory>
+#include <mutex>
+#include <string>
+#include <string_view>
+#include <vector>
+
+#include <nlohmann/json.hpp>
+
+namespace ad {
+
+// 请求内细分的阶段，大致按执行顺序
+enum class TraceStage {
+  kMget,        // sharestore拉取（命中用户缓存时为查缓存）
+  kParse,       // 解析user_counter/user_profile
+  kCapFilter,   // 预算和频控过滤
+  kFeature,     // 组装Feature
+  kExtract,     // 查预估缓存和特征抽取
+  kFillCtr,     // CTR模型填充tensor并发出Predict
+  kFillCvr,
+  kPredictCtr,  // 等待CTR模型打分
+  kPredictCvr,
+  kScore,       // 计算ecpm和req_ads
+  kSort,
+  kResult,      // 生成返回结果和RecAdInfo
+  kNewAdBoost,
+  kLog,         // 提交metis日志
+  kCount,
+};
+
+
+// HDR风格的耗时直方图（微秒）：每个2的幂区间再等分为8档，相对误差不超过1/8；
+// 计数为原子变量，可并发记录
+class LatencyHistogram {
+ public:
+  static constexpr int kSubBits = 3;
+  static constexpr int kMaxExp = 26;  // 超过约67秒的计入最后一档
+  static constexpr int kBucketCount = (kMaxExp - kSubBits + 2) << kSubBits;
+
+  void Record(int64_t us);
+  // q取[0, 1]，返回所在档的上界；没有数据时返回0
+  int64_t Percentile(double q) const;
+  uint64_t count() const;
+  void Reset();
+
+ private:
+  std::array<std::atomic<uint64_t>, kBucketCount> counts_{};
+};
+
+
+// 一次慢请求的记录
+struct SlowTrace {
+  int64_t time_ms = 0;  // 请求开始的unix时间
+  std::string user_id;
+  size_t candidates = 0;
+  int64_t total_us = 0;
+  int64_t stage_us[static_cast<int>(TraceStage::kCount)] = {};
+};
+
+
+// 一次请求的阶段耗时，构造时开始计时，析构时提交给TraceCollector
+class RequestTrace {
+ public:
+  using Clock = std::chrono::steady_clock;
+
+  explicit RequestTrace(std::string_view user_id);
+  ~RequestTrace();
+
+  RequestTrace(const RequestTrace&) = delete;
+  RequestTrace& operator=(const RequestTrace&) = delete;
+
+  // 上一次Mark（或构造）到现在的耗时计入stage，同一阶段可多次累加
+  void Mark(TraceStage stage);
+  // 候选素材数，决定计入哪一档直方图
+  void set_candidates(size_t candidates) { trace_.candidates = candidates; }
+
+  const SlowTrace& trace() const { return trace_; }
+
+ private:
+  Clock::time_point start_;
+  Clock::time_point mark_;
+  SlowTrace trace_;
+};
+
+
+// 按候选数分档汇总各阶段和总耗时的直方图，每分钟输出一次分位数并清零；
+// 每分钟最慢的若干个请求写入固定大小的环形缓冲区，旧的被覆盖
+class TraceCollector {
+ public:
+  struct Options {
+    bool enable = false;
+    std::vector<size_t> candidate_buckets{50, 100, 200, 500, 1000};  // 各档上界
+    size_t slow_per_minute = 10;
+    size_t ring_size = 600;
+  };
+  static constexpr int kTotal = static_cast<int>(TraceStage::kCount);
+
+  static TraceCollector& Instance();
+
+  // 须在开始处理请求前调用
+  void Configure(const Options& options);
+  bool enabled() const { return enabled_; }
+
+  void Record(const SlowTrace& trace);
+
+  // 当前分钟内第bucket档、stage阶段（kTotal为总耗时）的分位数
+  int64_t Percentile(size_t bucket, int stage, double q) const;
+  // 环形缓冲区中的慢请求，旧的在前
+  std::vector<SlowTrace> SlowTraces() const;
+
+  static const char* StageName(int stage);
+
+ private:
+  using Histograms = std::array<LatencyHistogram, kTotal + 1>;
+
+  TraceCollector() = default;
+
+  size_t BucketOf(size_t candidates) const;
+  void Rollover(int64_t minute);
+
+  bool enabled_ = false;
+  Options options_;
+  // candidate_buckets.size() + 1档，最后一档不设上界
+  std::vector<std::unique_ptr<Histograms>> histograms_;
+  std::atomic<int64_t> minute_{0};
+
+  mutable std::mutex mutex_;
+  std::vector<SlowTrace> slow_;  // 当前分钟的最慢请求，按total_us的小顶堆
+  std::atomic<int64_t> slow_threshold_{0};  // slow_已满时堆顶的耗时
+  std::vector<SlowTrace> ring_;
+  size_t ring_next_ = 0;
+};
+
+// 读取server.json中的"trace"配置，未配置时不汇总
+bool InitTrace(const nlohmann::json& conf);
+
+}  // end of namespace
@@ -0,0 +1,302 @@
+#include "rec/traffic_record.h"
+
+#include <chrono>
+#include <cstring>
+#include <memory>
+#include <random>
+
+#include "metrics/metrics.h"
+#include "util/log.h"
+
+namespace ad {
+
+static const char kFileMagic[4] = {'A', 'D', 'T', 'R'};
+static const uint32_t kFileVersion = 1;
+// 单条记录的长度上限，超过视为文件损坏
+static const uint32_t kMaxRecordBytes = 256 << 20;
+
+
+template <typename T>
+static void PutFixed(std::string& out, T value) {
+  out.append(reinterpret_cast<const char*>(&value), sizeof(value));
+}
+
+
+static void PutString(std::string& out, const std::string& value) {
+  PutFixed<uint32_t>(out, value.size());
+  out.append(value);
+}
+
+
+template <typename T>
+static bool GetFixed(const char*& p, const char* end, T* value) {
+  if (end - p < static_cast<ptrdiff_t>(sizeof(T))) {
+    return false;
+  }
+  memcpy(value, p, sizeof(T));
+  p += sizeof(T);
+  return true;
+}
+
+
+static bool GetString(const char*& p, const char* end, std::string* value) {
+  uint32_t size = 0;
+  if (!GetFixed(p, end, &size) || end - p < static_cast<ptrdiff_t>(size)) {
+    return false;
+  }
+  value->assign(p, size);
+  p += size;
+  return true;
+}
+
+
+TrafficRecordWriter::~TrafficRecordWriter() {
+  Close();
+}
+
+
+bool TrafficRecordWriter::Open(const std::string& path) {
+  Close();
+  file_ = fopen(path.c_str(), "wb");
+  if (file_ == nullptr) {
+    LOG_ERROR("open traffic record file failed: " << path);
+    return false;
+  }
+  std::string header(kFileMagic, sizeof(kFileMagic));
+  PutFixed(header, kFileVersion);
+  if (fwrite(header.data(), 1, header.size(), file_) != header.size()) {
+    LOG_ERROR("write traffic record header failed: " << path);
+    Close();
+    return false;
+  }
+  bytes_ = header.size();
+  return true;
+}
+
+
+bool TrafficRecordWriter::Write(const TrafficRecord& record) {
+  if (file_ == nullptr) {
+    return false;
+  }
+  std::string body;
+  body.reserve(64 + record.request.size() + record.user_counter.size() +
+    record.user_profile.size());
+  PutFixed(body, record.time_ms);
+  PutFixed(body, record.ad_info_hash);
+  PutFixed(body, record.ad_counter_hash);
+  PutFixed(body, record.ad_counter_seq);
+  PutString(body, record.request);
+  PutString(body, record.user_counter);
+  PutString(body, record.user_profile);
+
+  std::string size;
+  PutFixed<uint32_t>(size, body.size());
+  // 每条都刷到文件，进程退出时最多丢失正在写的一条
+  if (fwrite(size.data(), 1, size.size(), file_) != size.size() ||
+      fwrite(body.data(), 1, body.size(), file_) != body.size() ||
+      fflush(file_) != 0) {
+    return false;
+  }
+  bytes_ += size.size() + body.size();
+  return true;
+}
+
+
+void TrafficRecordWriter::Close() {
+  if (file_ != nullptr) {
+    fclose(file_);
+    file_ = nullptr;
+  }
+}
+
+/* ========================================================================== */
+
+TrafficRecordReader::~TrafficRecordReader() {
+  if (file_ != nullptr) {
+    fclose(file_);
+  }
+}
+
+
+bool TrafficRecordReader::Open(const std::string& path) {
+  file_ = fopen(path.c_str(), "rb");
+  if (file_ == nullptr) {
+    LOG_ERROR("open traffic record file failed: " << path);
+    return false;
+  }
+  char magic[sizeof(kFileMagic)];
+  uint32_t version = 0;
+  if (fread(magic, 1, sizeof(magic), file_) != sizeof(magic) ||
+      memcmp(magic, kFileMagic, sizeof(magic)) != 0 ||
+      fread(&version, 1, sizeof(version), file_) != sizeof(version) ||
+      version != kFileVersion) {
+    LOG_ERROR("invalid traffic record file: " << path);
+    return false;
+  }
+  return true;
+}
+
+
+bool TrafficRecordReader::Next(TrafficRecord* record) {
+  uint32_t size = 0;
+  if (file_ == nullptr ||
+      fread(&size, 1, sizeof(size), file_) != sizeof(size) ||
+      size > kMaxRecordBytes) {
+    return false;
+  }
+  buffer_.resize(size);
+  if (fread(&buffer_[0], 1, size, file_) != size) {
+    return false;
+  }
+  const char* p = buffer_.data();
+  const char* end = p + size;
+  return GetFixed(p, end, &record->time_ms) &&
+    GetFixed(p, end, &record->ad_info_hash) &&
+    GetFixed(p, end, &record->ad_counter_hash) &&
+    GetFixed(p, end, &record->ad_counter_seq) &&
+    GetString(p, end, &record->request) &&
+    GetString(p, end, &record->user_counter) &&
+    GetString(p, end, &record->user_profile);
+}
+
+/* ========================================================================== */
+
+TrafficRecorder& TrafficRecorder::Instance() {
+  static TrafficRecorder recorder;
+  return recorder;
+}
+
+
+TrafficRecorder::~TrafficRecorder() {
+  Stop();
+}
+
+
+bool TrafficRecorder::Configure(const Options& options) {
+  Stop();
+  writer_.Close();
+  options_ = options;
+  if (!options_.enable) {
+    return true;
+  }
+  if (!writer_.Open(options_.path)) {
+    return false;
+  }
+  queue_.reset(new BoundedQueue<TrafficRecordPtr>(options_.queue_size));
+  stop_ = false;
+  thread_ = std::thread(&TrafficRecorder::Run, this);
+  enabled_ = true;
+  return true;
+}
+
+
+void TrafficRecorder::Stop() {
+  enabled_ = false;
+  stop_ = true;
+  if (thread_.joinable()) {
+    thread_.join();
+  }
+  queue_.reset();
+}
+
+
+bool TrafficRecorder::Sample() const {
+  if (!enabled_.load(std::memory_order_relaxed)) {
+    return false;
+  }
+  thread_local std::minstd_rand rng(std::random_device{}());
+  return std::uniform_real_distribution<double>(0.0, 1.0)(rng) <
+    options_.sample_rate;
+}
+
+
+// 用户数据按解析后的内容重新序列化：未命中时与sharestore返回的一致，
+// 命中用户缓存时为缓存中的版本
+void TrafficRecorder::Record(const ad_model::AdRequest& request,
+    const UserData& user_data, const AdInfoSnapshot& ad_info,
+    const AdCounterSnapshot& ad_counter) {
+  auto record = std::make_unique<TrafficRecord>();
+  record->time_ms = std::chrono::duration_cast<std::chrono::milliseconds>(
+    std::chrono::system_clock::now().time_since_epoch()).count();
+  record->request = request.SerializeAsString();
+  record->user_counter = !user_data.counter_blob.empty() ?
+    user_data.counter_blob : user_data.counter->SerializeAsString();
+  record->user_profile = user_data.profile->SerializeAsString();
+  record->ad_info_hash = ad_info.content_hash;
+  record->ad_counter_hash = ad_counter.content_hash;
+  record->ad_counter_seq = ad_counter.seq;
+
+  if (!enabled_.load(std::memory_order_relaxed)) {
+    return;
+  }
+  if (!queue_->TryPush(record)) {
+    common::Stats::get()->Incr(trafficRecordDrop);
+  }
+}
+
+
+// 文件写满或写失败后停止录制，队列中剩余的记录丢弃
+void TrafficRecorder::Run() {
+  TrafficRecordPtr record;
+  bool writing = true;
+  for (;;) {
+    if (!queue_->TryPop(record)) {
+      if (stop_) {
+        return;
+      }
+      std::this_thread::sleep_for(std::chrono::milliseconds(10));
+      continue;
+    }
+    if (!writing) {
+      continue;
+    }
+    if (!writer_.Write(*record)) {
+      common::Stats::get()->Incr(trafficRecordError);
+      LOG_ERROR("write traffic record failed: " << options_.path);
+      enabled_ = false;
+      writing = false;
+      writer_.Close();
+      continue;
+    }
+    common::Stats::get()->Incr(trafficRecordCount);
+    if (writer_.bytes() >= (options_.max_mb << 20)) {
+      LOG_INFO("traffic record reached max_mb=" << options_.max_mb
+        << ", stopped");
+      enabled_ = false;
+      writing = false;
+      writer_.Close();
+    }
+  }
+}
+
+
+bool InitTrafficRecorder(const nlohmann::json& conf) {
+  TrafficRecorder::Options options;
+  auto it = conf.find("traffic_record");
+  if (it != conf.end()) {
+    const auto& record_conf = it.value();
+    if (!record_conf.is_object()) {
+      LOG_ERROR("traffic_record config invalid");
+      return false;
+    }
+    options.enable = record_conf.value("enable", options.enable);
+    options.sample_rate = record_conf.value("sample_rate",
+      options.sample_rate);
+    options.path = record_conf.value("path", options.path);
+    options.max_mb = record_conf.value("max_mb", options.max_mb);
+    options.queue_size = record_conf.value("queue_size", options.queue_size);
+    if (options.enable && options.path.empty()) {
+      LOG_ERROR("traffic_record path not set");
+      return false;
+    }
+  }
+  if (!TrafficRecorder::Instance().Configure(options)) {
+    return false;
+  }
+  LOG_INFO("traffic_record enable=" << options.enable << " sample_rate="
+    << options.sample_rate << " path=" << options.path << " max_mb="
+    << options.max_mb << " queue_size=" << options.queue_size);
+  return true;
+}
+
+}  // end of namespace
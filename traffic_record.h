@@ -0,0 +1,106 @@
+#pragma once
+
+#include <atomic>
+#include <cstdint>
+#include <cstdio>
+#include <memory>
+#include <string>
+#include <thread>
+
+#include <nlohmann/json.hpp>
+
+#include "ad_model_service.pb.h"
+#include "feature/feature.h"
+#include "rec/bounded_queue.h"
+#include "rec/user_cache.h"
+
+namespace ad {
+
+// 录制的一次请求：请求本身、当时用到的sharestore数据和快照的版本
+struct TrafficRecord {
+  int64_t time_ms = 0;
+  std::string request;       // 序列化的AdRequest
+  std::string user_counter;  // 序列化的StoreUserCounter，空串表示不存在
+  std::string user_profile;  // 序列化的StoreUserProfile
+  // 录制时ad_info/ad_counter的content_hash，回放时据此判断本地数据是否一致
+  uint64_t ad_info_hash = 0;
+  uint64_t ad_counter_hash = 0;
+  uint64_t ad_counter_seq = 0;
+};
+using TrafficRecordPtr = std::unique_ptr<TrafficRecord>;
+
+
+// 录制文件：文件头后依次为各条记录，每条以4字节长度开头；整数按本机字节序。
+// 写入中断时末尾不完整的记录在读取时忽略
+class TrafficRecordWriter {
+ public:
+  ~TrafficRecordWriter();
+
+  bool Open(const std::string& path);
+  bool Write(const TrafficRecord& record);
+  void Close();
+  size_t bytes() const { return bytes_; }
+
+ private:
+  FILE* file_ = nullptr;
+  size_t bytes_ = 0;
+};
+
+
+class TrafficRecordReader {
+ public:
+  ~TrafficRecordReader();
+
+  bool Open(const std::string& path);
+  // 读完或遇到不完整的记录时返回false
+  bool Next(TrafficRecord* record);
+
+ private:
+  FILE* file_ = nullptr;
+  std::string buffer_;
+};
+
+
+// 线上按比例抽样录制请求，供tools/traffic_replay回放；
+// 请求线程只序列化并放入定长无锁队列，后台线程写文件，队列满时丢弃；
+// 文件达到max_mb后停止录制
+class TrafficRecorder {
+ public:
+  struct Options {
+    bool enable = false;
+    double sample_rate = 0.001;
+    std::string path;
+    size_t max_mb = 1024;
+    size_t queue_size = 256;  // 每条记录含完整的请求和用户数据
+  };
+
+  static TrafficRecorder& Instance();
+  ~TrafficRecorder();
+
+  // 须在开始处理请求前调用
+  bool Configure(const Options& options);
+  // 未开启时只读一个原子变量
+  bool Sample() const;
+
+  void Record(const ad_model::AdRequest& request, const UserData& user_data,
+      const AdInfoSnapshot& ad_info, const AdCounterSnapshot& ad_counter);
+
+ private:
+  TrafficRecorder() = default;
+
+  void Run();
+  // 停止并等待后台线程写完队列中剩余的记录
+  void Stop();
+
+  Options options_;
+  std::atomic<bool> enabled_{false};
+  std::unique_ptr<BoundedQueue<TrafficRecordPtr>> queue_;
+  std::thread thread_;
+  std::atomic<bool> stop_{false};
+  TrafficRecordWriter writer_;  // 只在后台线程和Configure中使用
+};
+
+// 读取server.json中的"traffic_record"配置，未配置时不录制
+bool InitTrafficRecorder(const nlohmann::json& conf);
+
+}  // end of namespace
@@ -0,0 +1,238 @@
+#include "rec/user_cache.h"
+
+#include <algorithm>
+#include <utility>
+
+#include "metrics/metrics.h"
+#include "sharestore/sharestore.h"
+#include "util/log.h"
+
+namespace ad {
+
+UserData::UserData()
+  : counter(google::protobuf::Arena::CreateMessage<StoreUserCounter>(&arena)),
+    profile(google::protobuf::Arena::CreateMessage<StoreUserProfile>(&arena)) {
+}
+
+
+UserDataCache& UserDataCache::Instance() {
+  static UserDataCache cache;
+  return cache;
+}
+
+
+UserDataCache::UserDataCache()
+  : fetch_fn_(std::make_shared<FetchFn>(
+      [] (const std::string& user_id, std::string* counter,
+          std::string* profile) {
+        std::vector<std::string> keys;
+        keys.push_back("nt:ads:user_counter:" + user_id);
+        keys.push_back("nt:ads:user_profile:" + user_id);
+        std::vector<std::pair<std::string, std::string>> results;
+        common::Timer timer(sharestoreMgetMs);
+        if (!GetShareStore()->multiGetValue(GetSegment(), keys, &results)
+              || results.size() < 2) {
+          LOG_ERROR("sharestore mget failed, or size=" << results.size());
+          return false;
+        }
+        *counter = std::move(results[0].second);
+        *profile = std::move(results[1].second);
+        return true;
+      })) {
+}
+
+
+// 须在开始处理请求前调用
+void UserDataCache::Configure(const Options& options) {
+  std::lock_guard<std::mutex> lock(config_mutex_);
+  options_ = options;
+  options_.shards = std::max<size_t>(options_.shards, 1);
+  shards_.clear();
+  if (options_.enable) {
+    for (size_t i = 0; i < options_.shards; ++i) {
+      shards_.emplace_back(new Shard());
+    }
+  }
+  total_bytes_ = 0;
+}
+
+
+void UserDataCache::SetFetchFn(FetchFn fn) {
+  std::lock_guard<std::mutex> lock(config_mutex_);
+  fetch_fn_ = std::make_shared<const FetchFn>(std::move(fn));
+}
+
+
+UserDataPtr UserDataCache::Load(const std::string& user_id,
+    RequestTrace* trace) {
+  std::shared_ptr<const FetchFn> fetch_fn;
+  {
+    std::lock_guard<std::mutex> lock(config_mutex_);
+    fetch_fn = fetch_fn_;
+  }
+  auto data = std::make_shared<UserData>();
+  std::string counter;
+  std::string profile;
+  if (!(*fetch_fn)(user_id, &counter, &profile)) {
+    common::Stats::get()->Incr(sharestoreMgetError);
+    return nullptr;
+  }
+  if (trace != nullptr) {
+    trace->Mark(TraceStage::kMget);
+  }
+  static const int counter_field = StoreUserCounter::descriptor()->
+    FindFieldByName("store_user_counter")->number();
+  data->counter_blob = std::move(counter);
+  if (!data->counter_index.BuildFromWire(data->counter_blob, counter_field)) {
+    // 交给protobuf解析，仍失败时与原先一样按空counter处理
+    common::Stats::get()->Incr(counterLazyIndexError);
+    if (!data->counter->ParseFromString(data->counter_blob)) {
+      common::Stats::get()->Incr(counterParseError);
+      LOG_ERROR("parse sharestore counter failed");
+    }
+    data->counter_blob.clear();
+    data->counter_index.Build(data->counter->store_user_counter());
+  }
+  if (!profile.empty() && !data->profile->ParseFromString(profile)) {
+    common::Stats::get()->Incr(userProfileParseError);
+    LOG_ERROR("parse sharestore user_profile failed");
+  }
+  if (trace != nullptr) {
+    trace->Mark(TraceStage::kParse);
+  }
+  return data;
+}
+
+
+UserDataPtr UserDataCache::Get(const std::string& user_id,
+    RequestTrace* trace, std::chrono::steady_clock::time_point until) {
+  static const UserDataPtr empty = std::make_shared<UserData>();
+  if (shards_.empty()) {
+    auto data = Load(user_id, trace);
+    return data != nullptr ? data : empty;
+  }
+
+  auto& shard = *shards_[std::hash<std::string>()(user_id) % shards_.size()];
+  // 登记inflight后，任何退出路径（包括Load抛出异常）都撤销登记并唤醒
+  // 合并等待的请求；未正常完成时等待方得到nullptr，按拉取失败处理
+  struct InflightGuard {
+    UserDataCache* cache;
+    Shard& shard;
+    const std::string& user_id;
+    std::promise<UserDataPtr> promise;
+    bool registered = false;
+
+    void Finish(const UserDataPtr& data) {
+      {
+        std::lock_guard<std::mutex> lock(shard.mutex);
+        shard.inflight.erase(user_id);
+        if (data != nullptr) {
+          cache->Insert(shard, user_id, data);
+        }
+      }
+      registered = false;
+      promise.set_value(data);
+    }
+    ~InflightGuard() {
+      if (registered) {
+        std::lock_guard<std::mutex> lock(shard.mutex);
+        shard.inflight.erase(user_id);
+        promise.set_value(nullptr);
+      }
+    }
+  } guard{this, shard, user_id};
+  {
+    std::unique_lock<std::mutex> lock(shard.mutex);
+    auto it = shard.entries.find(user_id);
+    if (it != shard.entries.end()) {
+      if (it->second.expire > std::chrono::steady_clock::now()) {
+        shard.lru.splice(shard.lru.begin(), shard.lru, it->second.lru);
+        common::Stats::get()->Incr(userCacheHit);
+        return it->second.data;
+      }
+      Erase(shard, it);
+    }
+    auto it_inflight = shard.inflight.find(user_id);
+    if (it_inflight != shard.inflight.end()) {
+      auto future = it_inflight->second;
+      lock.unlock();
+      common::Stats::get()->Incr(userCacheCoalesced);
+      if (until != std::chrono::steady_clock::time_point::max() &&
+          future.wait_until(until) != std::future_status::ready) {
+        common::Stats::get()->Incr(userCacheWaitTimeout);
+        return empty;
+      }
+      auto data = future.get();
+      return data != nullptr ? data : empty;
+    }
+    shard.inflight.emplace(user_id, guard.promise.get_future().share());
+    guard.registered = true;
+  }
+
+  common::Stats::get()->Incr(userCacheMiss);
+  auto data = Load(user_id, trace);
+  guard.Finish(data);
+  common::Stats::get()->AddMetric(userCacheBytes, total_bytes_.load());
+  return data != nullptr ? data : empty;
+}
+
+
+// 须持有shard.mutex
+void UserDataCache::Insert(Shard& shard, const std::string& user_id,
+    UserDataPtr data) {
+  auto it = shard.entries.find(user_id);
+  if (it != shard.entries.end()) {
+    Erase(shard, it);
+  }
+  size_t bytes = data->arena.SpaceAllocated() +
+    data->counter_blob.capacity() + data->counter_index.bytes() +
+    sizeof(Entry) + user_id.size() * 2;
+  shard.lru.push_front(user_id);
+  shard.entries.emplace(user_id, Entry{std::move(data), bytes,
+    std::chrono::steady_clock::now() +
+      std::chrono::milliseconds(options_.ttl_ms),
+    shard.lru.begin()});
+  shard.bytes += bytes;
+  total_bytes_ += bytes;
+
+  // 按LRU淘汰到分片的内存上限以内，最近插入的一项总是保留
+  size_t budget = options_.max_bytes / shards_.size();
+  while (shard.bytes > budget && shard.lru.size() > 1) {
+    Erase(shard, shard.entries.find(shard.lru.back()));
+    common::Stats::get()->Incr(userCacheEvict);
+  }
+}
+
+
+// 须持有shard.mutex
+void UserDataCache::Erase(Shard& shard,
+    std::unordered_map<std::string, Entry>::iterator it) {
+  shard.bytes -= it->second.bytes;
+  total_bytes_ -= it->second.bytes;
+  shard.lru.erase(it->second.lru);
+  shard.entries.erase(it);
+}
+
+
+bool InitUserDataCache(const nlohmann::json& conf) {
+  UserDataCache::Options options;
+  auto it = conf.find("user_cache");
+  if (it != conf.end()) {
+    const auto& cache_conf = it.value();
+    if (!cache_conf.is_object()) {
+      LOG_ERROR("user_cache config invalid");
+      return false;
+    }
+    options.enable = cache_conf.value("enable", options.enable);
+    options.ttl_ms = cache_conf.value("ttl_ms", options.ttl_ms);
+    options.max_bytes =
+      cache_conf.value("max_mb", options.max_bytes >> 20) << 20;
+    options.shards = cache_conf.value("shards", options.shards);
+  }
+  UserDataCache::Instance().Configure(options);
+  LOG_INFO("user_cache enable=" << options.enable << " ttl_ms="
+    << options.ttl_ms << " max_bytes=" << options.max_bytes);
+  return true;
+}
+
+}  // end of namespace
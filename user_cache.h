@@ -0,0 +1,98 @@
+#pragma once
+
+#include <atomic>
+#include <chrono>
+#include <functional>
+#include <future>
+#include <list>
+#include <memory>
+#include <mutex>
+#include <string>
+#include <unordered_map>
+#include <vector>
+
+#include <google/protobuf/arena.h>
+#include <nlohmann/json.hpp>
+
+#include "feature/counter_index.h"
+#include "rec/trace.h"
+#include "store_table.pb.h"
+
+namespace ad {
+
+// 解析后的用户数据，消息分配在自身的arena上；缓存中的实例被多个请求共享，只读。
+// user_counter一般不整体解析：counter_index直接指向counter_blob中各entry的
+// value字节，查到时才解码；blob格式异常时才解析到counter
+struct UserData {
+  UserData();
+
+  google::protobuf::Arena arena;
+  std::string counter_blob;
+  StoreUserCounter* counter;
+  StoreUserProfile* profile;
+  CounterIndex counter_index;  // 指向counter_blob或counter
+};
+using UserDataPtr = std::shared_ptr<const UserData>;
+
+
+// sharestore前的进程内用户数据缓存：按user_id分片，TTL过期，按内存LRU淘汰；
+// 同一用户并发未命中时只拉取、解析一次
+class UserDataCache {
+ public:
+  struct Options {
+    bool enable = false;
+    int64_t ttl_ms = 3000;
+    size_t max_bytes = 256 << 20;
+    size_t shards = 64;
+  };
+  // 拉取user_counter和user_profile的序列化数据，空串表示不存在
+  using FetchFn = std::function<bool (const std::string& user_id,
+      std::string* counter, std::string* profile)>;
+
+  static UserDataCache& Instance();
+
+  void Configure(const Options& options);
+  // 替换数据来源，默认为sharestore multiGetValue
+  void SetFetchFn(FetchFn fn);
+
+  // 始终返回非空；拉取失败时返回空数据且不缓存。
+  // 本请求需要拉取时，拉取和解析的耗时记入trace。
+  // 等待其他请求的同一拉取时最多等到until，超时返回空数据；
+  // 本请求自己发出的拉取受sharestore客户端自身的超时限制
+  UserDataPtr Get(const std::string& user_id, RequestTrace* trace = nullptr,
+      std::chrono::steady_clock::time_point until =
+        std::chrono::steady_clock::time_point::max());
+
+ private:
+  struct Entry {
+    UserDataPtr data;
+    size_t bytes;
+    std::chrono::steady_clock::time_point expire;
+    std::list<std::string>::iterator lru;
+  };
+  struct Shard {
+    std::mutex mutex;
+    std::unordered_map<std::string, Entry> entries;
+    std::list<std::string> lru;  // 头部为最近使用
+    std::unordered_map<std::string, std::shared_future<UserDataPtr>> inflight;
+    size_t bytes = 0;
+  };
+
+  UserDataCache();
+
+  UserDataPtr Load(const std::string& user_id, RequestTrace* trace);
+  void Insert(Shard& shard, const std::string& user_id, UserDataPtr data);
+  void Erase(Shard& shard,
+      std::unordered_map<std::string, Entry>::iterator it);
+
+  std::mutex config_mutex_;
+  Options options_;
+  std::vector<std::unique_ptr<Shard>> shards_;
+  std::shared_ptr<const FetchFn> fetch_fn_;
+  std::atomic<size_t> total_bytes_{0};
+};
+
+// 读取server.json中的"user_cache"配置，未配置时不缓存
+bool InitUserDataCache(const nlohmann::json& conf);
+
+}  // end of namespace